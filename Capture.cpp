@@ -0,0 +1,121 @@
+#include "Capture.hpp"
+#include "Serialize.hpp"
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+Capture::Capture() : fd(-1), nextConnection(1) {}
+
+Capture::~Capture() {
+    flush();
+    if (fd >= 0)
+        close(fd);
+}
+
+
+// Appends to an existing capture, so a hot upgrade keeps one file.
+// The connection numbering may already have been restored.
+bool Capture::open(const std::string &path) {
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("Capture open failed");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        buffer = CAPTURE_MAGIC;
+        putU32(buffer, CAPTURE_VERSION);
+    }
+    return true;
+}
+
+bool Capture::isEnabled() const {
+    return fd >= 0;
+}
+
+void Capture::append(uint32_t connection, unsigned char type, const std::string &data) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    putU64(buffer, static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_usec);
+    putU32(buffer, connection);
+    buffer += static_cast<char>(type);
+    putBytes(buffer, data.data(), data.size());
+    if (buffer.size() >= CAPTURE_FLUSH_BYTES)
+        flush();
+}
+
+void Capture::connect(int client_fd) {
+    if (fd < 0)
+        return;
+    uint32_t connection = nextConnection++;
+    connections[client_fd] = connection;
+    append(connection, CAPTURE_OPEN, std::string());
+}
+
+void Capture::record(int client_fd, const std::string &line) {
+    if (fd < 0)
+        return;
+    std::map<int, uint32_t>::iterator it = connections.find(client_fd);
+    if (it == connections.end()) {
+        connect(client_fd);
+        it = connections.find(client_fd);
+    }
+    append(it->second, CAPTURE_LINE, line);
+}
+
+void Capture::disconnect(int client_fd) {
+    std::map<int, uint32_t>::iterator it = connections.find(client_fd);
+    if (fd < 0 || it == connections.end())
+        return;
+    append(it->second, CAPTURE_CLOSE, std::string());
+    connections.erase(it);
+}
+
+// u32 next connection, u32 count, then u32 fd and u32 connection each.
+void Capture::serializeState(std::string &out) const {
+    putU32(out, nextConnection);
+    putU32(out, static_cast<uint32_t>(connections.size()));
+    for (std::map<int, uint32_t>::const_iterator it = connections.begin(); it != connections.end(); ++it) {
+        putU32(out, static_cast<uint32_t>(it->first));
+        putU32(out, it->second);
+    }
+}
+
+// Fds are renumbered on the way through the upgrade; remap maps old to new.
+bool Capture::restoreState(Reader &in, const std::map<int, int> &remap) {
+    uint32_t next, count;
+    if (!in.getU32(next) || !in.getU32(count))
+        return false;
+    nextConnection = next;
+    connections.clear();
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t oldFd, connection;
+        if (!in.getU32(oldFd) || !in.getU32(connection))
+            return false;
+        std::map<int, int>::const_iterator fd = remap.find(static_cast<int>(oldFd));
+        if (fd != remap.end())
+            connections[fd->second] = connection;
+    }
+    return true;
+}
+
+// A failed write drops the buffered records rather than stalling the loop.
+void Capture::flush() {
+    if (fd < 0 || buffer.empty())
+        return;
+    size_t written = 0;
+    while (written < buffer.size()) {
+        ssize_t n = write(fd, buffer.data() + written, buffer.size() - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Capture write failed");
+            break;
+        }
+        written += n;
+    }
+    buffer.clear();
+}
@@ -0,0 +1,53 @@
+#pragma once
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <string>
+#include <map>
+#include <stdint.h>
+
+class Reader;
+
+#define CAPTURE_ENV "IRCSERV_CAPTURE"
+#define CAPTURE_MAGIC "IRCC"
+#define CAPTURE_VERSION 1
+#define CAPTURE_FLUSH_BYTES 65536
+
+#define CAPTURE_OPEN 0
+#define CAPTURE_LINE 1
+#define CAPTURE_CLOSE 2
+
+// Records inbound client traffic for tools/replay. The file is the magic
+// and a u32 version, then records of:
+//   u64 microseconds since the epoch | u32 connection | u8 type | bytes
+// Connections are numbered in the order they are first seen, so a reused
+// fd starts a new connection. Records are buffered and written from the
+// main loop. A hot upgrade hands the numbering to the new process, which
+// keeps appending to the same file.
+class Capture {
+private:
+    int fd;
+    uint32_t nextConnection;
+    std::map<int, uint32_t> connections;
+    std::string buffer;
+
+    Capture(const Capture &);
+    Capture &operator=(const Capture &);
+
+    void append(uint32_t connection, unsigned char type, const std::string &data);
+
+public:
+    Capture();
+    ~Capture();
+
+    bool open(const std::string &path);
+    bool isEnabled() const;
+    void connect(int client_fd);
+    void record(int client_fd, const std::string &line);
+    void disconnect(int client_fd);
+    void flush();
+    void serializeState(std::string &out) const;
+    bool restoreState(Reader &in, const std::map<int, int> &remap);
+};
+
+#endif
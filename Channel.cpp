@@ -1,45 +1,78 @@
 #include "Channel.hpp"
+#include "ChatServer.hpp"
 
-Channel::Channel(std::string channelName) : name(channelName), operator_fd(-1), topicRestricted(false), inviteOnly(false) {}
+Channel::Channel(std::string channelName) : name(channelName), server(NULL), operator_fd(-1), userLimit(0), emptySince(0), topicRestricted(false), inviteOnly(false) {}
 
-Channel::Channel() : name(""), operator_fd(-1) {} 
+Channel::Channel() : name(""), server(NULL), operator_fd(-1), userLimit(0), emptySince(0), topicRestricted(false), inviteOnly(false) {} 
 
 
 void Channel::addMember(int client_fd, const std::string& nickname, const std::string& username) {
+    size_t before = members.size();
     members.insert(client_fd);
-    memberNicknames[client_fd] = nickname;
-    memberUsernames[client_fd] = username;
+    memberNicknames[client_fd] = toPoolString(nickname);
+    memberUsernames[client_fd] = toPoolString(username);
+    emptySince = 0;
+    if (server && members.size() != before) {
+        server->channelResized(name, before, members.size());
+        server->memberJoined(client_fd, name);
+        server->channelChanged();
+    }
 }
 
 
-std::string Channel::getMembersList() {
-    std::string membersList;
-    for (std::set<int>::iterator it = members.begin(); it != members.end(); ++it) {
-        if (operators.find(*it) != operators.end()) {
-            membersList += "@";
+// Writes 353 lines split at MAX_LINE_LENGTH followed by 366 into out.
+void Channel::appendNamesReply(std::string &out, const std::string &nickname) {
+    std::string head = ":irc.localhost 353 " + nickname + " = " + name + " :";
+    size_t lineStart = 0;
+    bool lineEmpty = true;
+
+    for (FdSet::iterator it = members.begin(); it != members.end(); ++it) {
+        FdNickMap::const_iterator nickIt = memberNicknames.find(*it);
+        if (nickIt == memberNicknames.end()) {
+            continue;
+        }
+        bool op = operators.find(*it) != operators.end();
+        size_t entryLen = nickIt->second.size() + (op ? 1 : 0);
+
+        if (!lineEmpty && out.size() - lineStart + 1 + entryLen + 2 > MAX_LINE_LENGTH) {
+            out += "\r\n";
+            lineEmpty = true;
+        }
+        if (lineEmpty) {
+            lineStart = out.size();
+            out += head;
+            lineEmpty = false;
+        } else {
+            out += " ";
+        }
+        if (op) {
+            out += "@";
         }
-        membersList += memberNicknames[*it] + " ";
+        out.append(nickIt->second.data(), nickIt->second.size());
     }
-    if (!membersList.empty()) {
-        membersList.erase(membersList.size() - 1);
+    if (!lineEmpty) {
+        out += "\r\n";
     }
-    return membersList;
+    out += ":irc.localhost 366 " + nickname + " " + name + " :End of /NAMES list\r\n";
 }
 
 
 void Channel::removeMember(int client_fd) {
+    size_t before = members.size();
     members.erase(client_fd);
-    
-    
-    std::string nickname;
-    for (std::map<int, std::string>::const_iterator it = memberNicknames.begin(); it != memberNicknames.end(); ++it) {
-        if (it->first == client_fd) {
-            nickname = it->second;
-            break;
-        }
+    operators.erase(client_fd);
+    banCache.erase(client_fd);
+    if (server && members.size() != before) {
+        server->channelResized(name, before, members.size());
+        server->memberLeft(client_fd, name);
+        server->channelChanged();
     }
-    
-    invitedUsers.erase(nickname);
+    if (members.empty() && before > 0)
+        emptySince = time(NULL);
+
+    FdNickMap::const_iterator nickname = memberNicknames.find(client_fd);
+    if (nickname != memberNicknames.end())
+        invitedUsers.erase(nickname->second);
     
     if (client_fd == operator_fd && !members.empty()) {
         operator_fd = *members.begin();
@@ -50,8 +83,33 @@ void Channel::removeMember(int client_fd) {
 }
 
 
+// Renumbers a member whose connection id changed, keeping its status.
+void Channel::moveMember(int from, int to) {
+    if (!members.erase(from))
+        return;
+    members.insert(to);
+    if (server)
+        server->memberMoved(from, to, name);
+    if (operators.erase(from))
+        operators.insert(to);
+    if (operator_fd == from)
+        operator_fd = to;
+    banCache.erase(from);
+    FdNickMap::iterator nick = memberNicknames.find(from);
+    if (nick != memberNicknames.end()) {
+        memberNicknames[to] = nick->second;
+        memberNicknames.erase(nick);
+    }
+    FdNickMap::iterator user = memberUsernames.find(from);
+    if (user != memberUsernames.end()) {
+        memberUsernames[to] = user->second;
+        memberUsernames.erase(user);
+    }
+}
+
 void Channel::makeOperator(int client_fd) {
-    operators.insert(client_fd);
+    if (operators.insert(client_fd).second && server)
+        server->channelChanged();
 }
 
 bool Channel::isMember(int client_fd) const {
@@ -59,23 +117,16 @@ bool Channel::isMember(int client_fd) const {
     }
 
 
-void Channel::sendMessageToChannel(const std::string& message, int sender_fd) {
-    std::string sender_nickname = memberNicknames[sender_fd];
-    std::string sender_username = memberUsernames[sender_fd];
-
-    std::string ircMessage = ":" + sender_nickname + "!" + sender_username + "@localhost PRIVMSG " + name + " :" + message + "\r\n";
-
-    for (std::set<int>::iterator it = members.begin(); it != members.end(); ++it) {
-        if (*it != sender_fd) {
-            send(*it, ircMessage.c_str(), ircMessage.length(), 0);
-        }
-    }
+// Remote members (negative ids) are reached through server links instead.
+void Channel::sendMessageToChannel(const std::string& ircMessage, int sender_fd) {
+    server->sendToMembers(members, ircMessage, sender_fd);
 }
 
 
 int Channel::getFdByNickname(const std::string &nickname) const {
-    for (std::map<int, std::string>::const_iterator it = memberNicknames.begin(); it != memberNicknames.end(); ++it) {
-        if (it->second == nickname) {
+    PoolString key = toPoolString(nickname);
+    for (FdNickMap::const_iterator it = memberNicknames.begin(); it != memberNicknames.end(); ++it) {
+        if (it->second == key) {
             return it->first;
         }
     }
@@ -84,17 +135,23 @@ int Channel::getFdByNickname(const std::string &nickname) const {
 
 
 void Channel::inviteUser(const std::string& nickname) {
-    invitedUsers.insert(nickname);
+    invitedUsers[toPoolString(nickname)] = time(NULL);
+    if (server) {
+        server->userInvited(nickname, name);
+        server->channelChanged();
+    }
 }
 
 
 void Channel::setTopic(const std::string& newTopic) {
-    topic = newTopic;
+    topic = toPoolString(newTopic);
+    if (server)
+        server->channelChanged();
 }
 
 
 std::string Channel::getTopic() const {
-    return topic;
+    return toStdString(topic);
 }
 
 
@@ -109,13 +166,14 @@ bool Channel::isInviteOnly() const {
 
 
 bool Channel::isInvited(const std::string& nickname) const {
-    return invitedUsers.find(nickname) != invitedUsers.end();
+    InviteMap::const_iterator it = invitedUsers.find(toPoolString(nickname));
+    return it != invitedUsers.end() && time(NULL) - it->second < INVITE_TTL;
 }
 
 
 std::string Channel::getNicknameForFd(int client_fd) {
     if (memberNicknames.find(client_fd) != memberNicknames.end()) {
-        return memberNicknames[client_fd];
+        return toStdString(memberNicknames[client_fd]);
     }
     return "";
 }
@@ -132,9 +190,7 @@ bool Channel::isOperator(int client_fd) const {
 
 
 void Channel::broadcast(const std::string& message) {
-    for (std::set<int>::iterator it = members.begin(); it != members.end(); ++it) {
-        send(*it, message.c_str(), message.size(), 0);
-    }
+    server->sendToMembers(members, message, -1);
 }
 
 
@@ -150,83 +206,319 @@ int Channel::getMemberCount() const
 }
 
 
-void Channel::setMode(const std::string& mode, const std::string& param, int client_fd) {
-    std::string logMessage;
-
-    if (mode == "+i") {
-        inviteOnly = true;
-        logMessage = "Invite-only mode enabled.";
-    } else if (mode == "-i") {
-        inviteOnly = false;
-        logMessage = "Invite-only mode disabled.";
-    } else if (mode == "+t") {
-        topicRestricted = true;
-        logMessage = "Topic-restricted mode enabled.";
-    } else if (mode == "-t") {
-        topicRestricted = false;
-        logMessage = "Topic-restricted mode disabled.";
-    } else if (mode == "+k") {
-        if (param.empty()) {
-            std::string errorMsg = ":irc.localhost 461 " + getNicknameForFd(client_fd) +
-                                   " MODE :Not enough parameters for +k\r\n";
-            send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
-            return;
-        }
-        channelKey = param;
-        logMessage = "Password set: " + channelKey;
-    } else if (mode == "-k") {
-        channelKey = "";
-        logMessage = "Password removed.";
-    } else if (mode == "+o") {
-        int user_fd = getFdByNickname(param);
-        if (user_fd == -1) {
-            std::string errorMsg = ":irc.localhost 401 " + getNicknameForFd(client_fd) +
-                                " " + param + " :No such nick/channel\r\n";
-            send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
-            return;
-        }
-        operators.insert(user_fd);
-        std::string modeMsg = ":" + getNicknameForFd(client_fd) + "!" + getNicknameForFd(client_fd) +
-                            "@localhost MODE " + name + " +o " + param + "\r\n";
-        broadcast(modeMsg);
-        logMessage = "User " + param + " is now an operator.";
-    } else if (mode == "-o") {
-        int user_fd = getFdByNickname(param);
+static std::string hostmask(const Client &client) {
+    return client.getNickname() + "!" + client.getUsername() + "@localhost";
+}
+
+// Banned and not excepted. Results for members are cached until the
+// member's nick or user changes or any of the lists changes.
+bool Channel::isBanned(const Client &client) {
+    if (bans.empty())
+        return false;
+    int id = client.getFd();
+    std::map<int, std::pair<unsigned long, bool> >::iterator cached = banCache.find(id);
+    if (cached != banCache.end() && cached->second.first == client.getIdentity())
+        return cached->second.second;
+
+    std::string mask = hostmask(client);
+    bool banned = bans.matches(mask) && !exceptions.matches(mask);
+    if (isMember(id))
+        banCache[id] = std::make_pair(client.getIdentity(), banned);
+    return banned;
+}
+
+bool Channel::isInvexed(const Client &client) const {
+    return invexes.matches(hostmask(client));
+}
+
+// Whether the snapshot keeps anything for this channel beyond its name.
+bool Channel::hasPersistentState() const {
+    return !topic.empty() || !channelKey.empty() || userLimit || topicRestricted || inviteOnly ||
+           !bans.empty() || !exceptions.empty() || !invexes.empty() || !savedOperators.empty();
+}
+
+void Channel::appendMaskList(std::string &out, const std::string &nickname, char list) const {
+    const MaskList &masks = list == 'b' ? bans : list == 'e' ? exceptions : invexes;
+    const char *entry = list == 'b' ? " 367 " : list == 'e' ? " 348 " : " 346 ";
+    const char *end = list == 'b' ? " 368 " : list == 'e' ? " 349 " : " 347 ";
+    const char *what = list == 'b' ? "ban" : list == 'e' ? "exception" : "invite";
+
+    for (size_t i = 0; i < masks.entries().size(); i++) {
+        const CompiledMask &m = masks.entries()[i];
+        std::ostringstream line;
+        line << ":irc.localhost" << entry << nickname << " " << name << " " << m.text << " "
+             << m.setter << " " << m.setAt << "\r\n";
+        out += line.str();
+    }
+    out += ":irc.localhost" + std::string(end) + nickname + " " + name +
+           " :End of channel " + what + " list\r\n";
+}
+
+
+// Each list: u32 count, then mask, setter and u64 set time per entry.
+void Channel::serializeMasks(std::string &out) const {
+    const MaskList *lists[3] = { &bans, &exceptions, &invexes };
+    for (int l = 0; l < 3; l++) {
+        const std::vector<CompiledMask> &entries = lists[l]->entries();
+        putU32(out, static_cast<uint32_t>(entries.size()));
+        for (size_t i = 0; i < entries.size(); i++) {
+            putString(out, entries[i].text);
+            putString(out, entries[i].setter);
+            putU64(out, static_cast<uint64_t>(entries[i].setAt));
+        }
+    }
+}
+
+bool Channel::restoreMasks(Reader &in) {
+    MaskList *lists[3] = { &bans, &exceptions, &invexes };
+    for (int l = 0; l < 3; l++) {
+        uint32_t count;
+        if (!in.getU32(count))
+            return false;
+        for (uint32_t i = 0; i < count; i++) {
+            std::string mask, setter;
+            uint64_t setAt;
+            if (!in.getBytes(mask) || !in.getBytes(setter) || !in.getU64(setAt))
+                return false;
+            lists[l]->add(mask, setter, static_cast<time_t>(setAt));
+        }
+    }
+    banCache.clear();
+    return true;
+}
+
+
+// Splits a mode string into individual changes. b, e, I and o always take
+// a parameter, k and l only when set; -k accepts and ignores one. Unknown
+// letters get 472. Changes past MAX_MODE_CHANGES, the MODES= value in 005,
+// are dropped and reported once with a FAIL.
+std::vector<ModeChange> Channel::parseModes(const std::string &modes, const std::vector<std::string> &params,
+                                            int client_fd) {
+    std::vector<ModeChange> changes;
+    size_t next = 0;
+    size_t dropped = 0;
+    char sign = '+';
+
+    for (size_t i = 0; i < modes.size(); i++) {
+        char mode = modes[i];
+        if (mode == '+' || mode == '-') {
+            sign = mode;
+            continue;
+        }
+        if (std::string("itklobeI").find(mode) == std::string::npos) {
+            std::string errorMsg = ":irc.localhost 472 " + getNicknameForFd(client_fd) + " " +
+                                   std::string(1, mode) + " :is unknown mode char for " + name + "\r\n";
+            server->sendToClient(client_fd, errorMsg);
+            continue;
+        }
+
+        ModeChange change;
+        change.sign = sign;
+        change.mode = mode;
+        bool takesParam = std::string("obeI").find(mode) != std::string::npos ||
+                          (sign == '+' && (mode == 'k' || mode == 'l'));
+        if (takesParam) {
+            if (next >= params.size()) {
+                if (std::string("beI").find(mode) == std::string::npos) {
+                    std::string errorMsg = ":irc.localhost 461 " + getNicknameForFd(client_fd) +
+                                           " MODE :Not enough parameters for " + sign + mode + "\r\n";
+                    server->sendToClient(client_fd, errorMsg);
+                }
+                continue;
+            }
+            change.param = params[next++];
+        } else if (sign == '-' && mode == 'k' && next < params.size()) {
+            next++;
+        }
+        if (changes.size() < MAX_MODE_CHANGES)
+            changes.push_back(change);
+        else
+            dropped++;
+    }
+    if (dropped) {
+        std::ostringstream errorMsg;
+        errorMsg << ":irc.localhost FAIL MODE TOO_MANY_CHANGES " << name << " :Only " << MAX_MODE_CHANGES
+                 << " mode changes are allowed per command, " << dropped << " ignored\r\n";
+        server->sendToClient(client_fd, errorMsg.str());
+    }
+    return changes;
+}
+
+
+bool Channel::applyMode(ModeChange &change, int client_fd) {
+    bool adding = change.sign == '+';
+    std::string nick = getNicknameForFd(client_fd);
+
+    switch (change.mode) {
+    case 'i':
+        if (inviteOnly == adding)
+            return false;
+        inviteOnly = adding;
+        return true;
+    case 't':
+        if (topicRestricted == adding)
+            return false;
+        topicRestricted = adding;
+        return true;
+    case 'k':
+        if (!adding) {
+            if (channelKey.empty())
+                return false;
+            channelKey = "";
+            return true;
+        }
+        channelKey = change.param;
+        return true;
+    case 'l':
+        if (!adding) {
+            if (userLimit == 0)
+                return false;
+            userLimit = 0;
+            return true;
+        }
+        if (atoi(change.param.c_str()) <= 0) {
+            std::string errorMsg = ":irc.localhost 461 " + nick + " MODE :Invalid parameter for +l\r\n";
+            server->sendToClient(client_fd, errorMsg);
+            return false;
+        }
+        userLimit = atoi(change.param.c_str());
+        return true;
+    case 'o': {
+        int user_fd = getFdByNickname(change.param);
         if (user_fd == -1) {
-            std::string errorMsg = ":irc.localhost 401 " + getNicknameForFd(client_fd) +
-                                   " " + param + " :No such nick/channel\r\n";
-            send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
-            return;
+            std::string errorMsg = ":irc.localhost 401 " + nick + " " + change.param +
+                                   " :No such nick/channel\r\n";
+            server->sendToClient(client_fd, errorMsg);
+            return false;
+        }
+        if (adding) {
+            return operators.insert(user_fd).second;
         }
         if (operators.find(client_fd) != operators.end() && client_fd != user_fd) {
-            std::string errorMsg = ":irc.localhost 482 " + getNicknameForFd(client_fd) +
-                                   " " + name + " :You cannot remove another operator\r\n";
-            send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
-            return;
-        }
-        operators.erase(user_fd);
-        std::string demoteMsg = ":irc.localhost 341 " + getNicknameForFd(client_fd) + " " + param + " " + name + " :Operator privileges removed\r\n";
-        send(user_fd, demoteMsg.c_str(), demoteMsg.size(), 0);
-        logMessage = "User " + param + " is no longer an operator.";
-    } else if (mode == "+l") {
-        if (param.empty() || atoi(param.c_str()) <= 0) {
-            std::string errorMsg = ":irc.localhost 461 " + getNicknameForFd(client_fd) +
-                                   " MODE :Invalid parameter for +l\r\n";
-            send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
-            return;
-        }
-        userLimit = atoi(param.c_str());
-        logMessage = "User limit set to " + param;
-    } else if (mode == "-l") {
-        userLimit = 0;
-        logMessage = "User limit removed.";
-    } else {
-        std::string errorMsg = ":irc.localhost 472 " + getNicknameForFd(client_fd) +
-                               " " + mode + " :is unknown mode char for " + name + "\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
-        return;
+            std::string errorMsg = ":irc.localhost 482 " + nick + " " + name +
+                                   " :You cannot remove another operator\r\n";
+            server->sendToClient(client_fd, errorMsg);
+            return false;
+        }
+        return operators.erase(user_fd) > 0;
+    }
+    default: {
+        MaskList &list = change.mode == 'b' ? bans : change.mode == 'e' ? exceptions : invexes;
+        change.param = normalizeMask(change.param);
+        if (adding) {
+            if (list.size() >= MAX_LIST_MASKS) {
+                std::string errorMsg = ":irc.localhost 478 " + nick + " " + name + " " + change.param +
+                                       " :Channel list is full\r\n";
+                server->sendToClient(client_fd, errorMsg);
+                return false;
+            }
+            if (!list.add(change.param, nick, time(NULL)))
+                return false;
+        } else if (!list.remove(change.param)) {
+            return false;
+        }
+        banCache.clear();
+        return true;
+    }
+    }
+}
+
+
+// Applies every change that is valid and returns them as one mode string
+// with parameters, e.g. "+ook-l a b key", or "" when nothing changed.
+std::string Channel::applyModes(std::vector<ModeChange> &changes, int client_fd) {
+    std::string flags, args;
+    char sign = 0;
+    for (size_t i = 0; i < changes.size(); i++) {
+        if (!applyMode(changes[i], client_fd))
+            continue;
+        if (changes[i].sign != sign) {
+            sign = changes[i].sign;
+            flags += sign;
+        }
+        flags += changes[i].mode;
+        if (!changes[i].param.empty() && !(sign == '-' && changes[i].mode == 'k'))
+            args += " " + changes[i].param;
+        std::cout << "Setting mode " << sign << changes[i].mode << " on channel " << name << std::endl;
     }
-    if (!logMessage.empty()) {
-        std::cout << "Setting mode " << mode << " on channel " << name << ": " << logMessage << std::endl;
+    if (server && !flags.empty())
+        server->channelChanged();
+    return flags.empty() ? "" : flags + args;
+}
+
+
+// The 324 reply. The key is only shown to members.
+std::string Channel::modeString(bool showKey) const {
+    std::string flags = "+";
+    std::string args;
+    if (inviteOnly)
+        flags += 'i';
+    if (topicRestricted)
+        flags += 't';
+    if (!channelKey.empty()) {
+        flags += 'k';
+        args += " " + (showKey ? channelKey : std::string("*"));
+    }
+    if (userLimit > 0) {
+        std::ostringstream limit;
+        limit << userLimit;
+        flags += 'l';
+        args += " " + limit.str();
     }
+    return flags + args;
+}
+
+
+size_t Channel::memoryUsage() const {
+    size_t total = sizeof(Channel) + stringHeapBytes(name) + stringHeapBytes(topic) +
+                   stringHeapBytes(channelKey);
+
+    total += (members.size() + operators.size()) * treeNodeBytes<int>();
+    total += invitedUsers.size() * treeNodeBytes<InviteMap::value_type>();
+    total += savedOperators.size() * treeNodeBytes<PoolString>();
+    for (InviteMap::const_iterator it = invitedUsers.begin(); it != invitedUsers.end(); ++it) {
+        total += stringHeapBytes(it->first);
+    }
+    total += bans.memoryUsage() + exceptions.memoryUsage() + invexes.memoryUsage();
+    total += banCache.size() * treeNodeBytes<std::pair<const int, std::pair<unsigned long, bool> > >();
+    total += (memberNicknames.size() + memberUsernames.size()) * treeNodeBytes<FdNickMap::value_type>();
+    for (FdNickMap::const_iterator it = memberNicknames.begin(); it != memberNicknames.end(); ++it) {
+        total += stringHeapBytes(it->second);
+    }
+    for (FdNickMap::const_iterator it = memberUsernames.begin(); it != memberUsernames.end(); ++it) {
+        total += stringHeapBytes(it->second);
+    }
+    return total;
+}
+
+
+void Channel::addMemoryStats(MemoryStats &stats) const {
+    stats.channels.count++;
+    stats.channels.bytes += sizeof(Channel) + stringHeapBytes(name) + stringHeapBytes(channelKey) +
+                            savedOperators.size() * treeNodeBytes<PoolString>() +
+                            banCache.size() * treeNodeBytes<std::pair<const int, std::pair<unsigned long, bool> > >();
+
+    stats.members.count += members.size();
+    stats.members.bytes += (members.size() + operators.size()) * treeNodeBytes<int>() +
+                           (memberNicknames.size() + memberUsernames.size()) * treeNodeBytes<FdNickMap::value_type>();
+    for (FdNickMap::const_iterator it = memberNicknames.begin(); it != memberNicknames.end(); ++it)
+        stats.members.bytes += stringHeapBytes(it->second);
+    for (FdNickMap::const_iterator it = memberUsernames.begin(); it != memberUsernames.end(); ++it)
+        stats.members.bytes += stringHeapBytes(it->second);
+
+    stats.invites.count += invitedUsers.size();
+    stats.invites.bytes += invitedUsers.size() * treeNodeBytes<InviteMap::value_type>();
+    for (InviteMap::const_iterator it = invitedUsers.begin(); it != invitedUsers.end(); ++it)
+        stats.invites.bytes += stringHeapBytes(it->first);
+
+    if (!topic.empty()) {
+        stats.topics.count++;
+        stats.topics.bytes += stringHeapBytes(topic);
+    }
+
+    stats.masks.count += bans.size() + exceptions.size() + invexes.size();
+    stats.masks.bytes += bans.memoryUsage() + exceptions.memoryUsage() + invexes.memoryUsage();
+
+    stats.history.count += history.size();
+    stats.history.bytes += history.getBytes();
 }
@@ -5,32 +5,60 @@
 #include <iostream>
 #include <sstream>
 #include <set>
+#include <map>
+#include "Pool.hpp"
+#include "History.hpp"
 #include "Client.hpp"
-#include "ChatServer.hpp"
+#include "Mask.hpp"
+#include "MemStats.hpp"
 
 class Client;
 class ChatServer;
 
+#define MAX_MODE_CHANGES 6
+#define INVITE_TTL 3600
+
+struct ModeChange {
+    char sign;
+    char mode;
+    std::string param;
+};
+
+typedef std::set<int, std::less<int>, PoolAllocator<int> > FdSet;
+typedef std::set<PoolString, std::less<PoolString>, PoolAllocator<PoolString> > NickSet;
+typedef std::map<int, PoolString, std::less<int>, PoolAllocator<std::pair<const int, PoolString> > > FdNickMap;
+typedef std::map<PoolString, time_t, std::less<PoolString>, PoolAllocator<std::pair<const PoolString, time_t> > >
+    InviteMap;
+
 class Channel {
 public:
     std::string name;
-    std::set<int> members;
-    std::set<std::string> invitedUsers;
-    std::set<int> operators;
-    std::map<int, std::string> memberNicknames;
-    std::map<int, std::string> memberUsernames;
-    std::string topic;
+    FdSet members;
+    InviteMap invitedUsers;
+    NickSet savedOperators;
+    FdSet operators;
+    FdNickMap memberNicknames;
+    FdNickMap memberUsernames;
+    PoolString topic;
+    ChannelHistory history;
     std::string channelKey;
+    ChatServer *server;
     int operator_fd;
     int userLimit;
+    time_t emptySince;
     bool topicRestricted;
     bool inviteOnly;
+    MaskList bans;
+    MaskList exceptions;
+    MaskList invexes;
+    std::map<int, std::pair<unsigned long, bool> > banCache;
 
     Channel(std::string channelName);
     Channel();
     void addMember(int client_fd, const std::string& nickname, const std::string& username);
-    std::string getMembersList();
+    void appendNamesReply(std::string &out, const std::string &nickname);
     void removeMember(int client_fd);
+    void moveMember(int from, int to);
     void makeOperator(int client_fd);
     bool isMember(int client_fd) const;
     void sendMessageToChannel(const std::string &message, int sender_fd);
@@ -47,7 +75,19 @@ public:
     void broadcast(const std::string& message);
     int getUserLimit() const;
     int getMemberCount() const;
-    void setMode(const std::string& mode, const std::string& param, int client_fd);
+    bool isBanned(const Client &client);
+    bool isInvexed(const Client &client) const;
+    bool hasPersistentState() const;
+    void serializeMasks(std::string &out) const;
+    bool restoreMasks(Reader &in);
+    void appendMaskList(std::string &out, const std::string &nickname, char list) const;
+    std::vector<ModeChange> parseModes(const std::string &modes, const std::vector<std::string> &params,
+                                       int client_fd);
+    bool applyMode(ModeChange &change, int client_fd);
+    std::string applyModes(std::vector<ModeChange> &changes, int client_fd);
+    std::string modeString(bool showKey) const;
+    size_t memoryUsage() const;
+    void addMemoryStats(MemoryStats &stats) const;
 };
 
 
@@ -1,38 +1,51 @@
 #include "ChatServer.hpp"
+#include <sys/time.h>
+#include <cctype>
+
+ChatServer::ChatServer(const std::string &password)
+        : serverPassword(password), nextMsgId(1), historyBytes(0),
+          snapshotPid(-1), snapshotDirty(false), lastSnapshot(time(NULL)),
+          serverName("irc.localhost"), nextRemoteId(-2), lastLinkAttempt(0),
+          persistent(false), queriesRunnable(false), nextMemoryId(MEMORY_ID_BASE), peerEvent(0),
+          inputBytes(0), memorySoftLimit(MEMORY_SOFT_LIMIT), memoryHardLimit(MEMORY_HARD_LIMIT),
+          lastPressure(MEMORY_OK), loadLevel(LOAD_NORMAL), lagAverageUs(0), loadStats(),
+          nextScheduled(0), startedAt(time(NULL)), welcomeBytes(0), lastParkSweep(0),
+          reclaimStats(), lastReclaim(time(NULL)) {
+    loadStats.lastChange = time(NULL);
+}
 
-ChatServer::ChatServer(int port, const std::string &password) 
-        : serverPassword(password), serverPort(port) {
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        std::perror("Socket failed");
-        exit(1);
-    }
-
-    setNonBlocking(server_fd);
-
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(serverPort);
 
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        exit(1);
+// Takes over a hot upgrade handoff if there is one, otherwise opens the
+// listeners and loads the channel snapshot.
+bool ChatServer::start(const std::vector<std::string> &listenSpecs) {
+    persistent = true;
+    loadMotd();
+    if (resumeFromUpgrade()) {
+        startFanout();
+        searchIndex.start();
+        return true;
     }
 
-    if (listen(server_fd, MAX_CLIENTS) < 0) {
-        perror("Listen failed");
-        exit(1);
+    for (size_t i = 0; i < listenSpecs.size(); i++) {
+        if (!listenOn(listenSpecs[i])) {
+            closeListeners();
+            return false;
+        }
     }
+    loadSnapshot();
+    startFanout();
+    searchIndex.start();
+
+    std::cout << "Server started with " << listeners.size() << " listeners" << std::endl;
+    return true;
+}
 
-    pollfd pfd;
-    pfd.fd = server_fd;
-    pfd.events = POLLIN;
-    fds.push_back(pfd);
 
-    std::cout << "Server started on port " << serverPort << std::endl;
+// Runs without a listener or snapshot, for driving the server through
+// attachConnection() and openMemoryConnection().
+void ChatServer::startInProcess() {
+    startFanout();
+    searchIndex.start();
 }
 
 
@@ -43,57 +56,374 @@ void ChatServer::setNonBlocking(int fd) {
 }
 
 
+void ChatServer::enableCapture(const std::string &path) {
+    if (capture.open(path)) {
+        std::cout << "Capturing client traffic to " << path << std::endl;
+    }
+}
+
+
 ChatServer::~ChatServer() {
+    outbox.stop();
+    closeListeners();
     for (size_t i = 0; i < fds.size(); i++) {
         close(fds[i].fd);
     }
 }
 
 void ChatServer::run() {
-    while (true) {
-        int ret = poll(&fds[0], fds.size(), -1);
-        if (ret < 0) {
-            perror("Poll error");
-            break;
+    while (step(POLL_TIMEOUT_MS))
+        ;
+}
+
+// One pass of the event loop. Returns false if poll() failed for good.
+bool ChatServer::step(int timeoutMs) {
+    if (loadLevel != LOAD_NORMAL && timeoutMs > LOAD_POLL_MS)
+        timeoutMs = LOAD_POLL_MS;
+    // Postponed clients wait for the load to drop, not for the next tick.
+    if (queriesRunnable || inputBacklog.size() > inputPostponed.size())
+        timeoutMs = 0;
+    struct timeval pollStart;
+    gettimeofday(&pollStart, NULL);
+    int ret = poll(fds.empty() ? NULL : &fds[0], fds.size(), timeoutMs);
+    if (ret < 0) {
+        if (errno == EINTR) {
+            if (reloadRequested) {
+                reloadRequested = 0;
+                loadMotd();
+            }
+            if (upgradeRequested) {
+                performUpgrade();
+            }
+            return true;
         }
+        perror("Poll error");
+        return false;
+    }
+    struct timeval busyStart;
+    gettimeofday(&busyStart, NULL);
+    // A poll that timed out should have returned after timeoutMs; anything
+    // past that is time the process was not scheduled.
+    long lateUs = 0;
+    if (ret == 0 && timeoutMs > 0) {
+        lateUs = (busyStart.tv_sec - pollStart.tv_sec) * 1000000L + (busyStart.tv_usec - pollStart.tv_usec) -
+                 timeoutMs * 1000L;
+        if (lateUs < 0)
+            lateUs = 0;
+    }
 
-        for (size_t i = 0; i < fds.size(); i++) {
-            if (fds[i].revents & POLLIN) {
-                if (fds[i].fd == server_fd) {
-                    handleNewConnection();
-                } else {
-                    handleClientMessage(fds[i].fd);
-                }
+    for (size_t i = 0; i < fds.size(); i++) {
+        int fd = fds[i].fd;
+        short revents = fds[i].revents;
+        if (revents & POLLOUT) {
+            flushClientOutput(fd);
+        }
+        const Listener *listener = revents ? findListener(fd) : NULL;
+        if ((revents & (POLLERR | POLLHUP)) && !(revents & POLLIN) && !listener) {
+            handleClientDisconnect(fd);
+            continue;
+        }
+        if ((revents & POLLIN) && i < fds.size() && fds[i].fd == fd) {
+            if (listener) {
+                handleNewConnection(*listener);
+            } else if (fd == outbox.wakeupFd()) {
+                resumeBlockedOutput();
+            } else {
+                handleClientMessage(fd);
             }
         }
     }
-}
 
-void ChatServer::handleNewConnection() {
-    struct sockaddr_in client_addr;
+    dropOverflowedClients();
+    runScheduler();
+    queriesRunnable = runCursors();
+    capture.flush();
 
-    socklen_t client_len = sizeof(client_addr);
-    int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
-    if (client_fd < 0) {
-        perror("Accept failed");
-        return;
+    if (reloadRequested) {
+        reloadRequested = 0;
+        loadMotd();
+    }
+    if (upgradeRequested) {
+        performUpgrade();
+    }
+
+    if (!linkTargets.empty()) {
+        connectLinks();
+    }
+    if (!parkedClients.empty()) {
+        expireParkedClients(false);
+    }
+    if (time(NULL) - lastReclaim >= RECLAIM_INTERVAL) {
+        reclaimState();
+        lastReclaim = time(NULL);
     }
-    setNonBlocking(client_fd);
 
-    std::cout << "New client connected: " << inet_ntoa(client_addr.sin_addr) << std::endl;
+    if (persistent) {
+        reapSnapshot();
+        time_t now = time(NULL);
+        if (now - lastSnapshot >= SNAPSHOT_INTERVAL) {
+            startSnapshot();
+            lastSnapshot = now;
+        }
+    }
 
-    std::string passwordPrompt = ":irc.localhost NOTICE * :Please enter the password using PASS <password>.\r\n";
-    send(client_fd, passwordPrompt.c_str(), passwordPrompt.size(), 0);
+    struct timeval busyEnd;
+    gettimeofday(&busyEnd, NULL);
+    recordLoopLag(lateUs + (busyEnd.tv_sec - busyStart.tv_sec) * 1000000L + (busyEnd.tv_usec - busyStart.tv_usec),
+                  (busyEnd.tv_sec - pollStart.tv_sec) * 1000000L + (busyEnd.tv_usec - pollStart.tv_usec));
+    return true;
+}
 
+// Adopts an already connected socket, e.g. one end of a socketpair.
+int ChatServer::attachConnection(int client_fd) {
+    setNonBlocking(client_fd);
     pollfd new_pollfd;
     new_pollfd.fd = client_fd;
     new_pollfd.events = POLLIN;
     new_pollfd.revents = 0;
 
     fds.push_back(new_pollfd);
+    outbox.attach(client_fd);
+    registerConnection(client_fd);
+    return client_fd;
+}
+
+// Opens a connection with no socket behind it. Input arrives through
+// feed() and output is collected with takeOutput().
+int ChatServer::openMemoryConnection() {
+    if (memoryPressure() == MEMORY_HARD) {
+        return -1;
+    }
+    int id = takeMemoryId();
+    outbox.attach(id, true);
+    registerConnection(id);
+    return id;
+}
+
+// In-memory ids index the outbox's slot table, so freed ones are handed out
+// again before the table grows.
+int ChatServer::takeMemoryId() {
+    if (freeMemoryIds.empty())
+        return nextMemoryId++;
+    int id = freeMemoryIds.back();
+    freeMemoryIds.pop_back();
+    return id;
+}
+
+void ChatServer::releaseMemoryId(int id) {
+    if (id >= MEMORY_ID_BASE)
+        freeMemoryIds.push_back(id);
+}
+
+void ChatServer::registerConnection(int client_fd) {
+    capture.connect(client_fd);
     Client newClient(client_fd);
     newClient.setAuthenticated(false);
     clients[client_fd] = newClient;
+
+    std::string passwordPrompt = ":irc.localhost NOTICE * :Please enter the password using PASS <password>.\r\n";
+    sendToClient(client_fd, passwordPrompt);
+}
+
+// Runs one quantum of the fed lines at once; the rest wait for step().
+void ChatServer::feed(int client_fd, const std::string &data) {
+    if (clients.find(client_fd) != clients.end()) {
+        handleInput(client_fd, data);
+        serveInput(client_fd);
+    }
+}
+
+std::string ChatServer::takeOutput(int client_fd) {
+    return outbox.takeOutput(client_fd);
+}
+
+void ChatServer::closeConnection(int client_fd) {
+    if (clients.find(client_fd) != clients.end()) {
+        handleClientDisconnect(client_fd);
+    }
+}
+
+void ChatServer::sendToClient(int client_fd, const std::string &message) {
+    std::map<int, Client>::iterator it = clients.find(client_fd);
+    if (it == clients.end()) {
+        return;
+    }
+    if (it->second.isRemote()) {
+        sendToClient(it->second.getLinkFd(), message);
+        return;
+    }
+    if (outbox.push(client_fd, message)) {
+        setPollOut(client_fd, true);
+    }
+}
+
+// Large channels are handed to the fan-out workers so the loop keeps going.
+void ChatServer::sendToMembers(const FdSet &members, const std::string &message, int except_fd) {
+    if (members.size() < FANOUT_THRESHOLD || !outbox.isThreaded()) {
+        for (FdSet::const_iterator it = members.begin(); it != members.end(); ++it) {
+            if (*it != except_fd && *it >= 0) {
+                sendToClient(*it, message);
+            }
+        }
+        return;
+    }
+
+    std::vector<int> targets;
+    targets.reserve(members.size());
+    for (FdSet::const_iterator it = members.begin(); it != members.end(); ++it) {
+        if (*it != except_fd && *it >= 0) {
+            targets.push_back(*it);
+        }
+    }
+    outbox.fanout(targets, SharedLine(message));
+}
+
+// Per-client index of joined channels, kept by Channel as members come and
+// go, so QUIT and NICK fan-out never walks the whole channel map.
+void ChatServer::memberJoined(int id, const std::string &name) {
+    joinedChannels[id].insert(name);
+}
+
+void ChatServer::memberLeft(int id, const std::string &name) {
+    std::map<int, std::set<std::string> >::iterator joined = joinedChannels.find(id);
+    if (joined == joinedChannels.end())
+        return;
+    joined->second.erase(name);
+    if (joined->second.empty())
+        joinedChannels.erase(joined);
+}
+
+void ChatServer::memberMoved(int from, int to, const std::string &name) {
+    memberLeft(from, name);
+    memberJoined(to, name);
+}
+
+// Invites are keyed by nick; this index lets a nick change or quit drop
+// them without visiting every channel.
+void ChatServer::userInvited(const std::string &nick, const std::string &name) {
+    invitesByNick[nick].insert(name);
+}
+
+// Sends line once to every local client sharing a channel with id, and to
+// id itself if includeSelf. In the same pass id is dropped from each of its
+// channels, or renamed there when newNick is given, and invites to its old
+// nick lapse. Peers already reached carry the event number, so no set is
+// built.
+void ChatServer::notifyPeers(int id, const std::string &line, bool includeSelf, const std::string *newNick) {
+    unsigned long event = ++peerEvent;
+    peerTargets.clear();
+    std::map<int, Client>::iterator self = clients.find(id);
+    PoolString oldNick;
+    if (self != clients.end()) {
+        self->second.markPeer(event);
+        if (includeSelf && id >= 0)
+            peerTargets.push_back(id);
+        oldNick = toPoolString(self->second.getNickname());
+    }
+
+    std::map<std::string, std::set<std::string> >::iterator invites = invitesByNick.find(toStdString(oldNick));
+    if (invites != invitesByNick.end()) {
+        for (std::set<std::string>::iterator n = invites->second.begin(); n != invites->second.end(); ++n) {
+            ChannelMap::iterator chan = channels.find(*n);
+            if (chan != channels.end())
+                chan->second.invitedUsers.erase(oldNick);
+        }
+        invitesByNick.erase(invites);
+    }
+
+    // removeMember() edits the joined set, so walk a copy of it.
+    std::map<int, std::set<std::string> >::iterator joined = joinedChannels.find(id);
+    std::vector<std::string> names;
+    if (joined != joinedChannels.end())
+        names.assign(joined->second.begin(), joined->second.end());
+    for (size_t i = 0; i < names.size(); i++) {
+        ChannelMap::iterator it = channels.find(names[i]);
+        if (it == channels.end())
+            continue;
+        Channel &chan = it->second;
+        for (FdSet::iterator m = chan.members.begin(); m != chan.members.end(); ++m) {
+            if (*m < 0)
+                continue;
+            std::map<int, Client>::iterator peer = clients.find(*m);
+            if (peer != clients.end() && peer->second.markPeer(event))
+                peerTargets.push_back(*m);
+        }
+        if (newNick)
+            chan.memberNicknames[id] = toPoolString(*newNick);
+        else
+            chan.removeMember(id);
+    }
+
+    sendToTargets(peerTargets, SharedLine(line));
+}
+
+// Large target lists go to the fan-out workers, like sendToMembers.
+void ChatServer::sendToTargets(const std::vector<int> &targets, const SharedLine &line) {
+    if (targets.size() < FANOUT_THRESHOLD || !outbox.isThreaded()) {
+        for (size_t i = 0; i < targets.size(); i++)
+            sendToClient(targets[i], line.str());
+    } else {
+        outbox.fanout(targets, line);
+    }
+}
+
+void ChatServer::flushClientOutput(int client_fd) {
+    setPollOut(client_fd, outbox.flush(client_fd));
+}
+
+void ChatServer::startFanout() {
+    outbox.start(FANOUT_THREADS);
+    if (outbox.wakeupFd() < 0) {
+        return;
+    }
+    pollfd pfd;
+    pfd.fd = outbox.wakeupFd();
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    fds.push_back(pfd);
+}
+
+void ChatServer::resumeBlockedOutput() {
+    std::vector<int> blocked;
+    outbox.collectBlocked(blocked);
+    for (size_t i = 0; i < blocked.size(); i++) {
+        if (clients.find(blocked[i]) != clients.end()) {
+            setPollOut(blocked[i], true);
+        }
+    }
+}
+
+// Connections that stopped reading until their backlog passed
+// SENDQ_MAX_BYTES are closed like a quit.
+void ChatServer::dropOverflowedClients() {
+    std::vector<int> overflowed;
+    outbox.collectOverflowed(overflowed);
+    for (size_t i = 0; i < overflowed.size(); i++) {
+        std::map<int, Client>::iterator it = clients.find(overflowed[i]);
+        if (it == clients.end())
+            continue;
+        std::cout << "SendQ exceeded (fd=" << overflowed[i] << ")\n";
+        if (links.find(overflowed[i]) == links.end() && it->second.hasSentWelcome() &&
+            !it->second.isQuitAnnounced()) {
+            std::string quitLine = userPrefix(it->second) + " QUIT :SendQ exceeded\r\n";
+            notifyPeers(overflowed[i], quitLine, false, NULL);
+            propagate(quitLine, -1);
+            it->second.setQuitAnnounced(true);
+        }
+        handleClientDisconnect(overflowed[i]);
+    }
+}
+
+void ChatServer::setPollOut(int client_fd, bool enabled) {
+    for (std::vector<pollfd>::iterator it = fds.begin(); it != fds.end(); ++it) {
+        if (it->fd == client_fd) {
+            if (enabled)
+                it->events |= POLLOUT;
+            else
+                it->events &= ~POLLOUT;
+            break;
+        }
+    }
 }
 
 void ChatServer::handleClientMessage(int client_fd) {
@@ -109,34 +439,113 @@ void ChatServer::handleClientMessage(int client_fd) {
         return;
     }
 
+    handleInput(client_fd, std::string(buffer, bytes_read));
+}
+
+// Lines are captured as they arrive, so replay keeps the client's timing
+// even when the loop runs them later.
+void ChatServer::handleInput(int client_fd, const std::string &data) {
     Client &client = clients[client_fd];
-    std::string data(buffer, bytes_read);
+    size_t known = client.lineCount();
     client.appendToBuffer(data);
+    inputBytes += data.size();
+    inputBacklog.insert(client_fd);
+    if (!capture.isEnabled())
+        return;
+    std::string line;
+    for (size_t i = known; i < client.lineCount(); i++) {
+        client.copyLine(i, line);
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        capture.record(client_fd, line);
+    }
+}
 
-    while (true) {
-        size_t pos = client.getBuffer().find('\n');
-        if (pos == std::string::npos) {
-            break;
+// Runs the complete lines in a client's buffer, up to the line budget;
+// links have none. Returns true if lines are left for a later tick.
+bool ChatServer::drainInput(int client_fd) {
+    bool link = links.find(client_fd) != links.end();
+    size_t budget = link ? 0 : lineBudget();
+    inputPostponed.erase(client_fd);
+    std::string message;
+    unsigned char flags;
+    for (size_t handled = 0; ; handled++) {
+        std::map<int, Client>::iterator it = clients.find(client_fd);
+        if (it == clients.end() || !it->second.peekLine(message, flags)) {
+            return false;
+        }
+        if (budget && handled == budget) {
+            loadStats.throttled++;
+            return true;
         }
-        std::string message = client.getBuffer().substr(0, pos);
-        client.clearBuffer(pos);
         if (!message.empty() && message[message.size() - 1] == '\r') {
             message.erase(message.size() - 1);
         }
-        processCompleteMessage(client_fd, message);
+        if (budget && shouldPostpone(message)) {
+            if (!inputPaused.count(client_fd))
+                loadStats.postponed++;
+            inputPostponed.insert(client_fd);
+            return true;
+        }
+        inputBytes -= it->second.popLine();
+        if (flags && !link) {
+            rejectLine(client_fd, message, flags);
+        } else {
+            processCompleteMessage(client_fd, message);
+        }
+    }
+}
+
+// Lines holding a NUL, a bare CR or malformed UTF-8 never reach the parser.
+void ChatServer::rejectLine(int client_fd, const std::string &message, unsigned char flags) {
+    std::string command = message.substr(0, message.find(' '));
+    for (size_t i = 0; i < command.size(); i++) {
+        if (!std::isalnum(static_cast<unsigned char>(command[i]))) {
+            command = "*";
+            break;
+        }
+    }
+    std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+    if (command.empty())
+        command = "*";
+    if (flags & LINE_BAD_CONTROL) {
+        sendToClient(client_fd, ":irc.localhost FAIL " + command +
+                                " INVALID_CONTROL :Message rejected, it contains a NUL or a bare CR\r\n");
+    } else {
+        sendToClient(client_fd, ":irc.localhost FAIL " + command +
+                                " INVALID_UTF8 :Message rejected, your IRC software MUST use UTF-8\r\n");
     }
 }
 
 void ChatServer::handleClientDisconnect(int client_fd) {
     std::cout << "Client disconnected (fd=" << client_fd << ")\n";
-    close(client_fd);
+    if (parkClient(client_fd)) {
+        return;
+    }
+    if (links.find(client_fd) != links.end()) {
+        dropLink(client_fd);
+    } else {
+        std::map<int, Client>::iterator it = clients.find(client_fd);
+        if (it != clients.end() && it->second.hasSentWelcome() && !it->second.isQuitAnnounced()) {
+            std::string quitLine = userPrefix(it->second) + " QUIT :Connection closed\r\n";
+            notifyPeers(client_fd, quitLine, false, NULL);
+            propagate(quitLine, -1);
+        }
+    }
+    outbox.detach(client_fd);
+    capture.disconnect(client_fd);
+    if (client_fd < MEMORY_ID_BASE) {
+        close(client_fd);
+    }
     for (std::vector<pollfd>::iterator it = fds.begin(); it != fds.end(); ++it) {
         if (it->fd == client_fd) {
             fds.erase(it);
             break;
         }
     }
-    clients.erase(client_fd);
+    if (clients.find(client_fd) != clients.end())
+        releaseMemoryId(client_fd);
+    eraseClient(client_fd);
 }
 
 void ChatServer::processCompleteMessage(int client_fd, const std::string &message) {
@@ -168,7 +577,25 @@ void ChatServer::processCompleteMessage(int client_fd, const std::string &messag
         if (token[0] != ':')
             token = ":" + token;
         std::string response = "PONG " + token + "\r\n";
-        send(client_fd, response.c_str(), response.size(), 0);
+        sendToClient(client_fd, response);
+        return;
+    }
+
+    if (isEstablishedLink(client_fd)) {
+        processServerMessage(client_fd, message);
+        return;
+    }
+
+    if (command == "SERVER") {
+        handleServerHandshake(client_fd, param);
+        return;
+    }
+    if (links.find(client_fd) != links.end()) {
+        return;
+    }
+
+    if (command == "CAP") {
+        processCapCommand(client_fd, param);
         return;
     }
 
@@ -176,32 +603,48 @@ void ChatServer::processCompleteMessage(int client_fd, const std::string &messag
         if (command == "PASS") {
             if (param.empty()) {
                 std::string response = ":irc.localhost 461 * PASS :Not enough parameters.\r\n";
-                send(client_fd, response.c_str(), response.size(), 0);
+                sendToClient(client_fd, response);
                 return;
             }
             if (param == serverPassword) {
                 client.setAuthenticated(true);
                 std::string response = ":irc.localhost NOTICE * :Password accepted. Please enter NICK and USER.\r\n";
-                send(client_fd, response.c_str(), response.size(), 0);
+                sendToClient(client_fd, response);
             } else {
                 std::string response = ":irc.localhost 464 * :Incorrect password.\r\n";
-                send(client_fd, response.c_str(), response.size(), 0);
+                sendToClient(client_fd, response);
                 handleClientDisconnect(client_fd);
             }
         } else {
             std::string response = ":irc.localhost NOTICE * :Please enter the password using PASS <password>\r\n";
-            send(client_fd, response.c_str(), response.size(), 0);
+            sendToClient(client_fd, response);
         }
         return;
     }
 
+    if (command == "RESUME") {
+        processResumeCommand(client_fd, param);
+        return;
+    }
+
     if (command == "NICK") {
         if (param.empty()) {
             std::string response = ":irc.localhost 431 * :No nickname given\r\n";
-            send(client_fd, response.c_str(), response.size(), 0);
+            sendToClient(client_fd, response);
+            return;
+        }
+        int holder = getFdByNickname(param);
+        if (holder != -1 && holder != client_fd) {
+            std::string response = ":irc.localhost 433 * " + param + " :Nickname is already in use\r\n";
+            sendToClient(client_fd, response);
             return;
         }
-        client.setNickname(param);
+        if (client.hasSentWelcome()) {
+            std::string nickLine = userPrefix(client) + " NICK " + param + "\r\n";
+            propagate(nickLine, -1);
+            notifyPeers(client_fd, nickLine, true, &param);
+        }
+        setClientNickname(client_fd, param);
     }
 
     if (command == "USER") {
@@ -210,18 +653,17 @@ void ChatServer::processCompleteMessage(int client_fd, const std::string &messag
 
     if (!client.hasSentWelcome() && client.hasNickname() && client.hasUsername()) {
         client.setSentWelcome(true);
-        std::string welcomeMsg = ":irc.localhost 001 " + client.getNickname() + " :Welcome to the IRC server!\r\n";
-        std::string motdStart = ":irc.localhost 375 " + client.getNickname() + " :- IRC Message of the Day -\r\n";
-        std::string motdEnd = ":irc.localhost 376 " + client.getNickname() + " :End of /MOTD command.\r\n";
-        send(client_fd, welcomeMsg.c_str(), welcomeMsg.size(), 0);
-        send(client_fd, motdStart.c_str(), motdStart.size(), 0);
-        send(client_fd, motdEnd.c_str(), motdEnd.size(), 0);
+        client.setSignonTime(time(NULL));
+        introduceUser(client_fd);
+        notifyWatchers(client_fd, true);
+        sendWelcome(client_fd, client.getNickname());
+        issueResumeToken(client_fd);
     }
 
     if (command != "PASS" && command != "NICK" && command != "USER") {
         if (!client.hasNickname() || !client.hasUsername()) {
             std::string response = ":irc.localhost 451 * :You have not registered\r\n";
-            send(client_fd, response.c_str(), response.size(), 0);
+            sendToClient(client_fd, response);
             return;
         }
     }
@@ -229,7 +671,7 @@ void ChatServer::processCompleteMessage(int client_fd, const std::string &messag
         processCommand(client_fd, message);
     } else {
         std::string response = ":irc.localhost 421 * " + command + " :Unknown command\r\n";
-        send(client_fd, response.c_str(), response.size(), 0);
+        sendToClient(client_fd, response);
     }
 }
 
@@ -252,11 +694,10 @@ std::vector<std::string> splitParams(const std::string &s) {
 }
 
 void ChatServer::handleUSERCommand(int client_fd, const std::string &param, Client &client) {
-    printf("%s\n", param.c_str());
     std::vector<std::string> tokens = splitParams(param);
     if (tokens.size() < 4) {
         std::string response = ":irc.localhost 461 * USER :Not enough parameters\r\n";
-        send(client_fd, response.c_str(), response.size(), 0);
+        sendToClient(client_fd, response);
         return;
     }
     
@@ -274,7 +715,7 @@ void ChatServer::handleUSERCommand(int client_fd, const std::string &param, Clie
     
     if (username.empty()) {
         std::string response = ":irc.localhost 461 * USER :Invalid username\r\n";
-        send(client_fd, response.c_str(), response.size(), 0);
+        sendToClient(client_fd, response);
         return;
     }
     
@@ -299,6 +740,17 @@ bool ChatServer::isCommand(const std::string &command) {
         commands.insert("PING");
         commands.insert("PONG");
         commands.insert("QUIT");
+        commands.insert("STATS");
+        commands.insert("NAMES");
+        commands.insert("CHATHISTORY");
+        commands.insert("SEARCH");
+        commands.insert("LIST");
+        commands.insert("WHO");
+        commands.insert("WHOIS");
+        commands.insert("MONITOR");
+        commands.insert("OPER");
+        commands.insert("MEMSTATS");
+        commands.insert("LOADSTATS");
     }
     return commands.find(command) != commands.end();
 }
@@ -335,20 +787,83 @@ void ChatServer::processCommand(int client_fd, const std::string &message) {
         processNoticeCommand(client_fd, iss);
     } else if (command == "QUIT") {
         processQuitCommand(client_fd, iss);
+    } else if (command == "STATS") {
+        processStatsCommand(client_fd, iss);
+    } else if (command == "NAMES") {
+        processNamesCommand(client_fd, iss);
+    } else if (command == "CHATHISTORY") {
+        processChatHistoryCommand(client_fd, iss);
+    } else if (command == "SEARCH") {
+        processSearchCommand(client_fd, iss);
+    } else if (command == "LIST") {
+        processListCommand(client_fd, iss);
+    } else if (command == "WHO") {
+        processWhoCommand(client_fd, iss);
+    } else if (command == "WHOIS") {
+        processWhoisCommand(client_fd, iss);
+    } else if (command == "OPER") {
+        processOperCommand(client_fd, iss);
+    } else if (command == "MEMSTATS") {
+        processMemstatsCommand(client_fd);
+    } else if (command == "LOADSTATS") {
+        processLoadstatsCommand(client_fd);
+    } else if (command == "MONITOR") {
+        processMonitorCommand(client_fd, iss);
     } else {
         std::string errorMsg = ":irc.localhost 421 " + clients[client_fd].getNickname() +
                                " " + command + " :Unknown command\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
     }
 }
 
 
 int ChatServer::getFdByNickname(const std::string &nick) {
-    for (std::map<int, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
-        if (it->second.getNickname() == nick) {
-            return it->first;
+    std::map<std::string, int>::iterator it = nickIndex.find(nick);
+    return it == nickIndex.end() ? -1 : it->second;
+}
+
+// Every nickname change goes through here so nickIndex stays in step.
+void ChatServer::setClientNickname(int id, const std::string &nick) {
+    Client &client = clients[id];
+    if (client.hasNickname()) {
+        if (client.hasSentWelcome()) {
+            notifyWatchers(id, false);
+        }
+        std::map<std::string, int>::iterator it = nickIndex.find(client.getNickname());
+        if (it != nickIndex.end() && it->second == id) {
+            nickIndex.erase(it);
         }
     }
-    return -1;
+    client.setNickname(nick);
+    nickIndex[nick] = id;
+    if (client.hasSentWelcome()) {
+        notifyWatchers(id, true);
+    }
+}
+
+void ChatServer::eraseClient(int id) {
+    std::map<int, Client>::iterator client = clients.find(id);
+    if (client == clients.end()) {
+        return;
+    }
+    if (client->second.hasSentWelcome()) {
+        notifyWatchers(id, false);
+    }
+    clearMonitored(id);
+    inputBytes -= client->second.getBufferSize();
+    std::map<std::string, int>::iterator it = nickIndex.find(client->second.getNickname());
+    if (it != nickIndex.end() && it->second == id) {
+        nickIndex.erase(it);
+    }
+    std::map<std::string, int>::iterator token = resumeTokens.find(client->second.getResumeToken());
+    if (token != resumeTokens.end() && token->second == id) {
+        resumeTokens.erase(token);
+    }
+    parkedClients.erase(id);
+    cursors.erase(id);
+    inputBacklog.erase(id);
+    inputPaused.erase(id);
+    inputPostponed.erase(id);
+    clients.erase(client);
 }
 
@@ -7,6 +7,7 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <deque>
 #include <poll.h>
 #include <cstring>
 #include <cstdlib>
@@ -15,53 +16,294 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include "Pool.hpp"
+#include "History.hpp"
+#include "Outbox.hpp"
+#include "Capture.hpp"
+#include "Search.hpp"
+#include "MemStats.hpp"
+#include "Overload.hpp"
 #include "Client.hpp"
 #include "Channel.hpp"
 #include <cstdio>
 #include <cerrno>
 #include <algorithm>
+#include <csignal>
 
 
 class Client;
 class Channel;
 
-#define MAX_CLIENTS 10
+#define LISTEN_BACKLOG 128
 #define BUFFER_SIZE 1024
+#define TARGMAX 8
+#define MAX_LINE_LENGTH 512
+#define LINE_QUANTUM 8
+#define POLL_TIMEOUT_MS 1000
+#define SNAPSHOT_FILE "ircserv.snapshot"
+#define SNAPSHOT_INTERVAL 60
+#define MONITOR_LIMIT 100
+#define QUERY_CHUNK_ENTRIES 64
+#define QUERY_HIGH_WATER 16384
+#define OPER_ENV "IRCSERV_OPER"
+#define LINK_PASSWORD_ENV "IRCSERV_LINK_PASSWORD"
+#define SERVER_VERSION "ircserv-1.0"
+#define MOTD_FILE "ircd.motd"
+#define MOTD_ENV "IRCSERV_MOTD"
+#define MOTD_LINE_LENGTH 400
+#define CHANNEL_EMPTY_TTL 300
+#define RECLAIM_INTERVAL 60
+#define RESUME_GRACE 60
+#define RESUME_MAX_PENDING (256 * 1024)
+#define RESUME_TOKEN_BYTES 16
+
+struct ServerLink {
+    std::string name;
+    bool established;
+    bool outgoing;
+};
+
+struct Listener {
+    int fd;
+    std::string spec;
+    int family;
+    int backlog;
+    bool v6only;
+    std::string path;
+    // Identity of the socket file bound at path, so shutdown only removes
+    // that file and never whatever replaced it.
+    dev_t dev;
+    ino_t ino;
+};
+
+struct LinkTarget {
+    std::string host;
+    int port;
+    int fd;
+};
+
+// Resumable LIST/WHO state. Each chunk restarts from the last key it
+// scanned, so a cursor stays valid while channels and nicks change.
+struct QueryCursor {
+    enum Kind { QUERY_LIST, QUERY_WHO_CHANNEL, QUERY_WHO_MASK };
+    Kind kind;
+    std::vector<std::string> masks;
+    std::string prefix;
+    std::string target;
+    size_t minUsers;
+    size_t maxUsers;
+    bool bySize;
+    bool started;
+    std::string lastName;
+    size_t lastSize;
+    int lastId;
+};
+
+typedef std::map<std::string, Channel, std::less<std::string>,
+                 PoolAllocator<std::pair<const std::string, Channel> > > ChannelMap;
 
 class ChatServer {
+    // tests/server_test.cpp reaches into the server's state.
+    friend class ServerTest;
+
 private:
-    int server_fd;
+    std::vector<Listener> listeners;
     std::string serverPassword;
-    int serverPort;
-    std::map<std::string, Channel> channels;
+    ChannelMap channels;
     std::map<int, Client> clients;
     std::vector<pollfd> fds;
-    struct sockaddr_in server_addr;
+    unsigned long nextMsgId;
+    size_t historyBytes;
+    std::set<std::pair<unsigned long, std::string> > historyHeads;
+    pid_t snapshotPid;
+    bool snapshotDirty;
+    time_t lastSnapshot;
+    std::string binaryPath;
+    std::vector<std::string> execArgs;
+    std::string serverName;
+    std::string linkPassword;
+    std::map<int, ServerLink> links;
+    std::vector<LinkTarget> linkTargets;
+    int nextRemoteId;
+    time_t lastLinkAttempt;
+    Outbox outbox;
+    std::map<std::string, int> nickIndex;
+    std::set<std::pair<size_t, std::string> > channelsBySize;
+    std::map<int, std::deque<QueryCursor> > cursors;
+    std::map<std::string, std::set<int> > monitorWatchers;
+    std::map<int, std::set<std::string> > joinedChannels;
+    std::map<std::string, std::set<std::string> > invitesByNick;
+    Capture capture;
+    SearchIndex searchIndex;
+    bool persistent;
+    bool queriesRunnable;
+    int nextMemoryId;
+    std::vector<int> freeMemoryIds;
+    unsigned long peerEvent;
+    std::vector<int> peerTargets;
+    size_t inputBytes;
+    size_t memorySoftLimit;
+    size_t memoryHardLimit;
+    MemoryPressure lastPressure;
+    LoadLevel loadLevel;
+    long lagAverageUs;
+    LoadStats loadStats;
+    std::set<int> inputBacklog;
+    std::set<int> inputPaused;
+    std::set<int> inputPostponed;
+    int nextScheduled;
+    time_t startedAt;
+    std::vector<std::string> motdLines;
+    std::vector<std::string> welcomeParts;
+    size_t welcomeBytes;
+    std::map<std::string, int> resumeTokens;
+    std::map<int, time_t> parkedClients;
+    time_t lastParkSweep;
+    ReclaimStats reclaimStats;
+    time_t lastReclaim;
+
+    static volatile sig_atomic_t upgradeRequested;
+    static void handleUpgradeSignal(int signum);
+    static volatile sig_atomic_t reloadRequested;
+    static void handleReloadSignal(int signum);
 
     void setNonBlocking(int fd);
-    void handleNewConnection();
+    void handleNewConnection(const Listener &listener);
+    const Listener *findListener(int fd) const;
+    void closeListeners();
     void handleClientMessage(int client_fd);
+    void handleInput(int client_fd, const std::string &data);
+    bool drainInput(int client_fd);
+    void rejectLine(int client_fd, const std::string &message, unsigned char flags);
+    void registerConnection(int client_fd);
     void handleClientDisconnect(int client_fd);
     void processCompleteMessage(int client_fd, const std::string &message);
     void handleUSERCommand(int client_fd, const std::string &param, Client &client);
     void processCommand(int client_fd, const std::string &message);
     void processJoinCommand(int client_fd, std::istringstream &iss);
+    void joinChannel(int client_fd, std::string channelName, const std::string &key);
     void processPrivMsgCommand(int client_fd, std::istringstream &iss);
     void processKickCommand(int client_fd, std::istringstream &iss);
     void processInviteCommand(int client_fd, std::istringstream &iss);
     void processTopicCommand(int client_fd, std::istringstream &iss);
     void processModeCommand(int client_fd, std::istringstream &iss);
+    void processUserMode(int client_fd, const std::string &target, const std::string &modes);
     void processPartCommand(int client_fd, std::istringstream &iss);
     void processNoticeCommand(int client_fd, std::istringstream &iss);
     void processQuitCommand(int client_fd, std::istringstream &iss);
+    void processStatsCommand(int client_fd, std::istringstream &iss);
+    void processNamesCommand(int client_fd, std::istringstream &iss);
+    void processCapCommand(int client_fd, const std::string &param);
+    void processChatHistoryCommand(int client_fd, std::istringstream &iss);
+    void processSearchCommand(int client_fd, std::istringstream &iss);
+    void processListCommand(int client_fd, std::istringstream &iss);
+    void processWhoCommand(int client_fd, std::istringstream &iss);
+    void processWhoisCommand(int client_fd, std::istringstream &iss);
+    void startCursor(int client_fd, const QueryCursor &cursor);
+    bool advanceCursor(int client_fd, QueryCursor &cursor);
+    bool runCursors();
+    std::string whoReply(const std::string &nick, const std::string &channel, int id, bool op);
+    void processMonitorCommand(int client_fd, std::istringstream &iss);
+    void processOperCommand(int client_fd, std::istringstream &iss);
+    void processMemstatsCommand(int client_fd);
+    void collectMemoryStats(MemoryStats &stats);
+    size_t trackedMemory();
+    MemoryPressure memoryPressure();
+    void recordLoopLag(long lagUs, long elapsedUs);
+    size_t lineBudget() const;
+    void setListenersPaused(bool paused);
+    void setPollIn(int client_fd, bool enabled);
+    bool shouldPostpone(const std::string &message);
+    void serveInput(int client_fd);
+    void runScheduler();
+    void processLoadstatsCommand(int client_fd);
+    void loadMotd();
+    void renderWelcome();
+    void sendWelcome(int client_fd, const std::string &nick);
+    void issueResumeToken(int client_fd);
+    int takeMemoryId();
+    void releaseMemoryId(int id);
+    bool parkClient(int client_fd);
+    void moveClient(int from, int to);
+    void processResumeCommand(int client_fd, const std::string &param);
+    void expireParkedClients(bool all);
+    void sendMonitorStatus(int client_fd, const std::vector<std::string> &targets);
+    void notifyWatchers(int id, bool online);
+    void clearMonitored(int client_fd);
+    void sendNames(int client_fd, Channel &chan);
+    HistoryEntry recordHistory(Channel &chan, const SharedLine &line);
+    void sendChannelMessage(Channel &chan, const SharedLine &line, int except_fd);
+    void evictHistory(Channel &chan);
+    void destroyChannel(ChannelMap::iterator it);
+    void reclaimState();
+    std::string serializeChannels();
+    bool writeSnapshotFile(const std::string &data);
+    void startSnapshot();
+    void reapSnapshot();
+    void loadSnapshot();
+    std::string serializeUpgradeState(std::vector<int> &fdList);
+    bool restoreUpgradeState(const std::string &blob, const std::vector<int> &newFds);
+    bool resumeFromUpgrade();
+    void performUpgrade();
+    bool isEstablishedLink(int fd) const;
+    std::string userPrefix(const Client &client) const;
+    void connectLinks();
+    void handleServerHandshake(int fd, const std::string &param);
+    int findLinkPeer(int fd) const;
+    void sendBurst(int link_fd);
+    void propagate(const std::string &line, int except_link);
+    void propagateToChannel(Channel &chan, const std::string &line, int except_link);
+    void introduceUser(int client_fd);
+    void killUser(int id, const std::string &reason, int except_link);
+    void dropLink(int link_fd);
+    void dropRemoteUser(int id, const std::string &reason);
+    void renameUser(int id, const std::string &newNick, const std::string &line);
+    void sendToTargets(const std::vector<int> &targets, const SharedLine &line);
+    void notifyPeers(int id, const std::string &line, bool includeSelf, const std::string *newNick);
+    int remoteSource(int link_fd, const std::string &prefix);
+    void processServerMessage(int link_fd, const std::string &message);
+    void startFanout();
+    void resumeBlockedOutput();
+    void dropOverflowedClients();
+    void flushClientOutput(int client_fd);
+    void setPollOut(int client_fd, bool enabled);
     bool isCommand(const std::string &command);
     int getFdByNickname(const std::string &nick);
+    void setClientNickname(int id, const std::string &nick);
+    void eraseClient(int id);
 
 
 public:
-    ChatServer(int port, const std::string &password);
+    explicit ChatServer(const std::string &password);
     ~ChatServer();
+    bool start(const std::vector<std::string> &listenSpecs);
+    void startInProcess();
+    bool listenOn(const std::string &spec);
     void run();
+    bool step(int timeoutMs);
+    int attachConnection(int fd);
+    int openMemoryConnection();
+    void feed(int client_fd, const std::string &data);
+    std::string takeOutput(int client_fd);
+    void closeConnection(int client_fd);
+    void enableHotUpgrade(int argc, char **argv);
+    void enableMotdReload();
+    void setServerName(const std::string &name);
+    void addLinkTarget(const std::string &host, int port);
+    void setLinkPassword(const std::string &password);
+    void enableCapture(const std::string &path);
+    void setMemoryLimits(size_t soft, size_t hard);
+    void sendToClient(int client_fd, const std::string &message);
+    void sendToMembers(const FdSet &members, const std::string &message, int except_fd);
+    void channelResized(const std::string &name, size_t before, size_t after);
+    void channelChanged();
+    void memberJoined(int id, const std::string &name);
+    void memberLeft(int id, const std::string &name);
+    void memberMoved(int from, int to, const std::string &name);
+    void userInvited(const std::string &nick, const std::string &name);
 };
 
+std::vector<std::string> splitCommaList(const std::string &list);
+
 #endif
\ No newline at end of file
@@ -1,11 +1,24 @@
 #include "Client.hpp"
 
+// Changes whenever nick or user does, so cached mask matches can tell
+// they are stale. Never reused, even across reused fds.
+unsigned long Client::nextIdentity = 1;
+
 Client::Client(int fd) {
     this->fd = fd;
     this->authenticated = false;
     this->hasNick = false;
     this->hasUser = false;
     this->welcomeSent = false;
+    this->quitAnnounced = false;
+    this->linkFd = -1;
+    this->signonTime = 0;
+    this->capabilities = 0;
+    this->userModes = 0;
+    this->identity = nextIdentity++;
+    this->peerMark = 0;
+    this->bufferStart = 0;
+    resetFrameState(this->frameState);
 }
 
 Client::Client() {
@@ -13,6 +26,16 @@ Client::Client() {
     this->authenticated = false;
     this->hasNick = false;
     this->hasUser = false;
+    this->welcomeSent = false;
+    this->quitAnnounced = false;
+    this->linkFd = -1;
+    this->signonTime = 0;
+    this->capabilities = 0;
+    this->userModes = 0;
+    this->identity = nextIdentity++;
+    this->peerMark = 0;
+    this->bufferStart = 0;
+    resetFrameState(this->frameState);
 }
 
 bool Client::isAuthenticated() const {
@@ -36,7 +59,8 @@ void Client::setNickname(const std::string &nickname) {
         send(fd, "ERROR: Nickname cannot be empty\n", 30, 0);
         return;
     }
-    this->nickname = nickname;
+    this->nickname = toPoolString(nickname);
+    this->identity = nextIdentity++;
     this->hasNick = true;
     std::cout << "Client " << fd << " set nickname to " << nickname << std::endl;
 }
@@ -47,7 +71,8 @@ void Client::setUsername(const std::string &username) {
         send(fd, "ERROR: Username cannot be empty\n", 30, 0);
         return;
     }
-    this->username = username;
+    this->username = toPoolString(username);
+    this->identity = nextIdentity++;
     this->hasUser = true;
     this->authenticated = true;
     std::cout << "Client " << fd << " set username to " << username << std::endl;
@@ -58,23 +83,97 @@ int Client::getFd() const {
 }
 
 std::string Client::getNickname() const {
-    return nickname; 
+    return toStdString(nickname); 
 }
 
 std::string Client::getUsername() const {
-    return username; 
+    return toStdString(username); 
 }
 
+// Buffered input is framed as it arrives, so each byte is scanned once.
+// Consumed lines only move bufferStart; the dead prefix is dropped once it
+// is both large and most of the buffer.
 void Client::appendToBuffer(const std::string &data) {
+    static std::vector<LineEnd> found;
+    found.clear();
+    bestFrameKernel().scan(data.data(), data.size(), frameState, found);
+    size_t base = buffer.size();
     buffer += data;
+    for (size_t i = 0; i < found.size(); i++) {
+        found[i].offset += base;
+        lineEnds.push_back(found[i]);
+    }
+}
+
+size_t Client::getBufferSize() const {
+    return buffer.size() - bufferStart;
+}
+
+bool Client::hasLine() const {
+    return !lineEnds.empty();
+}
+
+// Copies out the next complete line, without its LF, and its framing flags.
+bool Client::peekLine(std::string &line, unsigned char &flags) const {
+    if (lineEnds.empty())
+        return false;
+    line.assign(buffer, bufferStart, lineEnds.front().offset - bufferStart);
+    flags = lineEnds.front().flags;
+    return true;
 }
 
-std::string Client::getBuffer() const {
-    return buffer;
+size_t Client::lineCount() const {
+    return lineEnds.size();
 }
 
-void Client::clearBuffer(size_t pos) {
-    buffer.erase(0, pos + 1);
+// Copies out a complete line further back in the buffer, without its LF.
+void Client::copyLine(size_t index, std::string &line) const {
+    size_t start = index ? lineEnds[index - 1].offset + 1 : bufferStart;
+    line.assign(buffer, start, lineEnds[index].offset - start);
+}
+
+// Drops the next line and returns the bytes it took up.
+size_t Client::popLine() {
+    size_t end = lineEnds.front().offset + 1;
+    size_t used = end - bufferStart;
+    lineEnds.pop_front();
+    bufferStart = end;
+    if (bufferStart == buffer.size()) {
+        buffer.clear();
+        bufferStart = 0;
+    } else if (bufferStart >= INPUT_COMPACT_BYTES && bufferStart * 2 >= buffer.size()) {
+        buffer.erase(0, bufferStart);
+        for (std::deque<LineEnd>::iterator it = lineEnds.begin(); it != lineEnds.end(); ++it)
+            it->offset -= bufferStart;
+        bufferStart = 0;
+    }
+    return used;
+}
+
+bool Client::hasUserMode(unsigned int mode) const {
+    return (userModes & mode) != 0;
+}
+
+void Client::setUserMode(unsigned int mode, bool enabled) {
+    if (enabled)
+        userModes |= mode;
+    else
+        userModes &= ~mode;
+}
+
+bool Client::hasCapability(unsigned int cap) const {
+    return (capabilities & cap) != 0;
+}
+
+void Client::setCapability(unsigned int cap, bool enabled) {
+    if (enabled)
+        capabilities |= cap;
+    else
+        capabilities &= ~cap;
+}
+
+unsigned int Client::getCapabilities() const {
+    return capabilities;
 }
 
 void Client::setCurrentChannel(const std::string &channel) {
@@ -85,10 +184,154 @@ std::string Client::getCurrentChannel() const {
     return currentChannel;
 }
 
+bool Client::isRemote() const {
+    return linkFd >= 0;
+}
+
+int Client::getLinkFd() const {
+    return linkFd;
+}
+
+void Client::setLinkFd(int link_fd) {
+    linkFd = link_fd;
+}
+
+time_t Client::getSignonTime() const {
+    return signonTime;
+}
+
+void Client::setSignonTime(time_t ts) {
+    signonTime = ts;
+}
+
+bool Client::isQuitAnnounced() const {
+    return quitAnnounced;
+}
+
+void Client::setQuitAnnounced(bool value) {
+    quitAnnounced = value;
+}
+
+unsigned long Client::getIdentity() const {
+    return identity;
+}
+
+// Returns false if this client was already reached by the given event.
+bool Client::markPeer(unsigned long event) {
+    if (peerMark == event)
+        return false;
+    peerMark = event;
+    return true;
+}
+
 bool Client::hasSentWelcome() const {
     return welcomeSent;
 }
 
 void Client::setSentWelcome(bool val) { 
     welcomeSent = val;
+}
+
+const std::string &Client::getResumeToken() const {
+    return resumeToken;
+}
+
+void Client::setResumeToken(const std::string &token) {
+    resumeToken = token;
+}
+
+// Takes over the registered user behind other: who it is, its modes and
+// monitor list. The connection side (fd, input, capabilities) stays.
+void Client::takeSession(const Client &other) {
+    nickname = other.nickname;
+    username = other.username;
+    currentChannel = other.currentChannel;
+    userModes = other.userModes;
+    monitored = other.monitored;
+    resumeToken = other.resumeToken;
+    authenticated = other.authenticated;
+    hasNick = other.hasNick;
+    hasUser = other.hasUser;
+    welcomeSent = other.welcomeSent;
+    quitAnnounced = false;
+    signonTime = other.signonTime;
+    identity = other.identity;
+}
+
+const std::set<std::string> &Client::getMonitored() const {
+    return monitored;
+}
+
+bool Client::addMonitored(const std::string &nick) {
+    return monitored.insert(nick).second;
+}
+
+bool Client::removeMonitored(const std::string &nick) {
+    return monitored.erase(nick) > 0;
+}
+
+size_t Client::memoryUsage() const {
+    return sizeof(Client) + stringHeapBytes(nickname) + stringHeapBytes(username) +
+           stringHeapBytes(currentChannel) + stringHeapBytes(resumeToken) + stringHeapBytes(buffer) +
+           lineEnds.size() * sizeof(LineEnd) +
+           monitored.size() * treeNodeBytes<std::string>();
+}
+
+void Client::serializeState(std::string &out) const {
+    putString(out, nickname);
+    putString(out, username);
+    putString(out, currentChannel);
+    putString(out, buffer.substr(bufferStart));
+
+    unsigned char flags = (authenticated ? 0x1 : 0) | (hasNick ? 0x2 : 0) |
+                          (hasUser ? 0x4 : 0) | (welcomeSent ? 0x8 : 0);
+    out += static_cast<char>(flags);
+    putU32(out, capabilities);
+    putU32(out, userModes);
+    putString(out, resumeToken);
+    putU64(out, static_cast<uint64_t>(signonTime));
+
+    putU32(out, static_cast<uint32_t>(monitored.size()));
+    for (std::set<std::string>::const_iterator it = monitored.begin(); it != monitored.end(); ++it) {
+        putString(out, *it);
+    }
+}
+
+bool Client::restoreState(Reader &in) {
+    std::string nick, user, pending;
+    unsigned char flags;
+    uint32_t caps, umodes;
+    uint64_t signon;
+    if (!in.getBytes(nick) || !in.getBytes(user) || !in.getBytes(currentChannel) ||
+        !in.getBytes(pending) || !in.getU8(flags) || !in.getU32(caps) || !in.getU32(umodes) ||
+        !in.getBytes(resumeToken) || !in.getU64(signon))
+        return false;
+
+    buffer.clear();
+    bufferStart = 0;
+    lineEnds.clear();
+    resetFrameState(frameState);
+    appendToBuffer(pending);
+
+    nickname = toPoolString(nick);
+    username = toPoolString(user);
+    authenticated = (flags & 0x1) != 0;
+    hasNick = (flags & 0x2) != 0;
+    hasUser = (flags & 0x4) != 0;
+    welcomeSent = (flags & 0x8) != 0;
+    capabilities = caps;
+    userModes = umodes;
+    signonTime = static_cast<time_t>(signon);
+    identity = nextIdentity++;
+
+    uint32_t count;
+    if (!in.getU32(count))
+        return false;
+    for (uint32_t i = 0; i < count; i++) {
+        std::string target;
+        if (!in.getBytes(target))
+            return false;
+        monitored.insert(target);
+    }
+    return true;
 }
\ No newline at end of file
@@ -4,20 +4,50 @@
 #define CLIENT_HPP
 
 #include <string>
+#include <set>
+#include <deque>
 #include <iostream>
 #include <sys/socket.h>
+#include <ctime>
+#include "Pool.hpp"
+#include "Serialize.hpp"
+#include "Framing.hpp"
+
+#define CAP_NO_IMPLICIT_NAMES 0x1
+#define CAP_MESSAGE_TAGS 0x2
+#define CAP_RESUME 0x4
+
+#define UMODE_INVISIBLE 0x1
+#define UMODE_WALLOPS 0x2
+#define UMODE_OPER 0x4
+
+#define INPUT_COMPACT_BYTES 4096
 
 class Client {
 private:
-    std::string nickname;
-    std::string username;
+    PoolString nickname;
+    PoolString username;
     std::string currentChannel;
     std::string buffer;
+    size_t bufferStart;
+    FrameState frameState;
+    std::deque<LineEnd> lineEnds;
+    unsigned int capabilities;
+    unsigned int userModes;
+    std::set<std::string> monitored;
+    std::string resumeToken;
     bool authenticated;
     bool hasNick;
     bool hasUser;
     bool welcomeSent;
+    bool quitAnnounced;
     int fd;
+    int linkFd;
+    time_t signonTime;
+    unsigned long identity;
+    unsigned long peerMark;
+
+    static unsigned long nextIdentity;
 
 public:
     Client(int fd);
@@ -36,14 +66,49 @@ public:
     std::string getUsername() const; 
 
     void appendToBuffer(const std::string &data);
-    std::string getBuffer() const;
-    void clearBuffer(size_t pos);
+    size_t getBufferSize() const;
+    bool hasLine() const;
+    bool peekLine(std::string &line, unsigned char &flags) const;
+    size_t popLine();
+    size_t lineCount() const;
+    void copyLine(size_t index, std::string &line) const;
 
     void setCurrentChannel(const std::string &channel);
     std::string getCurrentChannel() const;
 
+    bool hasUserMode(unsigned int mode) const;
+    void setUserMode(unsigned int mode, bool enabled);
+
+    bool hasCapability(unsigned int cap) const;
+    void setCapability(unsigned int cap, bool enabled);
+    unsigned int getCapabilities() const;
+
+    const std::set<std::string> &getMonitored() const;
+    bool addMonitored(const std::string &nick);
+    bool removeMonitored(const std::string &nick);
+
+    bool isRemote() const;
+    int getLinkFd() const;
+    void setLinkFd(int link_fd);
+    time_t getSignonTime() const;
+    void setSignonTime(time_t ts);
+    bool isQuitAnnounced() const;
+    void setQuitAnnounced(bool value);
+
+    unsigned long getIdentity() const;
+    bool markPeer(unsigned long event);
+
     bool hasSentWelcome() const;
     void setSentWelcome(bool val);
+
+    const std::string &getResumeToken() const;
+    void setResumeToken(const std::string &token);
+    void takeSession(const Client &other);
+
+    size_t memoryUsage() const;
+
+    void serializeState(std::string &out) const;
+    bool restoreState(Reader &in);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,169 @@
+#include "Framing.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FRAMING_X86 1
+#include <immintrin.h>
+#endif
+
+// Input framing and validation in one pass. Every byte goes through the
+// same state machine in scanByte(); the vector kernels only skip it for
+// blocks that are plain ASCII with no NUL and no CR other than one right
+// before an LF, which is what almost all IRC traffic looks like. For those
+// blocks the LF positions come straight out of the compare mask.
+
+void resetFrameState(FrameState &state) {
+    state.flags = 0;
+    state.pendingCR = false;
+    state.utf8Need = 0;
+    state.utf8Low = 0x80;
+    state.utf8High = 0xBF;
+}
+
+static inline void endLine(size_t offset, FrameState &state, std::vector<LineEnd> &ends) {
+    LineEnd end;
+    end.offset = offset;
+    end.flags = state.flags;
+    ends.push_back(end);
+    state.flags = 0;
+}
+
+static inline void scanByte(unsigned char c, size_t offset, FrameState &state, std::vector<LineEnd> &ends) {
+    if (state.utf8Need) {
+        if (c >= state.utf8Low && c <= state.utf8High) {
+            state.utf8Need--;
+            state.utf8Low = 0x80;
+            state.utf8High = 0xBF;
+            return;
+        }
+        // Truncated sequence; c starts something new.
+        state.flags |= LINE_BAD_UTF8;
+        state.utf8Need = 0;
+    }
+    if (state.pendingCR) {
+        state.pendingCR = false;
+        if (c != '\n')
+            state.flags |= LINE_BAD_CONTROL;
+    }
+
+    if (c < 0x80) {
+        if (c == '\n')
+            endLine(offset, state, ends);
+        else if (c == '\r')
+            state.pendingCR = true;
+        else if (c == 0)
+            state.flags |= LINE_BAD_CONTROL;
+        return;
+    }
+
+    // Lead byte. The narrowed ranges rule out overlong forms, surrogates
+    // and code points past U+10FFFF.
+    state.utf8Low = 0x80;
+    state.utf8High = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+        state.utf8Need = 1;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        state.utf8Need = 2;
+        if (c == 0xE0)
+            state.utf8Low = 0xA0;
+        else if (c == 0xED)
+            state.utf8High = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        state.utf8Need = 3;
+        if (c == 0xF0)
+            state.utf8Low = 0x90;
+        else if (c == 0xF4)
+            state.utf8High = 0x8F;
+    } else {
+        state.flags |= LINE_BAD_UTF8;
+    }
+}
+
+static void scanScalar(const char *data, size_t len, FrameState &state, std::vector<LineEnd> &ends) {
+    for (size_t i = 0; i < len; i++)
+        scanByte(static_cast<unsigned char>(data[i]), i, state, ends);
+}
+
+// Handles one block given its byte masks. Returns false if the block needs
+// the byte-wise path.
+static inline bool scanMasks(unsigned long lf, unsigned long cr, unsigned long other, unsigned width,
+                             size_t base, FrameState &state, std::vector<LineEnd> &ends) {
+    unsigned long all = width == 32 ? 0xFFFFFFFFUL : (1UL << width) - 1;
+    unsigned long bareCR = ((cr << 1) | (state.pendingCR ? 1 : 0)) & ~lf & all;
+    if (other || bareCR || state.utf8Need)
+        return false;
+    state.pendingCR = false;
+    while (lf) {
+        endLine(base + __builtin_ctzl(lf), state, ends);
+        lf &= lf - 1;
+    }
+    state.pendingCR = (cr >> (width - 1)) & 1;
+    return true;
+}
+
+#ifdef FRAMING_X86
+__attribute__((target("sse2")))
+static void scanSse2(const char *data, size_t len, FrameState &state, std::vector<LineEnd> &ends) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        unsigned long lfMask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, lf)));
+        unsigned long crMask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, cr)));
+        unsigned long other = static_cast<unsigned>(_mm_movemask_epi8(block) |
+                                                    _mm_movemask_epi8(_mm_cmpeq_epi8(block, zero)));
+        if (!scanMasks(lfMask, crMask, other, 16, i, state, ends)) {
+            for (size_t j = i; j < i + 16; j++)
+                scanByte(static_cast<unsigned char>(data[j]), j, state, ends);
+        }
+    }
+    for (; i < len; i++)
+        scanByte(static_cast<unsigned char>(data[i]), i, state, ends);
+}
+
+__attribute__((target("avx2")))
+static void scanAvx2(const char *data, size_t len, FrameState &state, std::vector<LineEnd> &ends) {
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        unsigned long lfMask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, lf)));
+        unsigned long crMask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, cr)));
+        unsigned long other = static_cast<unsigned>(_mm256_movemask_epi8(block) |
+                                                    _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero)));
+        if (!scanMasks(lfMask, crMask, other, 32, i, state, ends)) {
+            for (size_t j = i; j < i + 32; j++)
+                scanByte(static_cast<unsigned char>(data[j]), j, state, ends);
+        }
+    }
+    for (; i < len; i++)
+        scanByte(static_cast<unsigned char>(data[i]), i, state, ends);
+}
+#endif
+
+
+std::vector<FrameKernel> frameKernels() {
+    std::vector<FrameKernel> kernels;
+    FrameKernel scalar = {"scalar", scanScalar};
+    kernels.push_back(scalar);
+#ifdef FRAMING_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        FrameKernel sse2 = {"sse2", scanSse2};
+        kernels.push_back(sse2);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        FrameKernel avx2 = {"avx2", scanAvx2};
+        kernels.push_back(avx2);
+    }
+#endif
+    return kernels;
+}
+
+const FrameKernel &bestFrameKernel() {
+    static const std::vector<FrameKernel> kernels = frameKernels();
+    return kernels.back();
+}
@@ -0,0 +1,43 @@
+#pragma once
+#ifndef FRAMING_HPP
+#define FRAMING_HPP
+
+#include <cstddef>
+#include <vector>
+
+// Set on a line that holds a NUL or a CR not directly before its LF.
+#define LINE_BAD_CONTROL 0x1
+// Set on a line that is not well-formed UTF-8.
+#define LINE_BAD_UTF8 0x2
+
+// Scanner state carried from one chunk to the next: the flags of the line
+// in progress, a CR waiting to see whether an LF follows, and a UTF-8
+// sequence still expecting continuation bytes within [low, high].
+struct FrameState {
+    unsigned char flags;
+    bool pendingCR;
+    unsigned char utf8Need;
+    unsigned char utf8Low;
+    unsigned char utf8High;
+};
+
+struct LineEnd {
+    size_t offset;
+    unsigned char flags;
+};
+
+// Appends one LineEnd per LF in data, with offset relative to data.
+typedef void (*FrameScanFn)(const char *data, size_t len, FrameState &state, std::vector<LineEnd> &ends);
+
+struct FrameKernel {
+    const char *name;
+    FrameScanFn scan;
+};
+
+void resetFrameState(FrameState &state);
+// The kernels this CPU can run, slowest first.
+std::vector<FrameKernel> frameKernels();
+// The fastest of them, picked on first use.
+const FrameKernel &bestFrameKernel();
+
+#endif
@@ -0,0 +1,192 @@
+#include "History.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+
+SharedLine::SharedLine() : rep(NULL) {}
+
+SharedLine::SharedLine(const std::string &data) : rep(new Rep) {
+    rep->data = data;
+    rep->refs = 1;
+}
+
+SharedLine::SharedLine(const SharedLine &other) : rep(other.rep) {
+    if (rep)
+        __sync_add_and_fetch(&rep->refs, 1);
+}
+
+SharedLine &SharedLine::operator=(const SharedLine &other) {
+    if (rep != other.rep) {
+        release();
+        rep = other.rep;
+        if (rep)
+            __sync_add_and_fetch(&rep->refs, 1);
+    }
+    return *this;
+}
+
+SharedLine::~SharedLine() {
+    release();
+}
+
+void SharedLine::release() {
+    if (rep && __sync_sub_and_fetch(&rep->refs, 1) == 0)
+        delete rep;
+    rep = NULL;
+}
+
+const std::string &SharedLine::str() const {
+    static const std::string empty;
+    return rep ? rep->data : empty;
+}
+
+size_t SharedLine::size() const {
+    return rep ? rep->data.size() : 0;
+}
+
+
+// Timestamps reach clients with millisecond precision, so entries compare at
+// that precision too; otherwise a message's own time tag would not match it.
+static bool isBefore(const HistoryEntry &entry, const HistoryRef &ref) {
+    if (ref.byId)
+        return entry.msgid < ref.msgid;
+    if (entry.time.tv_sec != ref.time.tv_sec)
+        return entry.time.tv_sec < ref.time.tv_sec;
+    return entry.time.tv_usec / 1000 < ref.time.tv_usec / 1000;
+}
+
+static bool isAfter(const HistoryEntry &entry, const HistoryRef &ref) {
+    if (ref.byId)
+        return entry.msgid > ref.msgid;
+    if (entry.time.tv_sec != ref.time.tv_sec)
+        return entry.time.tv_sec > ref.time.tv_sec;
+    return entry.time.tv_usec / 1000 > ref.time.tv_usec / 1000;
+}
+
+ChannelHistory::ChannelHistory() : bytes(0) {}
+
+size_t ChannelHistory::entryBytes(const HistoryEntry &entry) {
+    return sizeof(HistoryEntry) + entry.line.size();
+}
+
+void ChannelHistory::append(const HistoryEntry &entry) {
+    entries.push_back(entry);
+    bytes += entryBytes(entry);
+    while (entries.size() > 1 &&
+           (entries.size() > HISTORY_MAX_MESSAGES || bytes > HISTORY_MAX_BYTES)) {
+        evictOldest();
+    }
+}
+
+void ChannelHistory::evictOldest() {
+    if (entries.empty())
+        return;
+    bytes -= entryBytes(entries.front());
+    entries.pop_front();
+}
+
+bool ChannelHistory::empty() const {
+    return entries.empty();
+}
+
+size_t ChannelHistory::size() const {
+    return entries.size();
+}
+
+size_t ChannelHistory::getBytes() const {
+    return bytes;
+}
+
+unsigned long ChannelHistory::oldestId() const {
+    return entries.empty() ? 0 : entries.front().msgid;
+}
+
+// First index not strictly before ref.
+size_t ChannelHistory::lowerBound(const HistoryRef &ref) const {
+    size_t lo = 0, hi = entries.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (isBefore(entries[mid], ref))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// First index strictly after ref.
+size_t ChannelHistory::upperBound(const HistoryRef &ref) const {
+    size_t lo = 0, hi = entries.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (isAfter(entries[mid], ref))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+void ChannelHistory::latest(const HistoryRef *ref, size_t limit, std::vector<HistoryEntry> &out) const {
+    size_t start = ref ? upperBound(*ref) : 0;
+    if (entries.size() - start > limit)
+        start = entries.size() - limit;
+    out.assign(entries.begin() + start, entries.end());
+}
+
+void ChannelHistory::before(const HistoryRef &ref, size_t limit, std::vector<HistoryEntry> &out) const {
+    size_t end = lowerBound(ref);
+    size_t start = end > limit ? end - limit : 0;
+    out.assign(entries.begin() + start, entries.begin() + end);
+}
+
+void ChannelHistory::after(const HistoryRef &ref, size_t limit, std::vector<HistoryEntry> &out) const {
+    size_t start = upperBound(ref);
+    size_t end = entries.size() - start > limit ? start + limit : entries.size();
+    out.assign(entries.begin() + start, entries.begin() + end);
+}
+
+
+// Accepts "msgid=<id>" or "timestamp=YYYY-MM-DDThh:mm:ss.sssZ".
+bool parseHistoryRef(const std::string &token, HistoryRef &ref) {
+    if (token.compare(0, 6, "msgid=") == 0) {
+        char *end;
+        ref.byId = true;
+        ref.msgid = std::strtoul(token.c_str() + 6, &end, 10);
+        return token.size() > 6 && *end == '\0';
+    }
+    if (token.compare(0, 10, "timestamp=") == 0) {
+        struct tm tm;
+        int millis = 0;
+        memset(&tm, 0, sizeof(tm));
+        int fields = std::sscanf(token.c_str() + 10, "%d-%d-%dT%d:%d:%d.%dZ",
+                                 &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                                 &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &millis);
+        if (fields < 6)
+            return false;
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        ref.byId = false;
+        ref.time.tv_sec = timegm(&tm);
+        ref.time.tv_usec = millis * 1000;
+        return true;
+    }
+    return false;
+}
+
+std::string formatHistoryTime(const struct timeval &tv) {
+    char buf[32];
+    struct tm tm;
+    time_t sec = tv.tv_sec;
+    gmtime_r(&sec, &tm);
+    size_t len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + len, sizeof(buf) - len, ".%03dZ", static_cast<int>(tv.tv_usec / 1000));
+    return buf;
+}
+
+std::string messageTags(unsigned long msgid, const struct timeval &tv) {
+    char id[32];
+    snprintf(id, sizeof(id), "%lu", msgid);
+    return std::string("@msgid=") + id + ";time=" + formatHistoryTime(tv) + " ";
+}
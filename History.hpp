@@ -0,0 +1,83 @@
+#pragma once
+#ifndef HISTORY_HPP
+#define HISTORY_HPP
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <sys/time.h>
+
+#define HISTORY_MAX_MESSAGES 100
+#define HISTORY_MAX_BYTES 65536
+#define HISTORY_TOTAL_BYTES (16 * 1024 * 1024)
+
+// Reference-counted, immutable serialized line. The broadcast path builds
+// it once and the history ring keeps a reference instead of a copy. The
+// count is atomic because fan-out workers hold references too.
+class SharedLine {
+private:
+    struct Rep {
+        std::string data;
+        size_t refs;
+    };
+    Rep *rep;
+
+    void release();
+
+public:
+    SharedLine();
+    explicit SharedLine(const std::string &data);
+    SharedLine(const SharedLine &other);
+    SharedLine &operator=(const SharedLine &other);
+    ~SharedLine();
+
+    const std::string &str() const;
+    size_t size() const;
+};
+
+struct HistoryEntry {
+    unsigned long msgid;
+    struct timeval time;
+    SharedLine line;
+};
+
+// A position in the history, given either as a msgid or a timestamp.
+struct HistoryRef {
+    bool byId;
+    unsigned long msgid;
+    struct timeval time;
+};
+
+// Bounded FIFO of recent channel messages, trimmed by count and bytes.
+class ChannelHistory {
+private:
+    std::deque<HistoryEntry> entries;
+    size_t bytes;
+
+    size_t lowerBound(const HistoryRef &ref) const;
+    size_t upperBound(const HistoryRef &ref) const;
+
+public:
+    ChannelHistory();
+
+    void append(const HistoryEntry &entry);
+    void evictOldest();
+
+    bool empty() const;
+    size_t size() const;
+    size_t getBytes() const;
+    unsigned long oldestId() const;
+
+    void latest(const HistoryRef *ref, size_t limit, std::vector<HistoryEntry> &out) const;
+    void before(const HistoryRef &ref, size_t limit, std::vector<HistoryEntry> &out) const;
+    void after(const HistoryRef &ref, size_t limit, std::vector<HistoryEntry> &out) const;
+
+    static size_t entryBytes(const HistoryEntry &entry);
+};
+
+bool parseHistoryRef(const std::string &token, HistoryRef &ref);
+std::string formatHistoryTime(const struct timeval &tv);
+// "@msgid=<id>;time=<timestamp> ", for clients with message-tags.
+std::string messageTags(unsigned long msgid, const struct timeval &tv);
+
+#endif
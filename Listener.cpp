@@ -0,0 +1,224 @@
+#include "ChatServer.hpp"
+#include <climits>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+
+// Listening sockets. A spec is one of
+//   <port>             IPv6 dual-stack on every address (IPv4 only if the
+//                      host has no IPv6)
+//   <ipv4>:<port>      one IPv4 address
+//   [<ipv6>]:<port>    one IPv6 address, IPv6 only
+//   unix:<path>        a Unix stream socket; a stale socket file is
+//                      replaced, anything else at path is an error
+// optionally followed by @<backlog>. Accepted TCP sockets get TCP_NODELAY
+// so replies are not held back waiting for the peer's ACK.
+
+static bool parsePort(const std::string &text, int &port) {
+    errno = 0;
+    char *end;
+    long value = std::strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || errno == ERANGE || value < 1024 || value > 65535)
+        return false;
+    port = static_cast<int>(value);
+    return true;
+}
+
+// Fills in the listener and its bind address from a spec.
+static bool parseListener(const std::string &spec, Listener &listener,
+                          struct sockaddr_storage &addr, socklen_t &addrLen) {
+    std::string address = spec;
+    listener.backlog = LISTEN_BACKLOG;
+    size_t at = address.rfind('@');
+    if (at != std::string::npos) {
+        char *end;
+        long backlog = std::strtol(address.c_str() + at + 1, &end, 10);
+        if (*end != '\0' || backlog <= 0 || backlog > INT_MAX)
+            return false;
+        listener.backlog = static_cast<int>(backlog);
+        address.erase(at);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    listener.spec = spec;
+    listener.path.clear();
+    listener.v6only = false;
+    listener.dev = 0;
+    listener.ino = 0;
+
+    if (address.compare(0, 5, "unix:") == 0) {
+        struct sockaddr_un *un = reinterpret_cast<struct sockaddr_un *>(&addr);
+        listener.path = address.substr(5);
+        if (listener.path.empty() || listener.path.size() >= sizeof(un->sun_path))
+            return false;
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, listener.path.c_str(), listener.path.size() + 1);
+        listener.family = AF_UNIX;
+        addrLen = sizeof(struct sockaddr_un);
+        return true;
+    }
+
+    int port;
+    size_t colon = address.rfind(':');
+    std::string host = colon == std::string::npos ? "" : address.substr(0, colon);
+    if (!parsePort(colon == std::string::npos ? address : address.substr(colon + 1), port))
+        return false;
+
+    if (host.empty() || (host.size() > 2 && host[0] == '[' && host[host.size() - 1] == ']')) {
+        struct sockaddr_in6 *in6 = reinterpret_cast<struct sockaddr_in6 *>(&addr);
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        in6->sin6_addr = in6addr_any;
+        if (!host.empty() && inet_pton(AF_INET6, host.substr(1, host.size() - 2).c_str(), &in6->sin6_addr) != 1)
+            return false;
+        listener.v6only = !host.empty();
+        listener.family = AF_INET6;
+        addrLen = sizeof(struct sockaddr_in6);
+        return true;
+    }
+
+    struct sockaddr_in *in = reinterpret_cast<struct sockaddr_in *>(&addr);
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &in->sin_addr) != 1)
+        return false;
+    listener.family = AF_INET;
+    addrLen = sizeof(struct sockaddr_in);
+    return true;
+}
+
+
+bool ChatServer::listenOn(const std::string &spec) {
+    Listener listener;
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+    if (!parseListener(spec, listener, addr, addrLen)) {
+        std::cerr << "Invalid listener " << spec << std::endl;
+        return false;
+    }
+
+    listener.fd = socket(listener.family, SOCK_STREAM, 0);
+    if (listener.fd < 0 && listener.family == AF_INET6 && !listener.v6only) {
+        // No IPv6 on this host: fall back to IPv4 on every address.
+        struct sockaddr_in *in = reinterpret_cast<struct sockaddr_in *>(&addr);
+        in_port_t port = reinterpret_cast<struct sockaddr_in6 *>(&addr)->sin6_port;
+        memset(&addr, 0, sizeof(addr));
+        in->sin_family = AF_INET;
+        in->sin_port = port;
+        in->sin_addr.s_addr = INADDR_ANY;
+        listener.family = AF_INET;
+        addrLen = sizeof(struct sockaddr_in);
+        listener.fd = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (listener.fd < 0) {
+        std::perror("Socket failed");
+        return false;
+    }
+
+    setNonBlocking(listener.fd);
+    fcntl(listener.fd, F_SETFD, FD_CLOEXEC);
+
+    int opt = 1;
+    struct stat st;
+    if (listener.family == AF_UNIX) {
+        if (lstat(listener.path.c_str(), &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                std::cerr << "Refusing to listen on " << spec << ": " << listener.path << " is not a socket"
+                          << std::endl;
+                close(listener.fd);
+                return false;
+            }
+            unlink(listener.path.c_str());
+        }
+    } else {
+        setsockopt(listener.fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    }
+    if (listener.family == AF_INET6) {
+        int v6only = listener.v6only ? 1 : 0;
+        setsockopt(listener.fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+
+    if (bind(listener.fd, reinterpret_cast<struct sockaddr *>(&addr), addrLen) < 0) {
+        std::cerr << "Bind failed for " << spec << ": " << strerror(errno) << std::endl;
+        close(listener.fd);
+        return false;
+    }
+
+    if (listener.family == AF_UNIX && lstat(listener.path.c_str(), &st) == 0) {
+        listener.dev = st.st_dev;
+        listener.ino = st.st_ino;
+    }
+
+    if (listen(listener.fd, listener.backlog) < 0) {
+        std::cerr << "Listen failed for " << spec << ": " << strerror(errno) << std::endl;
+        close(listener.fd);
+        return false;
+    }
+
+    listeners.push_back(listener);
+    pollfd pfd;
+    pfd.fd = listener.fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    fds.push_back(pfd);
+    std::cout << "Listening on " << spec << std::endl;
+    return true;
+}
+
+
+const Listener *ChatServer::findListener(int fd) const {
+    for (size_t i = 0; i < listeners.size(); i++) {
+        if (listeners[i].fd == fd)
+            return &listeners[i];
+    }
+    return NULL;
+}
+
+void ChatServer::closeListeners() {
+    for (size_t i = 0; i < listeners.size(); i++) {
+        for (std::vector<pollfd>::iterator p = fds.begin(); p != fds.end(); ++p) {
+            if (p->fd == listeners[i].fd) {
+                fds.erase(p);
+                break;
+            }
+        }
+        close(listeners[i].fd);
+        struct stat st;
+        if (listeners[i].ino && lstat(listeners[i].path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode) &&
+            st.st_dev == listeners[i].dev && st.st_ino == listeners[i].ino)
+            unlink(listeners[i].path.c_str());
+    }
+    listeners.clear();
+}
+
+
+void ChatServer::handleNewConnection(const Listener &listener) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    int client_fd = accept(listener.fd, reinterpret_cast<struct sockaddr *>(&client_addr), &client_len);
+    if (client_fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("Accept failed");
+        return;
+    }
+
+    char host[INET6_ADDRSTRLEN] = "unix";
+    if (client_addr.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &reinterpret_cast<struct sockaddr_in *>(&client_addr)->sin_addr, host, sizeof(host));
+    } else if (client_addr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &reinterpret_cast<struct sockaddr_in6 *>(&client_addr)->sin6_addr, host, sizeof(host));
+    }
+    if (memoryPressure() == MEMORY_HARD) {
+        const char refusal[] = "ERROR :Server is out of memory, try again later\r\n";
+        ssize_t n = send(client_fd, refusal, sizeof(refusal) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+        (void)n;
+        close(client_fd);
+        return;
+    }
+    if (listener.family != AF_UNIX) {
+        int one = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    std::cout << "New client connected: " << host << " via " << listener.spec << std::endl;
+    attachConnection(client_fd);
+}
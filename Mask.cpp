@@ -0,0 +1,154 @@
+#include "Mask.hpp"
+#include "Match.hpp"
+#include "Pool.hpp"
+#include <algorithm>
+#include <cctype>
+
+static std::string lowercase(const std::string &s) {
+    std::string out(s);
+    std::transform(out.begin(), out.end(), out.begin(), ::tolower);
+    return out;
+}
+
+static CompiledMask compile(const std::string &mask, const std::string &setter, time_t setAt) {
+    CompiledMask compiled;
+    compiled.text = mask;
+    compiled.setter = setter;
+    compiled.setAt = setAt;
+
+    std::string lower = lowercase(mask);
+    compiled.hasQuestion = lower.find('?') != std::string::npos;
+    compiled.hasStar = lower.find('*') != std::string::npos;
+
+    size_t first = lower.find('*');
+    size_t last = lower.rfind('*');
+    compiled.head = lower.substr(0, first);
+    if (compiled.hasStar) {
+        compiled.tail = lower.substr(last + 1);
+        size_t pos = first + 1;
+        while (pos < last) {
+            size_t next = lower.find('*', pos);
+            if (next > pos)
+                compiled.middle.push_back(lower.substr(pos, next - pos));
+            pos = next + 1;
+        }
+    }
+    return compiled;
+}
+
+// subject must already be lowercase.
+bool CompiledMask::matches(const std::string &subject) const {
+    if (hasQuestion)
+        return matchMask(lowercase(text), subject);
+    if (!hasStar)
+        return subject == head;
+    if (subject.size() < head.size() + tail.size())
+        return false;
+    if (subject.compare(0, head.size(), head) != 0 ||
+        subject.compare(subject.size() - tail.size(), tail.size(), tail) != 0)
+        return false;
+
+    size_t pos = head.size();
+    size_t end = subject.size() - tail.size();
+    for (size_t i = 0; i < middle.size(); i++) {
+        size_t found = subject.find(middle[i], pos);
+        if (found == std::string::npos || found + middle[i].size() > end)
+            return false;
+        pos = found + middle[i].size();
+    }
+    return true;
+}
+
+
+void MaskList::rebuild() {
+    buckets.clear();
+    unbucketed.clear();
+    for (size_t i = 0; i < masks.size(); i++) {
+        std::string prefix = literalPrefix(masks[i].head);
+        if (prefix.size() >= MASK_BUCKET_PREFIX)
+            buckets[prefix.substr(0, MASK_BUCKET_PREFIX)].push_back(i);
+        else
+            unbucketed.push_back(i);
+    }
+}
+
+bool MaskList::add(const std::string &mask, const std::string &setter, time_t setAt) {
+    std::string lower = lowercase(mask);
+    for (size_t i = 0; i < masks.size(); i++) {
+        if (lowercase(masks[i].text) == lower)
+            return false;
+    }
+    masks.push_back(compile(mask, setter, setAt));
+    rebuild();
+    return true;
+}
+
+bool MaskList::remove(const std::string &mask) {
+    std::string lower = lowercase(mask);
+    for (size_t i = 0; i < masks.size(); i++) {
+        if (lowercase(masks[i].text) == lower) {
+            masks.erase(masks.begin() + i);
+            rebuild();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MaskList::matches(const std::string &subject) const {
+    if (masks.empty())
+        return false;
+    std::string lower = lowercase(subject);
+
+    std::map<std::string, std::vector<size_t> >::const_iterator bucket =
+        buckets.find(lower.substr(0, MASK_BUCKET_PREFIX));
+    if (bucket != buckets.end()) {
+        for (size_t i = 0; i < bucket->second.size(); i++) {
+            if (masks[bucket->second[i]].matches(lower))
+                return true;
+        }
+    }
+    for (size_t i = 0; i < unbucketed.size(); i++) {
+        if (masks[unbucketed[i]].matches(lower))
+            return true;
+    }
+    return false;
+}
+
+bool MaskList::empty() const {
+    return masks.empty();
+}
+
+size_t MaskList::size() const {
+    return masks.size();
+}
+
+const std::vector<CompiledMask> &MaskList::entries() const {
+    return masks;
+}
+
+size_t MaskList::memoryUsage() const {
+    size_t total = masks.capacity() * sizeof(CompiledMask);
+    for (size_t i = 0; i < masks.size(); i++) {
+        const CompiledMask &m = masks[i];
+        total += stringHeapBytes(m.text) + stringHeapBytes(m.setter) +
+                 stringHeapBytes(m.head) + stringHeapBytes(m.tail) +
+                 m.middle.capacity() * sizeof(std::string);
+    }
+    total += buckets.size() * treeNodeBytes<std::pair<const std::string, std::vector<size_t> > >();
+    total += (masks.size() + unbucketed.capacity()) * sizeof(size_t);
+    return total;
+}
+
+
+std::string normalizeMask(const std::string &mask) {
+    size_t bang = mask.find('!');
+    size_t at = mask.find('@');
+    if (bang == std::string::npos && at == std::string::npos)
+        return mask + "!*@*";
+    if (bang == std::string::npos)
+        return "*!" + mask;
+    if (at == std::string::npos)
+        return mask + "@*";
+    return mask;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#ifndef MASK_HPP
+#define MASK_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+
+#define MASK_BUCKET_PREFIX 2
+#define MAX_LIST_MASKS 100
+
+// A nick!user@host mask split at its '*' wildcards, so matching is a
+// prefix compare, a suffix compare and an ordered find of the middle
+// pieces. Masks containing '?' fall back to the generic glob matcher.
+struct CompiledMask {
+    std::string text;
+    std::string setter;
+    time_t setAt;
+    std::string head;
+    std::string tail;
+    std::vector<std::string> middle;
+    bool hasStar;
+    bool hasQuestion;
+
+    bool matches(const std::string &subject) const;
+};
+
+// Ban, exception or invite-exception list of one channel. Masks are
+// bucketed by their first MASK_BUCKET_PREFIX literal characters, so a
+// lookup only tries the subject's bucket plus masks with a shorter prefix.
+// Matching is case-insensitive.
+class MaskList {
+private:
+    std::vector<CompiledMask> masks;
+    std::map<std::string, std::vector<size_t> > buckets;
+    std::vector<size_t> unbucketed;
+
+    void rebuild();
+
+public:
+    bool add(const std::string &mask, const std::string &setter, time_t setAt);
+    bool remove(const std::string &mask);
+    bool matches(const std::string &subject) const;
+    bool empty() const;
+    size_t size() const;
+    const std::vector<CompiledMask> &entries() const;
+    size_t memoryUsage() const;
+};
+
+// Expands "nick", "user@host" and "nick!user" into full nick!user@host form.
+std::string normalizeMask(const std::string &mask);
+
+#endif
@@ -0,0 +1,28 @@
+#include "Match.hpp"
+
+bool matchMask(const std::string &mask, const std::string &text) {
+    size_t m = 0, t = 0;
+    size_t star = std::string::npos, resume = 0;
+
+    while (t < text.size()) {
+        if (m < mask.size() && (mask[m] == '?' || mask[m] == text[t])) {
+            m++;
+            t++;
+        } else if (m < mask.size() && mask[m] == '*') {
+            star = m++;
+            resume = t;
+        } else if (star != std::string::npos) {
+            m = star + 1;
+            t = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (m < mask.size() && mask[m] == '*')
+        m++;
+    return m == mask.size();
+}
+
+std::string literalPrefix(const std::string &mask) {
+    return mask.substr(0, mask.find_first_of("*?"));
+}
@@ -0,0 +1,13 @@
+#pragma once
+#ifndef MATCH_HPP
+#define MATCH_HPP
+
+#include <string>
+
+// Glob matching with '*' (any run) and '?' (one character).
+bool matchMask(const std::string &mask, const std::string &text);
+
+// The characters before the first wildcard, usable as an index range.
+std::string literalPrefix(const std::string &mask);
+
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+#ifndef MEMSTATS_HPP
+#define MEMSTATS_HPP
+
+#include <cstddef>
+
+#define MEMORY_SOFT_LIMIT (512UL * 1024 * 1024)
+#define MEMORY_HARD_LIMIT (1024UL * 1024 * 1024)
+#define MEMORY_SOFT_ENV "IRCSERV_MEMORY_SOFT"
+#define MEMORY_HARD_ENV "IRCSERV_MEMORY_HARD"
+
+struct MemoryCounter {
+    size_t count;
+    size_t bytes;
+};
+
+// Per-subsystem live objects and bytes, filled in by MEMSTATS.
+struct MemoryStats {
+    MemoryCounter clients;
+    MemoryCounter input;
+    MemoryCounter output;
+    MemoryCounter channels;
+    MemoryCounter members;
+    MemoryCounter invites;
+    MemoryCounter topics;
+    MemoryCounter masks;
+    MemoryCounter history;
+    MemoryCounter search;
+};
+
+// What the periodic sweep has taken back since startup.
+struct ReclaimStats {
+    unsigned long sweeps;
+    unsigned long channels;
+    unsigned long members;
+    unsigned long operators;
+    unsigned long invites;
+};
+
+enum MemoryPressure { MEMORY_OK, MEMORY_SOFT, MEMORY_HARD };
+
+#endif
@@ -0,0 +1,121 @@
+#include "ChatServer.hpp"
+
+// Memory accounting. trackedMemory() is a running estimate kept from
+// counters that are updated as data comes and goes: pool-allocated channel
+// state, history, queued output, unparsed input and the client table. It is
+// cheap enough to consult on every accept and channel creation. Over the
+// soft limit no new channels are created; over the hard limit new
+// connections are refused too. MEMSTATS walks every structure for an exact
+// per-subsystem breakdown.
+
+void ChatServer::setMemoryLimits(size_t soft, size_t hard) {
+    memorySoftLimit = soft;
+    memoryHardLimit = hard;
+}
+
+size_t ChatServer::trackedMemory() {
+    return MemoryPool::getLiveBytes() + MemoryPool::getLargeBytes() + historyBytes +
+           outbox.pendingBytes() + inputBytes + searchIndex.bytes() +
+           clients.size() * treeNodeBytes<std::pair<const int, Client> >();
+}
+
+MemoryPressure ChatServer::memoryPressure() {
+    size_t used = trackedMemory();
+    MemoryPressure level = MEMORY_OK;
+    if (memoryHardLimit && used >= memoryHardLimit)
+        level = MEMORY_HARD;
+    else if (memorySoftLimit && used >= memorySoftLimit)
+        level = MEMORY_SOFT;
+    if (level != lastPressure) {
+        std::cerr << "Memory pressure " << (level == MEMORY_HARD ? "hard" : level == MEMORY_SOFT ? "soft" : "cleared")
+                  << " at " << used << " bytes" << std::endl;
+        lastPressure = level;
+    }
+    return level;
+}
+
+
+void ChatServer::collectMemoryStats(MemoryStats &stats) {
+    for (std::map<int, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
+        size_t buffered = it->second.getBufferSize();
+        stats.clients.count++;
+        stats.clients.bytes += it->second.memoryUsage() - buffered +
+                               treeNodeBytes<std::pair<const int, Client> >();
+        if (buffered) {
+            stats.input.count++;
+            stats.input.bytes += buffered;
+        }
+        if (it->first >= 0 && outbox.hasPending(it->first))
+            stats.output.count++;
+    }
+    stats.output.bytes = outbox.pendingBytes();
+
+    SearchStats search = searchIndex.stats();
+    stats.search.count = search.docs;
+    stats.search.bytes = search.bytes;
+
+    for (ChannelMap::iterator it = channels.begin(); it != channels.end(); ++it) {
+        it->second.addMemoryStats(stats);
+        stats.channels.bytes += treeNodeBytes<ChannelMap::value_type>() + stringHeapBytes(it->first);
+    }
+}
+
+
+void ChatServer::processMemstatsCommand(int client_fd) {
+    Client &client = clients[client_fd];
+    std::string nick = client.getNickname();
+    if (!client.hasUserMode(UMODE_OPER)) {
+        sendToClient(client_fd, ":irc.localhost 481 " + nick + " :Permission Denied- You're not an IRC operator\r\n");
+        return;
+    }
+
+    MemoryStats stats = MemoryStats();
+    collectMemoryStats(stats);
+    const char *names[] = {"clients", "input", "output", "channels", "members",
+                           "invites", "topics", "masks", "history", "search"};
+    const MemoryCounter *counters[] = {&stats.clients, &stats.input, &stats.output, &stats.channels,
+                                       &stats.members, &stats.invites, &stats.topics, &stats.masks,
+                                       &stats.history, &stats.search};
+
+    std::ostringstream report;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        report << ":irc.localhost 249 " << nick << " :" << names[i] << " " << counters[i]->count
+               << " objects " << counters[i]->bytes << " bytes\r\n";
+    }
+    report << ":irc.localhost 249 " << nick << " :pool " << MemoryPool::getLiveObjects() << " objects "
+           << MemoryPool::getLiveBytes() << " bytes " << MemoryPool::getReservedBytes() << " reserved\r\n";
+    MemoryPressure level = memoryPressure();
+    report << ":irc.localhost 249 " << nick << " :tracked " << trackedMemory() << " bytes soft "
+           << memorySoftLimit << " hard " << memoryHardLimit << " state "
+           << (level == MEMORY_HARD ? "hard" : level == MEMORY_SOFT ? "soft" : "ok") << "\r\n";
+    report << ":irc.localhost 249 " << nick << " :reclaimed " << reclaimStats.channels << " channels "
+           << reclaimStats.members << " members " << reclaimStats.operators << " operators "
+           << reclaimStats.invites << " invites in " << reclaimStats.sweeps << " sweeps\r\n";
+    report << ":irc.localhost 219 " << nick << " MEMSTATS :End of MEMSTATS report\r\n";
+    sendToClient(client_fd, report.str());
+}
+
+
+// OPER <name> <password>, checked against IRCSERV_OPER=<name>:<password>.
+void ChatServer::processOperCommand(int client_fd, std::istringstream &iss) {
+    std::string name, password;
+    iss >> name >> password;
+    Client &client = clients[client_fd];
+    std::string nick = client.getNickname();
+    if (password.empty()) {
+        sendToClient(client_fd, ":irc.localhost 461 " + nick + " OPER :Not enough parameters\r\n");
+        return;
+    }
+    const char *config = std::getenv(OPER_ENV);
+    if (!config) {
+        sendToClient(client_fd, ":irc.localhost 491 " + nick + " :No O-lines for your host\r\n");
+        return;
+    }
+    if (std::string(config) != name + ":" + password) {
+        sendToClient(client_fd, ":irc.localhost 464 " + nick + " :Password incorrect\r\n");
+        return;
+    }
+    client.setUserMode(UMODE_OPER, true);
+    sendToClient(client_fd, ":irc.localhost 381 " + nick + " :You are now an IRC operator\r\n");
+    sendToClient(client_fd, userPrefix(client) + " MODE " + nick + " :+o\r\n");
+}
@@ -0,0 +1,140 @@
+#include "ChatServer.hpp"
+
+// IRCv3 MONITOR. monitorWatchers maps a nickname to the local clients
+// watching it, so presence changes touch only those watchers. Each client
+// may watch at most MONITOR_LIMIT nicknames.
+
+// Appends numeric lines carrying a comma-separated list, split so no
+// line exceeds MAX_LINE_LENGTH.
+static void appendListReply(std::string &out, const std::string &head,
+                            const std::vector<std::string> &items) {
+    std::string line;
+    for (size_t i = 0; i < items.size(); i++) {
+        if (!line.empty() && head.size() + line.size() + 1 + items[i].size() + 2 > MAX_LINE_LENGTH) {
+            out += head + line + "\r\n";
+            line.clear();
+        }
+        line += (line.empty() ? "" : ",") + items[i];
+    }
+    if (!line.empty())
+        out += head + line + "\r\n";
+}
+
+
+void ChatServer::notifyWatchers(int id, bool online) {
+    Client &client = clients[id];
+    std::map<std::string, std::set<int> >::iterator it = monitorWatchers.find(client.getNickname());
+    if (it == monitorWatchers.end()) {
+        return;
+    }
+    std::string target = online ? client.getNickname() + "!" + client.getUsername() + "@localhost"
+                                : client.getNickname();
+    for (std::set<int>::iterator w = it->second.begin(); w != it->second.end(); ++w) {
+        if (*w == id)
+            continue;
+        std::string nick = clients[*w].getNickname();
+        sendToClient(*w, ":irc.localhost " + std::string(online ? "730 " : "731 ") + nick +
+                         " :" + target + "\r\n");
+    }
+}
+
+
+void ChatServer::clearMonitored(int client_fd) {
+    Client &client = clients[client_fd];
+    std::set<std::string> targets = client.getMonitored();
+    for (std::set<std::string>::iterator it = targets.begin(); it != targets.end(); ++it) {
+        std::map<std::string, std::set<int> >::iterator entry = monitorWatchers.find(*it);
+        if (entry != monitorWatchers.end()) {
+            entry->second.erase(client_fd);
+            if (entry->second.empty())
+                monitorWatchers.erase(entry);
+        }
+        client.removeMonitored(*it);
+    }
+}
+
+
+void ChatServer::sendMonitorStatus(int client_fd, const std::vector<std::string> &targets) {
+    std::string nick = clients[client_fd].getNickname();
+    std::vector<std::string> online, offline;
+    for (size_t i = 0; i < targets.size(); i++) {
+        int id = getFdByNickname(targets[i]);
+        if (id != -1 && clients[id].hasSentWelcome())
+            online.push_back(targets[i] + "!" + clients[id].getUsername() + "@localhost");
+        else
+            offline.push_back(targets[i]);
+    }
+    std::string out;
+    appendListReply(out, ":irc.localhost 730 " + nick + " :", online);
+    appendListReply(out, ":irc.localhost 731 " + nick + " :", offline);
+    if (!out.empty())
+        sendToClient(client_fd, out);
+}
+
+
+void ChatServer::processMonitorCommand(int client_fd, std::istringstream &iss) {
+    std::string modifier, targetList;
+    iss >> modifier >> targetList;
+    Client &client = clients[client_fd];
+    std::string nick = client.getNickname();
+
+    if (modifier.empty()) {
+        sendToClient(client_fd, ":irc.localhost 461 " + nick + " MONITOR :Not enough parameters\r\n");
+        return;
+    }
+
+    std::vector<std::string> targets = splitCommaList(targetList);
+    if ((modifier == "+" || modifier == "-") && targets.empty()) {
+        sendToClient(client_fd, ":irc.localhost 461 " + nick + " MONITOR :Not enough parameters\r\n");
+        return;
+    }
+
+    if (modifier == "+") {
+        std::vector<std::string> added;
+        for (size_t i = 0; i < targets.size(); i++) {
+            if (client.getMonitored().count(targets[i]))
+                continue;
+            if (client.getMonitored().size() >= MONITOR_LIMIT) {
+                std::vector<std::string> rest(targets.begin() + i, targets.end());
+                std::string list;
+                for (size_t j = 0; j < rest.size(); j++)
+                    list += (j ? "," : "") + rest[j];
+                std::ostringstream full;
+                full << ":irc.localhost 734 " << nick << " " << MONITOR_LIMIT << " " << list
+                     << " :Monitor list is full.\r\n";
+                sendMonitorStatus(client_fd, added);
+                sendToClient(client_fd, full.str());
+                return;
+            }
+            client.addMonitored(targets[i]);
+            monitorWatchers[targets[i]].insert(client_fd);
+            added.push_back(targets[i]);
+        }
+        sendMonitorStatus(client_fd, added);
+    } else if (modifier == "-") {
+        for (size_t i = 0; i < targets.size(); i++) {
+            if (!client.removeMonitored(targets[i]))
+                continue;
+            std::map<std::string, std::set<int> >::iterator entry = monitorWatchers.find(targets[i]);
+            if (entry != monitorWatchers.end()) {
+                entry->second.erase(client_fd);
+                if (entry->second.empty())
+                    monitorWatchers.erase(entry);
+            }
+        }
+    } else if (modifier == "C" || modifier == "c") {
+        clearMonitored(client_fd);
+    } else if (modifier == "L" || modifier == "l") {
+        std::vector<std::string> list(client.getMonitored().begin(), client.getMonitored().end());
+        std::string out;
+        appendListReply(out, ":irc.localhost 732 " + nick + " :", list);
+        out += ":irc.localhost 733 " + nick + " :End of MONITOR list\r\n";
+        sendToClient(client_fd, out);
+    } else if (modifier == "S" || modifier == "s") {
+        std::vector<std::string> list(client.getMonitored().begin(), client.getMonitored().end());
+        sendMonitorStatus(client_fd, list);
+    } else {
+        sendToClient(client_fd, ":irc.localhost 421 " + nick + " MONITOR " + modifier +
+                                    " :Unknown MONITOR modifier\r\n");
+    }
+}
@@ -0,0 +1,120 @@
+#include "ChatServer.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The registration burst (001-005 and the MOTD) is rendered once into a
+// template split around the nickname, so welcoming a client is one string
+// build and one queued write. The MOTD file is mapped rather than read.
+// SIGHUP reloads it; the new template replaces the old one only once it is
+// complete, and a file that cannot be read leaves the old one in place.
+
+volatile sig_atomic_t ChatServer::reloadRequested = 0;
+
+void ChatServer::handleReloadSignal(int) {
+    reloadRequested = 1;
+}
+
+static std::string motdPath() {
+    const char *path = std::getenv(MOTD_ENV);
+    return path ? path : MOTD_FILE;
+}
+
+// Reads the MOTD into lines. A missing file is an empty MOTD.
+static bool readMotd(const std::string &path, std::vector<std::string> &lines) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return true;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    const char *data = static_cast<const char *>(map);
+    size_t size = st.st_size;
+    for (size_t start = 0; start < size;) {
+        const char *newline = static_cast<const char *>(memchr(data + start, '\n', size - start));
+        size_t end = newline ? newline - data : size;
+        std::string line(data + start, std::min(end - start, static_cast<size_t>(MOTD_LINE_LENGTH)));
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        if (line.find('\0') == std::string::npos)
+            lines.push_back(line);
+        start = end + 1;
+    }
+    munmap(map, size);
+    return true;
+}
+
+void ChatServer::loadMotd() {
+    std::string path = motdPath();
+    std::vector<std::string> lines;
+    if (!readMotd(path, lines)) {
+        std::cerr << "Cannot read MOTD " << path << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    motdLines.swap(lines);
+    renderWelcome();
+    std::cout << "Loaded MOTD from " << path << " (" << motdLines.size() << " lines)" << std::endl;
+}
+
+void ChatServer::renderWelcome() {
+    char created[64];
+    strftime(created, sizeof(created), "%a %b %d %Y at %H:%M:%S UTC", gmtime(&startedAt));
+
+    std::ostringstream isupport;
+    isupport << "CHANTYPES=# PREFIX=(o)@ CHANMODES=beI,k,l,it MODES=" << MAX_MODE_CHANGES
+             << " TARGMAX=PRIVMSG:" << TARGMAX << ",NOTICE:" << TARGMAX << " MONITOR=" << MONITOR_LIMIT
+             << " EXCEPTS=e INVEX=I ELIST=MU CHATHISTORY=" << HISTORY_MAX_MESSAGES << " UTF8ONLY";
+
+    std::vector<std::string> lines;
+    lines.push_back("001|:Welcome to the IRC server!");
+    lines.push_back("002|:Your host is " + serverName + ", running version " SERVER_VERSION);
+    lines.push_back(std::string("003|:This server was created ") + created);
+    lines.push_back("004|" + serverName + " " SERVER_VERSION " iow beIiklot beIklo");
+    lines.push_back("005|" + isupport.str() + " :are supported by this server");
+    lines.push_back("375|:- " + serverName + " Message of the Day -");
+    for (size_t i = 0; i < motdLines.size(); i++)
+        lines.push_back("372|:- " + motdLines[i]);
+    lines.push_back("376|:End of /MOTD command.");
+
+    std::vector<std::string> parts(1);
+    for (size_t i = 0; i < lines.size(); i++) {
+        parts.back() += ":irc.localhost " + lines[i].substr(0, 3) + " ";
+        parts.push_back(" " + lines[i].substr(4) + "\r\n");
+    }
+    size_t bytes = 0;
+    for (size_t i = 0; i < parts.size(); i++)
+        bytes += parts[i].size();
+    welcomeParts.swap(parts);
+    welcomeBytes = bytes;
+}
+
+void ChatServer::sendWelcome(int client_fd, const std::string &nick) {
+    if (welcomeParts.empty())
+        renderWelcome();
+    std::string burst;
+    burst.reserve(welcomeBytes + nick.size() * (welcomeParts.size() - 1));
+    burst += welcomeParts[0];
+    for (size_t i = 1; i < welcomeParts.size(); i++) {
+        burst += nick;
+        burst += welcomeParts[i];
+    }
+    sendToClient(client_fd, burst);
+}
+
+void ChatServer::enableMotdReload() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleReloadSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+}
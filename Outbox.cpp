@@ -0,0 +1,447 @@
+#include "Outbox.hpp"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define OUTBOX_MAX_SLOTS (1 << 20)
+
+Outbox::Outbox() : outstanding(0), stopping(false), queuedBytes(0) {
+    pthread_mutex_init(&queueLock, NULL);
+    pthread_cond_init(&workReady, NULL);
+    pthread_cond_init(&allDone, NULL);
+    pthread_mutex_init(&blockedLock, NULL);
+    wakePipe[0] = -1;
+    wakePipe[1] = -1;
+
+    // Sized up front so workers can index it without taking a lock.
+    size_t size = 1024;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur > size)
+        size = rl.rlim_cur > OUTBOX_MAX_SLOTS ? OUTBOX_MAX_SLOTS : rl.rlim_cur;
+    slots.resize(size, NULL);
+}
+
+Outbox::~Outbox() {
+    stop();
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i]) {
+            pthread_mutex_destroy(&slots[i]->lock);
+            delete slots[i];
+        }
+    }
+    for (size_t i = 0; i < memorySlots.size(); i++) {
+        if (memorySlots[i]) {
+            pthread_mutex_destroy(&memorySlots[i]->lock);
+            delete memorySlots[i];
+        }
+    }
+    pthread_mutex_destroy(&queueLock);
+    pthread_cond_destroy(&workReady);
+    pthread_cond_destroy(&allDone);
+    pthread_mutex_destroy(&blockedLock);
+}
+
+
+void Outbox::start(size_t threads) {
+    if (threads == 0 || !workers.empty())
+        return;
+    if (pipe(wakePipe) < 0) {
+        perror("Outbox pipe failed, fan-out disabled");
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(wakePipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(wakePipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    shards.resize(threads * FANOUT_SHARDS_PER_THREAD);
+    for (size_t i = 0; i < shards.size(); i++)
+        shards[i].busy = false;
+
+    // Signals stay with the main thread so poll() still sees EINTR.
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+    workers.resize(threads);
+    size_t started = 0;
+    for (; started < threads; started++) {
+        workers[started].outbox = this;
+        workers[started].home = started;
+        if (pthread_create(&workers[started].thread, NULL, workerMain, &workers[started]) != 0)
+            break;
+    }
+    workers.resize(started);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (workers.empty()) {
+        perror("Outbox thread creation failed, fan-out disabled");
+        close(wakePipe[0]);
+        close(wakePipe[1]);
+        wakePipe[0] = -1;
+        wakePipe[1] = -1;
+    }
+}
+
+void Outbox::stop() {
+    if (workers.empty())
+        return;
+    pthread_mutex_lock(&queueLock);
+    stopping = true;
+    pthread_cond_broadcast(&workReady);
+    pthread_mutex_unlock(&queueLock);
+    for (size_t i = 0; i < workers.size(); i++)
+        pthread_join(workers[i].thread, NULL);
+    workers.clear();
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+    wakePipe[0] = -1;
+    wakePipe[1] = -1;
+}
+
+// Blocks until every queued chunk has been written or buffered.
+void Outbox::quiesce() {
+    pthread_mutex_lock(&queueLock);
+    while (outstanding > 0)
+        pthread_cond_wait(&allDone, &queueLock);
+    pthread_mutex_unlock(&queueLock);
+}
+
+bool Outbox::isThreaded() const {
+    return !workers.empty();
+}
+
+
+void *Outbox::workerMain(void *arg) {
+    Worker *worker = static_cast<Worker *>(arg);
+    worker->outbox->workerLoop(worker->home);
+    return NULL;
+}
+
+void Outbox::workerLoop(size_t home) {
+    pthread_mutex_lock(&queueLock);
+    while (true) {
+        size_t shard;
+        Job *job = takeJob(home, shard);
+        if (!job) {
+            if (stopping)
+                break;
+            pthread_cond_wait(&workReady, &queueLock);
+            continue;
+        }
+        pthread_mutex_unlock(&queueLock);
+        runJob(job);
+        delete job;
+        pthread_mutex_lock(&queueLock);
+        shards[shard].busy = false;
+        if (--outstanding == 0)
+            pthread_cond_broadcast(&allDone);
+    }
+    pthread_mutex_unlock(&queueLock);
+}
+
+// Called with queueLock held. Home shards are checked first.
+Outbox::Job *Outbox::takeJob(size_t home, size_t &shard) {
+    size_t count = shards.size();
+    size_t first = home * FANOUT_SHARDS_PER_THREAD;
+    for (size_t i = 0; i < count; i++) {
+        size_t idx = (first + i) % count;
+        if (!shards[idx].busy && !shards[idx].jobs.empty()) {
+            Job *job = shards[idx].jobs.front();
+            shards[idx].jobs.pop_front();
+            shards[idx].busy = true;
+            shard = idx;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+void Outbox::runJob(Job *job) {
+    const std::string &data = job->line.str();
+    for (size_t i = 0; i < job->targets.size(); i++) {
+        int fd = job->targets[i].first;
+        Slot *slot = slotFor(fd);
+        bool waiting = false;
+        pthread_mutex_lock(&slot->lock);
+        if (slot->generation == job->targets[i].second)
+            waiting = writeLocked(fd, *slot, data.data(), data.size());
+        __sync_sub_and_fetch(&slot->inflight, 1);
+        pthread_mutex_unlock(&slot->lock);
+        if (waiting)
+            noteBlocked(fd);
+    }
+}
+
+// Worker-side sockets that filled up are handed back to the main loop,
+// which owns the poll set and arms POLLOUT for them.
+void Outbox::noteBlocked(int fd) {
+    pthread_mutex_lock(&blockedLock);
+    blocked.push_back(fd);
+    pthread_mutex_unlock(&blockedLock);
+    char byte = 0;
+    ssize_t n = write(wakePipe[1], &byte, 1);
+    (void)n;
+}
+
+void Outbox::noteOverflowed(int fd) {
+    pthread_mutex_lock(&blockedLock);
+    overflowed.push_back(fd);
+    pthread_mutex_unlock(&blockedLock);
+    if (wakePipe[1] >= 0) {
+        char byte = 0;
+        ssize_t n = write(wakePipe[1], &byte, 1);
+        (void)n;
+    }
+}
+
+int Outbox::wakeupFd() const {
+    return wakePipe[0];
+}
+
+void Outbox::collectBlocked(std::vector<int> &out) {
+    char drain[256];
+    while (read(wakePipe[0], drain, sizeof(drain)) > 0) {
+    }
+    pthread_mutex_lock(&blockedLock);
+    out.swap(blocked);
+    blocked.clear();
+    pthread_mutex_unlock(&blockedLock);
+}
+
+// Only sockets still over the limit are returned; a descriptor that was
+// closed and reused since it was noted has a fresh slot state.
+void Outbox::collectOverflowed(std::vector<int> &out) {
+    std::vector<int> noted;
+    pthread_mutex_lock(&blockedLock);
+    noted.swap(overflowed);
+    pthread_mutex_unlock(&blockedLock);
+    for (size_t i = 0; i < noted.size(); i++) {
+        Slot *slot = slotFor(noted[i]);
+        if (!slot)
+            continue;
+        pthread_mutex_lock(&slot->lock);
+        if (slot->overflowed)
+            out.push_back(noted[i]);
+        pthread_mutex_unlock(&slot->lock);
+    }
+}
+
+
+Outbox::Slot *Outbox::slotFor(int fd) {
+    if (fd >= MEMORY_ID_BASE) {
+        size_t index = fd - MEMORY_ID_BASE;
+        return index < memorySlots.size() ? memorySlots[index] : NULL;
+    }
+    if (fd < 0 || static_cast<size_t>(fd) >= slots.size())
+        return NULL;
+    return slots[fd];
+}
+
+// Sends what the socket accepts and keeps the rest. Returns whether output
+// is still waiting for POLLOUT.
+bool Outbox::writeLocked(int fd, Slot &slot, const char *data, size_t len) {
+    if (slot.memory) {
+        slot.pending.append(data, len);
+        __sync_add_and_fetch(&queuedBytes, len);
+        return false;
+    }
+    if (slot.overflowed)
+        return true;
+    size_t sent = 0;
+    while (slot.pending.empty() && sent < len) {
+        ssize_t n = ::send(fd, data + sent, len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    if (sent < len) {
+        slot.pending.append(data + sent, len - sent);
+        __sync_add_and_fetch(&queuedBytes, len - sent);
+    }
+    if (slot.pending.size() > SENDQ_MAX_BYTES) {
+        slot.overflowed = true;
+        noteOverflowed(fd);
+    }
+    return !slot.pending.empty();
+}
+
+void Outbox::attach(int fd, bool memory) {
+    if (fd < 0)
+        return;
+    std::vector<Slot *> &table = memory ? memorySlots : slots;
+    size_t index = memory ? fd - MEMORY_ID_BASE : fd;
+    if (index >= table.size()) {
+        // Workers read the table unlocked, so let them finish first.
+        quiesce();
+        table.resize(memory ? index + index / 2 + 1 : index + 1, NULL);
+    }
+    if (!table[index]) {
+        Slot *slot = new Slot;
+        pthread_mutex_init(&slot->lock, NULL);
+        slot->generation = 0;
+        slot->inflight = 0;
+        slot->memory = memory;
+        slot->overflowed = false;
+        table[index] = slot;
+    } else {
+        pthread_mutex_lock(&table[index]->lock);
+        __sync_sub_and_fetch(&queuedBytes, table[index]->pending.size());
+        std::string().swap(table[index]->pending);
+        table[index]->overflowed = false;
+        pthread_mutex_unlock(&table[index]->lock);
+    }
+}
+
+// Chunks still queued for this fd are skipped once the generation moves on,
+// so a reused descriptor never receives the previous owner's lines.
+void Outbox::detach(int fd) {
+    Slot *slot = slotFor(fd);
+    if (!slot)
+        return;
+    pthread_mutex_lock(&slot->lock);
+    __sync_sub_and_fetch(&queuedBytes, slot->pending.size());
+    std::string().swap(slot->pending);
+    slot->overflowed = false;
+    slot->generation++;
+    pthread_mutex_unlock(&slot->lock);
+}
+
+bool Outbox::push(int fd, const std::string &data) {
+    Slot *slot = slotFor(fd);
+    if (!slot)
+        return false;
+
+    // Chunks for this fd are still queued, so go behind them.
+    if (__sync_add_and_fetch(&slot->inflight, 0) > 0) {
+        Job *job = new Job;
+        job->line = SharedLine(data);
+        job->targets.push_back(std::make_pair(fd, slot->generation));
+        __sync_add_and_fetch(&slot->inflight, 1);
+        pthread_mutex_lock(&queueLock);
+        shards[fd % shards.size()].jobs.push_back(job);
+        outstanding++;
+        pthread_cond_signal(&workReady);
+        pthread_mutex_unlock(&queueLock);
+        return false;
+    }
+
+    pthread_mutex_lock(&slot->lock);
+    bool waiting = writeLocked(fd, *slot, data.data(), data.size());
+    pthread_mutex_unlock(&slot->lock);
+    return waiting;
+}
+
+void Outbox::fanout(const std::vector<int> &fds, const SharedLine &line) {
+    std::vector<Job *> chunks(shards.size(), static_cast<Job *>(NULL));
+    for (size_t i = 0; i < fds.size(); i++) {
+        Slot *slot = slotFor(fds[i]);
+        if (!slot)
+            continue;
+        Job *&job = chunks[fds[i] % shards.size()];
+        if (!job) {
+            job = new Job;
+            job->line = line;
+        }
+        job->targets.push_back(std::make_pair(fds[i], slot->generation));
+        __sync_add_and_fetch(&slot->inflight, 1);
+    }
+
+    pthread_mutex_lock(&queueLock);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (chunks[i]) {
+            shards[i].jobs.push_back(chunks[i]);
+            outstanding++;
+        }
+    }
+    pthread_cond_broadcast(&workReady);
+    pthread_mutex_unlock(&queueLock);
+}
+
+bool Outbox::flush(int fd) {
+    Slot *slot = slotFor(fd);
+    if (!slot || slot->memory)
+        return false;
+    pthread_mutex_lock(&slot->lock);
+    size_t sent = 0;
+    while (sent < slot->pending.size()) {
+        ssize_t n = ::send(fd, slot->pending.data() + sent, slot->pending.size() - sent,
+                           MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    slot->pending.erase(0, sent);
+    __sync_sub_and_fetch(&queuedBytes, sent);
+    bool waiting = !slot->pending.empty();
+    pthread_mutex_unlock(&slot->lock);
+    return waiting;
+}
+
+bool Outbox::hasPending(int fd) {
+    Slot *slot = slotFor(fd);
+    if (!slot)
+        return false;
+    pthread_mutex_lock(&slot->lock);
+    bool waiting = !slot->pending.empty();
+    pthread_mutex_unlock(&slot->lock);
+    return waiting;
+}
+
+size_t Outbox::pendingSize(int fd) {
+    Slot *slot = slotFor(fd);
+    if (!slot)
+        return 0;
+    pthread_mutex_lock(&slot->lock);
+    size_t size = slot->pending.size();
+    pthread_mutex_unlock(&slot->lock);
+    return size;
+}
+
+std::string Outbox::pendingOutput(int fd) {
+    Slot *slot = slotFor(fd);
+    if (!slot)
+        return std::string();
+    pthread_mutex_lock(&slot->lock);
+    std::string copy = slot->pending;
+    pthread_mutex_unlock(&slot->lock);
+    return copy;
+}
+
+void Outbox::restorePending(int fd, const std::string &data) {
+    attach(fd);
+    Slot *slot = slotFor(fd);
+    pthread_mutex_lock(&slot->lock);
+    __sync_sub_and_fetch(&queuedBytes, slot->pending.size());
+    slot->pending = data;
+    __sync_add_and_fetch(&queuedBytes, data.size());
+    pthread_mutex_unlock(&slot->lock);
+}
+
+size_t Outbox::pendingBytes() {
+    return __sync_add_and_fetch(&queuedBytes, 0);
+}
+
+// Hands over everything queued for an in-memory connection. Chunks still
+// with the workers are waited for so the caller sees complete output.
+std::string Outbox::takeOutput(int fd) {
+    std::string out;
+    Slot *slot = slotFor(fd);
+    if (!slot)
+        return out;
+    if (__sync_add_and_fetch(&slot->inflight, 0) > 0)
+        quiesce();
+    pthread_mutex_lock(&slot->lock);
+    out.swap(slot->pending);
+    __sync_sub_and_fetch(&queuedBytes, out.size());
+    pthread_mutex_unlock(&slot->lock);
+    return out;
+}
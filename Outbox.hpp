@@ -0,0 +1,102 @@
+#pragma once
+#ifndef OUTBOX_HPP
+#define OUTBOX_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <pthread.h>
+#include "History.hpp"
+
+#define FANOUT_THREADS 4
+#define FANOUT_THRESHOLD 1000
+#define FANOUT_SHARDS_PER_THREAD 4
+#define MEMORY_ID_BASE (1 << 30)
+#define SENDQ_MAX_BYTES (1024 * 1024)
+
+// Per-connection output queues shared by the main loop and a pool of sender
+// threads. A large broadcast is split into one chunk per shard (fd modulo the
+// shard count). A shard is drained by at most one worker at a time, in FIFO
+// order, so every recipient sees its lines in the order they were queued.
+// Workers start with their own shards and steal idle ones from the others.
+// In-memory connections use ids from MEMORY_ID_BASE up, above any real fd;
+// their output stays queued until takeOutput(). A socket whose backlog
+// passes SENDQ_MAX_BYTES stops queueing and is reported by collectOverflowed().
+class Outbox {
+private:
+    struct Slot {
+        pthread_mutex_t lock;
+        std::string pending;
+        unsigned int generation;
+        int inflight;
+        bool memory;
+        bool overflowed;
+    };
+    struct Job {
+        SharedLine line;
+        std::vector<std::pair<int, unsigned int> > targets;
+    };
+    struct Shard {
+        std::deque<Job *> jobs;
+        bool busy;
+    };
+    struct Worker {
+        Outbox *outbox;
+        size_t home;
+        pthread_t thread;
+    };
+
+    std::vector<Slot *> slots;
+    std::vector<Slot *> memorySlots;
+    std::vector<Shard> shards;
+    std::vector<Worker> workers;
+    pthread_mutex_t queueLock;
+    pthread_cond_t workReady;
+    pthread_cond_t allDone;
+    size_t outstanding;
+    bool stopping;
+    pthread_mutex_t blockedLock;
+    std::vector<int> blocked;
+    std::vector<int> overflowed;
+    int wakePipe[2];
+    size_t queuedBytes;
+
+    Outbox(const Outbox &);
+    Outbox &operator=(const Outbox &);
+
+    static void *workerMain(void *arg);
+    void workerLoop(size_t home);
+    Job *takeJob(size_t home, size_t &shard);
+    void runJob(Job *job);
+    Slot *slotFor(int fd);
+    bool writeLocked(int fd, Slot &slot, const char *data, size_t len);
+    void noteBlocked(int fd);
+    void noteOverflowed(int fd);
+
+public:
+    Outbox();
+    ~Outbox();
+
+    void start(size_t threads);
+    void stop();
+    void quiesce();
+    bool isThreaded() const;
+
+    void attach(int fd, bool memory = false);
+    void detach(int fd);
+    bool push(int fd, const std::string &data);
+    void fanout(const std::vector<int> &fds, const SharedLine &line);
+    bool flush(int fd);
+    bool hasPending(int fd);
+    size_t pendingSize(int fd);
+    std::string pendingOutput(int fd);
+    void restorePending(int fd, const std::string &data);
+    size_t pendingBytes();
+    std::string takeOutput(int fd);
+
+    int wakeupFd() const;
+    void collectBlocked(std::vector<int> &out);
+    void collectOverflowed(std::vector<int> &out);
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include "ChatServer.hpp"
+
+// Admission control. Each pass of step() measures how long input could not
+// be looked at: its own work plus any time poll() overslept its timeout.
+// The lag is averaged over wall-clock time, LOAD_LAG_WINDOW_US, so a loop
+// spinning through many cheap passes does not dilute one slow pass. The
+// average picks a load level, with hysteresis so it does not flap. As the
+// level rises the scheduler hands each client fewer lines per tick,
+// listeners stop being polled, LIST/NAMES/WHO and joins to large channels
+// wait in the client's buffer, and channel NOTICEs are not fanned out.
+
+static const char *loadLevelName(LoadLevel level) {
+    static const char *names[] = {"normal", "elevated", "overloaded", "critical"};
+    return names[level];
+}
+
+static const long loadThresholds[] = {0, LOAD_ELEVATED_US, LOAD_OVERLOADED_US, LOAD_CRITICAL_US};
+
+void ChatServer::recordLoopLag(long lagUs, long elapsedUs) {
+    loadStats.lastLagUs = lagUs;
+    if (lagUs > loadStats.maxLagUs)
+        loadStats.maxLagUs = lagUs;
+    if (elapsedUs > 0)
+        lagAverageUs += (lagUs - lagAverageUs) * elapsedUs / (elapsedUs + LOAD_LAG_WINDOW_US);
+
+    LoadLevel level = loadLevel;
+    while (level < LOAD_CRITICAL && lagAverageUs >= loadThresholds[level + 1])
+        level = static_cast<LoadLevel>(level + 1);
+    while (level > LOAD_NORMAL && lagAverageUs < loadThresholds[level] / 2)
+        level = static_cast<LoadLevel>(level - 1);
+    if (level == loadLevel)
+        return;
+
+    std::cerr << "Load " << loadLevelName(level) << " at " << lagAverageUs / 1000 << " ms lag" << std::endl;
+    if ((level >= LOAD_OVERLOADED) != (loadLevel >= LOAD_OVERLOADED))
+        setListenersPaused(level >= LOAD_OVERLOADED);
+    if (level < LOAD_OVERLOADED)
+        inputPostponed.clear();
+    loadLevel = level;
+    loadStats.entered[level]++;
+    loadStats.lastChange = time(NULL);
+}
+
+void ChatServer::setListenersPaused(bool paused) {
+    for (std::vector<pollfd>::iterator it = fds.begin(); it != fds.end(); ++it) {
+        if (findListener(it->fd))
+            it->events = paused ? 0 : POLLIN;
+    }
+}
+
+// LIST, NAMES, WHO and a JOIN that touches a large channel are held back
+// while overloaded.
+bool ChatServer::shouldPostpone(const std::string &message) {
+    if (loadLevel < LOAD_OVERLOADED)
+        return false;
+    std::istringstream iss(message);
+    std::string command, target;
+    iss >> command >> target;
+    while (!command.empty() && (command[0] == '/' || command[0] == '\\'))
+        command.erase(0, 1);
+    std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+    if (command == "LIST" || command == "NAMES" || command == "WHO")
+        return true;
+    if (command != "JOIN")
+        return false;
+
+    std::vector<std::string> names = splitCommaList(target);
+    for (size_t i = 0; i < names.size(); i++) {
+        std::string name = names[i][0] == '#' ? names[i] : "#" + names[i];
+        ChannelMap::iterator it = channels.find(name);
+        if (it != channels.end() && it->second.getMemberCount() >= LARGE_CHANNEL_MEMBERS)
+            return true;
+    }
+    return false;
+}
+
+void ChatServer::processLoadstatsCommand(int client_fd) {
+    Client &client = clients[client_fd];
+    std::string nick = client.getNickname();
+    if (!client.hasUserMode(UMODE_OPER)) {
+        sendToClient(client_fd, ":irc.localhost 481 " + nick + " :Permission Denied- You're not an IRC operator\r\n");
+        return;
+    }
+
+    std::string prefix = ":irc.localhost 249 " + nick + " :";
+    std::ostringstream report;
+    report << prefix << "state " << loadLevelName(loadLevel) << " since " << loadStats.lastChange << "\r\n";
+    report << prefix << "lag " << loadStats.lastLagUs << " us average " << lagAverageUs << " us max "
+           << loadStats.maxLagUs << " us\r\n";
+    report << prefix << "entered";
+    for (int level = LOAD_NORMAL; level <= LOAD_CRITICAL; level++)
+        report << " " << loadLevelName(static_cast<LoadLevel>(level)) << " " << loadStats.entered[level];
+    report << "\r\n";
+    report << prefix << "budget " << lineBudget() << " lines backlog " << inputBacklog.size()
+           << " clients accept " << (loadLevel >= LOAD_OVERLOADED ? "paused" : "open") << "\r\n";
+    report << prefix << "throttled " << loadStats.throttled << " postponed " << loadStats.postponed
+           << " shed " << loadStats.shed << "\r\n";
+    report << ":irc.localhost 219 " << nick << " LOADSTATS :End of LOADSTATS report\r\n";
+    sendToClient(client_fd, report.str());
+}
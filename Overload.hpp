@@ -0,0 +1,29 @@
+#pragma once
+#ifndef OVERLOAD_HPP
+#define OVERLOAD_HPP
+
+#include <ctime>
+
+// Smoothed event loop lag, in microseconds, at which each level is entered.
+// A level is left once the lag falls below half its entry threshold.
+#define LOAD_ELEVATED_US 20000
+#define LOAD_OVERLOADED_US 50000
+#define LOAD_CRITICAL_US 100000
+#define LOAD_LAG_WINDOW_US 500000
+#define LOAD_POLL_MS 50
+#define LARGE_CHANNEL_MEMBERS 1000
+
+enum LoadLevel { LOAD_NORMAL, LOAD_ELEVATED, LOAD_OVERLOADED, LOAD_CRITICAL };
+
+// Counters reported by LOADSTATS.
+struct LoadStats {
+    long lastLagUs;
+    long maxLagUs;
+    unsigned long entered[4];
+    time_t lastChange;
+    unsigned long throttled;
+    unsigned long postponed;
+    unsigned long shed;
+};
+
+#endif
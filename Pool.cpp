@@ -0,0 +1,77 @@
+#include "Pool.hpp"
+
+MemoryPool::FreeNode *MemoryPool::freeLists[POOL_CLASSES] = {0};
+size_t MemoryPool::liveBytes = 0;
+size_t MemoryPool::liveObjects = 0;
+size_t MemoryPool::reservedBytes = 0;
+size_t MemoryPool::largeBytes = 0;
+
+static size_t classFor(size_t bytes) {
+    return (bytes + POOL_GRANULARITY - 1) / POOL_GRANULARITY - 1;
+}
+
+void MemoryPool::refill(size_t sizeClass) {
+    size_t chunk = (sizeClass + 1) * POOL_GRANULARITY;
+    char *block = static_cast<char *>(::operator new(POOL_BLOCK_BYTES));
+    reservedBytes += POOL_BLOCK_BYTES;
+
+    for (size_t off = 0; off + chunk <= POOL_BLOCK_BYTES; off += chunk) {
+        FreeNode *node = reinterpret_cast<FreeNode *>(block + off);
+        node->next = freeLists[sizeClass];
+        freeLists[sizeClass] = node;
+    }
+}
+
+void *MemoryPool::allocate(size_t bytes) {
+    if (bytes == 0)
+        bytes = 1;
+    if (bytes > POOL_MAX_BYTES) {
+        largeBytes += bytes;
+        return ::operator new(bytes);
+    }
+
+    size_t sizeClass = classFor(bytes);
+    if (!freeLists[sizeClass])
+        refill(sizeClass);
+
+    FreeNode *node = freeLists[sizeClass];
+    freeLists[sizeClass] = node->next;
+    liveBytes += (sizeClass + 1) * POOL_GRANULARITY;
+    liveObjects++;
+    return node;
+}
+
+void MemoryPool::deallocate(void *ptr, size_t bytes) {
+    if (!ptr)
+        return;
+    if (bytes == 0)
+        bytes = 1;
+    if (bytes > POOL_MAX_BYTES) {
+        largeBytes -= bytes;
+        ::operator delete(ptr);
+        return;
+    }
+
+    size_t sizeClass = classFor(bytes);
+    FreeNode *node = static_cast<FreeNode *>(ptr);
+    node->next = freeLists[sizeClass];
+    freeLists[sizeClass] = node;
+    liveBytes -= (sizeClass + 1) * POOL_GRANULARITY;
+    liveObjects--;
+}
+
+size_t MemoryPool::getLiveBytes() {
+    return liveBytes;
+}
+
+size_t MemoryPool::getLiveObjects() {
+    return liveObjects;
+}
+
+size_t MemoryPool::getReservedBytes() {
+    return reservedBytes;
+}
+
+size_t MemoryPool::getLargeBytes() {
+    return largeBytes;
+}
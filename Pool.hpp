@@ -0,0 +1,114 @@
+#pragma once
+#ifndef POOL_HPP
+#define POOL_HPP
+
+#include <cstddef>
+#include <new>
+#include <string>
+
+#define POOL_GRANULARITY 16
+#define POOL_MAX_BYTES 512
+#define POOL_CLASSES (POOL_MAX_BYTES / POOL_GRANULARITY)
+#define POOL_BLOCK_BYTES 16384
+
+// Size-class free-list pool shared by every PoolAllocator instantiation.
+// Requests up to POOL_MAX_BYTES are carved out of large blocks and recycled
+// on free; anything larger goes straight to operator new.
+class MemoryPool {
+private:
+    struct FreeNode {
+        FreeNode *next;
+    };
+
+    static FreeNode *freeLists[POOL_CLASSES];
+    static size_t liveBytes;
+    static size_t liveObjects;
+    static size_t reservedBytes;
+    static size_t largeBytes;
+
+    static void refill(size_t sizeClass);
+
+public:
+    static void *allocate(size_t bytes);
+    static void deallocate(void *ptr, size_t bytes);
+
+    static size_t getLiveBytes();
+    static size_t getLiveObjects();
+    static size_t getReservedBytes();
+    static size_t getLargeBytes();
+};
+
+template <typename T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef PoolAllocator<U> other;
+    };
+
+    PoolAllocator() {}
+    PoolAllocator(const PoolAllocator &) {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U> &) {}
+    ~PoolAllocator() {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+
+    pointer allocate(size_type n, const void * = 0) {
+        return static_cast<pointer>(MemoryPool::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(pointer p, size_type n) {
+        MemoryPool::deallocate(p, n * sizeof(T));
+    }
+
+    size_type max_size() const { return size_t(-1) / sizeof(T); }
+
+    void construct(pointer p, const T &val) { new (static_cast<void *>(p)) T(val); }
+    void destroy(pointer p) { p->~T(); }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &) { return false; }
+
+// Nick, user and topic storage. Short values stay in the inline buffer,
+// longer ones come from the pool instead of the general heap.
+typedef std::basic_string<char, std::char_traits<char>, PoolAllocator<char> > PoolString;
+
+inline PoolString toPoolString(const std::string &s) {
+    return PoolString(s.data(), s.size());
+}
+
+inline std::string toStdString(const PoolString &s) {
+    return std::string(s.data(), s.size());
+}
+
+// Heap bytes owned by a string, zero when it fits in the inline buffer.
+template <typename S>
+size_t stringHeapBytes(const S &s) {
+    const char *data = s.data();
+    const char *self = reinterpret_cast<const char *>(&s);
+    if (data >= self && data < self + sizeof(S))
+        return 0;
+    return s.capacity() + 1;
+}
+
+// Approximate footprint of one red-black tree node holding a V.
+template <typename V>
+size_t treeNodeBytes() {
+    return sizeof(V) + 4 * sizeof(void *);
+}
+
+#endif
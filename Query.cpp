@@ -0,0 +1,293 @@
+#include "ChatServer.hpp"
+#include "Match.hpp"
+
+// LIST, WHO and WHOIS. LIST and WHO run as cursors over the channel name
+// map, the channelsBySize index or nickIndex. Each step scans at most
+// QUERY_CHUNK_ENTRIES keys and only runs while the client has less than
+// QUERY_HIGH_WATER bytes queued, so large results trickle out as the
+// socket drains instead of stalling the loop.
+
+void ChatServer::channelResized(const std::string &name, size_t before, size_t after) {
+    if (before > 0)
+        channelsBySize.erase(std::make_pair(before, name));
+    if (after > 0)
+        channelsBySize.insert(std::make_pair(after, name));
+}
+
+static bool matchesAny(const std::vector<std::string> &masks, const std::string &text) {
+    if (masks.empty())
+        return true;
+    for (size_t i = 0; i < masks.size(); i++) {
+        if (matchMask(masks[i], text))
+            return true;
+    }
+    return false;
+}
+
+static bool hasPrefix(const std::string &text, const std::string &prefix) {
+    return text.compare(0, prefix.size(), prefix) == 0;
+}
+
+
+void ChatServer::processListCommand(int client_fd, std::istringstream &iss) {
+    std::string filter;
+    iss >> filter;
+
+    QueryCursor cursor;
+    cursor.kind = QueryCursor::QUERY_LIST;
+    cursor.minUsers = 1;
+    cursor.maxUsers = static_cast<size_t>(-1);
+    cursor.started = false;
+    cursor.lastSize = 0;
+    cursor.lastId = 0;
+
+    std::vector<std::string> items = splitCommaList(filter);
+    for (size_t i = 0; i < items.size(); i++) {
+        long count = std::strtol(items[i].c_str() + 1, NULL, 10);
+        if (items[i][0] == '>' && count >= 0) {
+            cursor.minUsers = std::max(cursor.minUsers, static_cast<size_t>(count) + 1);
+        } else if (items[i][0] == '<' && count >= 0) {
+            size_t limit = count > 0 ? static_cast<size_t>(count) - 1 : 0;
+            cursor.maxUsers = std::min(cursor.maxUsers, limit);
+        } else {
+            cursor.masks.push_back(items[i]);
+        }
+    }
+
+    // A literal prefix narrows the name range; otherwise a count filter
+    // walks the size index from the lower bound.
+    if (cursor.masks.size() == 1)
+        cursor.prefix = literalPrefix(cursor.masks[0]);
+    cursor.bySize = cursor.prefix.empty() &&
+                    (cursor.minUsers > 1 || cursor.maxUsers != static_cast<size_t>(-1));
+
+    std::string nick = clients[client_fd].getNickname();
+    sendToClient(client_fd, ":irc.localhost 321 " + nick + " Channel :Users  Name\r\n");
+    if (cursor.minUsers > cursor.maxUsers) {
+        sendToClient(client_fd, ":irc.localhost 323 " + nick + " :End of /LIST\r\n");
+        return;
+    }
+    startCursor(client_fd, cursor);
+}
+
+
+void ChatServer::processWhoCommand(int client_fd, std::istringstream &iss) {
+    std::string mask;
+    iss >> mask;
+
+    QueryCursor cursor;
+    cursor.minUsers = 0;
+    cursor.maxUsers = 0;
+    cursor.bySize = false;
+    cursor.started = false;
+    cursor.lastSize = 0;
+    cursor.lastId = 0;
+    cursor.target = mask;
+
+    if (!mask.empty() && (mask[0] == '#' || mask[0] == '&')) {
+        cursor.kind = QueryCursor::QUERY_WHO_CHANNEL;
+    } else {
+        cursor.kind = QueryCursor::QUERY_WHO_MASK;
+        if (mask.empty() || mask == "0")
+            mask = "*";
+        cursor.masks.push_back(mask);
+        // Plain masks also match usernames, so only nick!user@host masks
+        // can narrow the nick range.
+        if (mask.find('!') != std::string::npos)
+            cursor.prefix = literalPrefix(mask.substr(0, mask.find('!')));
+    }
+    startCursor(client_fd, cursor);
+}
+
+
+std::string ChatServer::whoReply(const std::string &nick, const std::string &channel, int id, bool op) {
+    Client &client = clients[id];
+    std::string server = serverName;
+    std::map<int, ServerLink>::iterator link = links.find(client.getLinkFd());
+    if (client.isRemote() && link != links.end())
+        server = link->second.name;
+
+    return ":irc.localhost 352 " + nick + " " + channel + " " + client.getUsername() +
+           " localhost " + server + " " + client.getNickname() + (op ? " H@" : " H") +
+           (client.isRemote() ? " :1 " : " :0 ") + client.getUsername() + "\r\n";
+}
+
+
+void ChatServer::processWhoisCommand(int client_fd, std::istringstream &iss) {
+    std::string first, second;
+    iss >> first >> second;
+    std::string target = second.empty() ? first : second;
+    std::string nick = clients[client_fd].getNickname();
+
+    if (target.empty()) {
+        sendToClient(client_fd, ":irc.localhost 431 " + nick + " :No nickname given\r\n");
+        return;
+    }
+
+    int id = getFdByNickname(target);
+    if (id == -1 || !clients[id].hasSentWelcome()) {
+        sendToClient(client_fd, ":irc.localhost 401 " + nick + " " + target + " :No such nick/channel\r\n");
+        sendToClient(client_fd, ":irc.localhost 318 " + nick + " " + target + " :End of /WHOIS list\r\n");
+        return;
+    }
+
+    Client &client = clients[id];
+    std::string out = ":irc.localhost 311 " + nick + " " + target + " " + client.getUsername() +
+                      " localhost * :" + client.getUsername() + "\r\n";
+
+    std::string head = ":irc.localhost 319 " + nick + " " + target + " :";
+    std::string line;
+    for (ChannelMap::iterator it = channels.begin(); it != channels.end(); ++it) {
+        if (!it->second.isMember(id))
+            continue;
+        std::string entry = (it->second.isOperator(id) ? "@" : "") + it->first;
+        if (!line.empty() && head.size() + line.size() + 1 + entry.size() + 2 > MAX_LINE_LENGTH) {
+            out += head + line + "\r\n";
+            line.clear();
+        }
+        line += (line.empty() ? "" : " ") + entry;
+    }
+    if (!line.empty())
+        out += head + line + "\r\n";
+
+    std::string server = serverName;
+    std::map<int, ServerLink>::iterator link = links.find(client.getLinkFd());
+    if (client.isRemote() && link != links.end())
+        server = link->second.name;
+    out += ":irc.localhost 312 " + nick + " " + target + " " + server + " :ircserv\r\n";
+    out += ":irc.localhost 318 " + nick + " " + target + " :End of /WHOIS list\r\n";
+    sendToClient(client_fd, out);
+}
+
+
+void ChatServer::startCursor(int client_fd, const QueryCursor &cursor) {
+    std::deque<QueryCursor> &queue = cursors[client_fd];
+    queue.push_back(cursor);
+    if (queue.size() == 1 && outbox.pendingSize(client_fd) < QUERY_HIGH_WATER) {
+        if (advanceCursor(client_fd, queue.front())) {
+            queue.pop_front();
+            if (queue.empty())
+                cursors.erase(client_fd);
+        }
+    }
+}
+
+
+// Emits one chunk and returns true once the cursor is finished.
+bool ChatServer::advanceCursor(int client_fd, QueryCursor &cursor) {
+    std::string nick = clients[client_fd].getNickname();
+    std::string out;
+    size_t scanned = 0;
+    bool done = false;
+
+    if (cursor.kind == QueryCursor::QUERY_LIST && !cursor.bySize) {
+        ChannelMap::iterator it = cursor.started ? channels.upper_bound(cursor.lastName)
+                                                 : channels.lower_bound(cursor.prefix);
+        for (; it != channels.end() && scanned < QUERY_CHUNK_ENTRIES; ++it, ++scanned) {
+            if (!hasPrefix(it->first, cursor.prefix)) {
+                it = channels.end();
+                break;
+            }
+            cursor.started = true;
+            cursor.lastName = it->first;
+            size_t count = it->second.members.size();
+            if (count < cursor.minUsers || count > cursor.maxUsers || !matchesAny(cursor.masks, it->first))
+                continue;
+            std::ostringstream row;
+            row << ":irc.localhost 322 " << nick << " " << it->first << " " << count
+                << " :" << it->second.getTopic() << "\r\n";
+            out += row.str();
+        }
+        done = it == channels.end();
+    } else if (cursor.kind == QueryCursor::QUERY_LIST) {
+        std::set<std::pair<size_t, std::string> >::iterator it =
+            cursor.started ? channelsBySize.upper_bound(std::make_pair(cursor.lastSize, cursor.lastName))
+                           : channelsBySize.lower_bound(std::make_pair(cursor.minUsers, std::string()));
+        for (; it != channelsBySize.end() && scanned < QUERY_CHUNK_ENTRIES; ++it, ++scanned) {
+            if (it->first > cursor.maxUsers) {
+                it = channelsBySize.end();
+                break;
+            }
+            cursor.started = true;
+            cursor.lastSize = it->first;
+            cursor.lastName = it->second;
+            ChannelMap::iterator chan = channels.find(it->second);
+            if (chan == channels.end() || !matchesAny(cursor.masks, it->second))
+                continue;
+            std::ostringstream row;
+            row << ":irc.localhost 322 " << nick << " " << it->second << " " << it->first
+                << " :" << chan->second.getTopic() << "\r\n";
+            out += row.str();
+        }
+        done = it == channelsBySize.end();
+    } else if (cursor.kind == QueryCursor::QUERY_WHO_CHANNEL) {
+        ChannelMap::iterator chan = channels.find(cursor.target);
+        done = true;
+        if (chan != channels.end()) {
+            FdSet &members = chan->second.members;
+            FdSet::iterator it = cursor.started ? members.upper_bound(cursor.lastId) : members.begin();
+            for (; it != members.end() && scanned < QUERY_CHUNK_ENTRIES; ++it, ++scanned) {
+                cursor.started = true;
+                cursor.lastId = *it;
+                if (clients.find(*it) != clients.end())
+                    out += whoReply(nick, cursor.target, *it, chan->second.isOperator(*it));
+            }
+            done = it == members.end();
+        }
+    } else {
+        const std::string &mask = cursor.masks[0];
+        bool full = mask.find('!') != std::string::npos || mask.find('@') != std::string::npos;
+        std::map<std::string, int>::iterator it = cursor.started ? nickIndex.upper_bound(cursor.lastName)
+                                                                 : nickIndex.lower_bound(cursor.prefix);
+        for (; it != nickIndex.end() && scanned < QUERY_CHUNK_ENTRIES; ++it, ++scanned) {
+            if (!hasPrefix(it->first, cursor.prefix)) {
+                it = nickIndex.end();
+                break;
+            }
+            cursor.started = true;
+            cursor.lastName = it->first;
+            Client &client = clients[it->second];
+            if (!client.hasSentWelcome() ||
+                (client.hasUserMode(UMODE_INVISIBLE) && it->second != client_fd))
+                continue;
+            bool match = full ? matchMask(mask, it->first + "!" + client.getUsername() + "@localhost")
+                              : matchMask(mask, it->first) || matchMask(mask, client.getUsername());
+            if (match)
+                out += whoReply(nick, "*", it->second, false);
+        }
+        done = it == nickIndex.end();
+    }
+
+    if (done) {
+        if (cursor.kind == QueryCursor::QUERY_LIST)
+            out += ":irc.localhost 323 " + nick + " :End of /LIST\r\n";
+        else
+            out += ":irc.localhost 315 " + nick + " " + cursor.target + " :End of /WHO list\r\n";
+    }
+    if (!out.empty())
+        sendToClient(client_fd, out);
+    return done;
+}
+
+
+// Returns whether a cursor can make progress without waiting on POLLOUT.
+bool ChatServer::runCursors() {
+    bool runnable = false;
+    std::map<int, std::deque<QueryCursor> >::iterator it = cursors.begin();
+    while (it != cursors.end()) {
+        std::map<int, std::deque<QueryCursor> >::iterator current = it++;
+        int fd = current->first;
+        if (outbox.pendingSize(fd) >= QUERY_HIGH_WATER)
+            continue;
+        if (advanceCursor(fd, current->second.front())) {
+            current->second.pop_front();
+            if (current->second.empty()) {
+                cursors.erase(current);
+                continue;
+            }
+        }
+        if (outbox.pendingSize(fd) < QUERY_HIGH_WATER)
+            runnable = true;
+    }
+    return runnable;
+}
@@ -0,0 +1,88 @@
+#include "ChatServer.hpp"
+
+// Lifecycle cleanup. Quits, parts and kicks remove members as they happen;
+// every RECLAIM_INTERVAL seconds a sweep also drops whatever slipped past:
+// member entries whose client is gone, operator entries without a member,
+// invites that expired or whose nick is no longer online, and channels
+// that have stayed empty for CHANNEL_EMPTY_TTL seconds. A channel with a
+// topic, key, modes, list masks or saved operators is kept: it is what the
+// snapshot exists to bring back, and after a restart it has no members.
+
+void ChatServer::destroyChannel(ChannelMap::iterator it) {
+    Channel &chan = it->second;
+    if (!chan.history.empty()) {
+        historyHeads.erase(std::make_pair(chan.history.oldestId(), chan.name));
+        historyBytes -= chan.history.getBytes();
+    }
+    if (!chan.members.empty()) {
+        channelsBySize.erase(std::make_pair(chan.members.size(), chan.name));
+        for (FdSet::iterator m = chan.members.begin(); m != chan.members.end(); ++m)
+            memberLeft(*m, chan.name);
+    }
+    searchIndex.forgetChannel(chan.name, nextMsgId);
+    std::cout << "Destroyed empty channel: " << chan.name << std::endl;
+    channels.erase(it);
+    snapshotDirty = true;
+}
+
+void ChatServer::reclaimState() {
+    time_t now = time(NULL);
+    reclaimStats.sweeps++;
+
+    for (ChannelMap::iterator it = channels.begin(); it != channels.end();) {
+        Channel &chan = it->second;
+
+        // A member is stale if its id is unknown or now belongs to someone
+        // else; nick changes keep memberNicknames in step otherwise.
+        std::vector<int> dead;
+        for (FdSet::iterator m = chan.members.begin(); m != chan.members.end(); ++m) {
+            std::map<int, Client>::iterator client = clients.find(*m);
+            FdNickMap::iterator nick = chan.memberNicknames.find(*m);
+            if (client == clients.end() || nick == chan.memberNicknames.end() ||
+                toStdString(nick->second) != client->second.getNickname()) {
+                dead.push_back(*m);
+            }
+        }
+        for (size_t i = 0; i < dead.size(); i++) {
+            chan.removeMember(dead[i]);
+        }
+        reclaimStats.members += dead.size();
+
+        for (FdSet::iterator op = chan.operators.begin(); op != chan.operators.end();) {
+            if (chan.isMember(*op)) {
+                ++op;
+            } else {
+                chan.operators.erase(op++);
+                reclaimStats.operators++;
+                snapshotDirty = true;
+            }
+        }
+
+        for (InviteMap::iterator inv = chan.invitedUsers.begin(); inv != chan.invitedUsers.end();) {
+            if (now - inv->second < INVITE_TTL && nickIndex.count(toStdString(inv->first))) {
+                ++inv;
+            } else {
+                std::map<std::string, std::set<std::string> >::iterator index =
+                    invitesByNick.find(toStdString(inv->first));
+                if (index != invitesByNick.end()) {
+                    index->second.erase(chan.name);
+                    if (index->second.empty())
+                        invitesByNick.erase(index);
+                }
+                chan.invitedUsers.erase(inv++);
+                reclaimStats.invites++;
+            }
+        }
+
+        if (chan.members.empty() && !chan.hasPersistentState()) {
+            if (!chan.emptySince) {
+                chan.emptySince = now;
+            } else if (now - chan.emptySince >= CHANNEL_EMPTY_TTL) {
+                destroyChannel(it++);
+                reclaimStats.channels++;
+                continue;
+            }
+        }
+        ++it;
+    }
+}
@@ -0,0 +1,206 @@
+#include "ChatServer.hpp"
+
+// Session resumption (draft/resume-0.5). A client with the capability gets
+// a token once registered. If its connection then drops without a QUIT the
+// user is parked under an in-memory id: it stays in its channels, output
+// for it queues up and nobody is told it left. A new connection presenting
+// the token within RESUME_GRACE seconds takes the session over, so peers
+// see neither a QUIT nor a JOIN; otherwise it quits as usual.
+
+static std::string newResumeToken() {
+    unsigned char raw[RESUME_TOKEN_BYTES];
+    int fd = open("/dev/urandom", O_RDONLY);
+    ssize_t n = fd < 0 ? -1 : read(fd, raw, sizeof(raw));
+    if (fd >= 0)
+        close(fd);
+    if (n != static_cast<ssize_t>(sizeof(raw)))
+        return std::string();
+
+    static const char hex[] = "0123456789abcdef";
+    std::string token;
+    for (size_t i = 0; i < sizeof(raw); i++) {
+        token += hex[raw[i] >> 4];
+        token += hex[raw[i] & 0xf];
+    }
+    return token;
+}
+
+// Replaces the client's token, if it has one, with a fresh one.
+void ChatServer::issueResumeToken(int client_fd) {
+    Client &client = clients[client_fd];
+    std::map<std::string, int>::iterator old = resumeTokens.find(client.getResumeToken());
+    if (old != resumeTokens.end() && old->second == client_fd)
+        resumeTokens.erase(old);
+    client.setResumeToken("");
+    if (!client.hasCapability(CAP_RESUME) || client.isRemote())
+        return;
+
+    std::string token = newResumeToken();
+    if (token.empty())
+        return;
+    client.setResumeToken(token);
+    resumeTokens[token] = client_fd;
+    sendToClient(client_fd, ":irc.localhost RESUME TOKEN " + token + "\r\n");
+}
+
+// Detaches a registered client holding a token from its connection and
+// keeps the session under a new in-memory id. Returns false if the client
+// cannot be resumed later.
+bool ChatServer::parkClient(int client_fd) {
+    std::map<int, Client>::iterator it = clients.find(client_fd);
+    if (it == clients.end() || links.find(client_fd) != links.end() || it->second.getResumeToken().empty() ||
+        !it->second.hasSentWelcome() || it->second.isQuitAnnounced()) {
+        return false;
+    }
+
+    int parked = takeMemoryId();
+    std::string pending = outbox.takeOutput(client_fd);
+    outbox.detach(client_fd);
+    outbox.attach(parked, true);
+    if (!pending.empty())
+        outbox.push(parked, pending);
+    capture.disconnect(client_fd);
+    if (client_fd < MEMORY_ID_BASE) {
+        close(client_fd);
+    }
+    for (std::vector<pollfd>::iterator p = fds.begin(); p != fds.end(); ++p) {
+        if (p->fd == client_fd) {
+            fds.erase(p);
+            break;
+        }
+    }
+    inputBytes -= it->second.getBufferSize();
+    cursors.erase(client_fd);
+    inputBacklog.erase(client_fd);
+    inputPaused.erase(client_fd);
+    inputPostponed.erase(client_fd);
+
+    Client session(parked);
+    session.takeSession(it->second);
+    session.setCapability(it->second.getCapabilities(), true);
+    clients[parked] = session;
+    moveClient(client_fd, parked);
+    clients.erase(client_fd);
+    releaseMemoryId(client_fd);
+    parkedClients[parked] = time(NULL) + RESUME_GRACE;
+    std::cout << "Client " << session.getNickname() << " parked for resumption (fd=" << client_fd << ")\n";
+    return true;
+}
+
+// Points everything that refers to client from at to instead. The Client
+// entry under to must already be in place.
+void ChatServer::moveClient(int from, int to) {
+    std::map<int, std::set<std::string> >::iterator joined = joinedChannels.find(from);
+    if (joined != joinedChannels.end()) {
+        // moveMember() edits the joined sets, so walk a copy.
+        std::vector<std::string> names(joined->second.begin(), joined->second.end());
+        for (size_t i = 0; i < names.size(); i++) {
+            ChannelMap::iterator chan = channels.find(names[i]);
+            if (chan != channels.end())
+                chan->second.moveMember(from, to);
+        }
+    }
+
+    Client &client = clients[to];
+    std::map<std::string, int>::iterator nick = nickIndex.find(client.getNickname());
+    if (nick != nickIndex.end() && nick->second == from) {
+        nick->second = to;
+    }
+    const std::set<std::string> &monitored = client.getMonitored();
+    for (std::set<std::string>::const_iterator m = monitored.begin(); m != monitored.end(); ++m) {
+        std::map<std::string, std::set<int> >::iterator entry = monitorWatchers.find(*m);
+        if (entry != monitorWatchers.end() && entry->second.erase(from)) {
+            entry->second.insert(to);
+        }
+    }
+    std::map<std::string, int>::iterator token = resumeTokens.find(client.getResumeToken());
+    if (token != resumeTokens.end() && token->second == from) {
+        token->second = to;
+    }
+}
+
+// RESUME <token>, sent before NICK and USER. A session still attached to
+// another connection is taken from it.
+void ChatServer::processResumeCommand(int client_fd, const std::string &param) {
+    Client &client = clients[client_fd];
+    std::istringstream iss(param);
+    std::string token;
+    iss >> token;
+
+    if (client.hasSentWelcome()) {
+        sendToClient(client_fd, ":irc.localhost FAIL RESUME REGISTRATION_IS_COMPLETED :Cannot resume, you are "
+                                "already registered\r\n");
+        return;
+    }
+    std::map<std::string, int>::iterator it = resumeTokens.find(token);
+    if (token.empty() || it == resumeTokens.end() ||
+        (parkedClients.find(it->second) == parkedClients.end() && !parkClient(it->second))) {
+        sendToClient(client_fd, ":irc.localhost FAIL RESUME INVALID_TOKEN :Cannot resume connection, token is "
+                                "not valid\r\n");
+        return;
+    }
+    int parked = resumeTokens[token];
+
+    if (client.hasNickname()) {
+        std::map<std::string, int>::iterator held = nickIndex.find(client.getNickname());
+        if (held != nickIndex.end() && held->second == client_fd)
+            nickIndex.erase(held);
+    }
+    std::string pending = outbox.takeOutput(parked);
+    outbox.detach(parked);
+    client.takeSession(clients[parked]);
+    moveClient(parked, client_fd);
+    parkedClients.erase(parked);
+    clients.erase(parked);
+    releaseMemoryId(parked);
+
+    std::string nick = client.getNickname();
+    std::cout << "Client " << nick << " resumed (fd=" << client_fd << ")\n";
+    sendToClient(client_fd, ":irc.localhost RESUME SUCCESS " + nick + "\r\n");
+    sendWelcome(client_fd, nick);
+
+    // Only the resuming client hears about its channels; members see nothing.
+    std::string prefix = userPrefix(client);
+    std::map<int, std::set<std::string> >::iterator joined = joinedChannels.find(client_fd);
+    std::set<std::string> none;
+    const std::set<std::string> &names = joined != joinedChannels.end() ? joined->second : none;
+    for (std::set<std::string>::const_iterator n = names.begin(); n != names.end(); ++n) {
+        ChannelMap::iterator c = channels.find(*n);
+        if (c == channels.end())
+            continue;
+        Channel &chan = c->second;
+        std::string burst = prefix + " JOIN " + chan.name + "\r\n";
+        std::string topic = chan.getTopic();
+        if (!topic.empty())
+            burst += ":irc.localhost 332 " + nick + " " + chan.name + " :" + topic + "\r\n";
+        if (!client.hasCapability(CAP_NO_IMPLICIT_NAMES))
+            chan.appendNamesReply(burst, nick);
+        sendToClient(client_fd, burst);
+    }
+    if (!pending.empty())
+        sendToClient(client_fd, pending);
+    issueResumeToken(client_fd);
+}
+
+// Parked sessions quit once their grace period is over or too much output
+// has piled up for them; with all set, every one of them does.
+void ChatServer::expireParkedClients(bool all) {
+    time_t now = time(NULL);
+    if (!all && now == lastParkSweep)
+        return;
+    lastParkSweep = now;
+
+    std::vector<int> expired;
+    for (std::map<int, time_t>::iterator it = parkedClients.begin(); it != parkedClients.end(); ++it) {
+        if (all || it->second <= now || outbox.pendingSize(it->first) > RESUME_MAX_PENDING)
+            expired.push_back(it->first);
+    }
+    for (size_t i = 0; i < expired.size(); i++) {
+        Client &client = clients[expired[i]];
+        std::string quitLine = userPrefix(client) + " QUIT :Connection closed\r\n";
+        notifyPeers(expired[i], quitLine, false, NULL);
+        propagate(quitLine, -1);
+        client.setQuitAnnounced(true);
+        handleClientDisconnect(expired[i]);
+    }
+}
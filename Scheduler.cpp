@@ -0,0 +1,55 @@
+#include "ChatServer.hpp"
+
+// Input scheduling. Reading a socket only buffers the data and marks the
+// client ready; the lines are run afterwards by runScheduler(), which gives
+// every ready client one quantum of lines per tick. The walk starts one
+// past the client served first last time, so low fds get no head start. A
+// client with lines left after its quantum is not read from again until
+// they have run, which pushes back on pipelining peers through TCP.
+
+// Lines a client may run per tick at the current load level.
+size_t ChatServer::lineBudget() const {
+    static const size_t budgets[] = {LINE_QUANTUM, LINE_QUANTUM / 2, LINE_QUANTUM / 4, 1};
+    return budgets[loadLevel];
+}
+
+void ChatServer::setPollIn(int client_fd, bool enabled) {
+    for (std::vector<pollfd>::iterator it = fds.begin(); it != fds.end(); ++it) {
+        if (it->fd == client_fd) {
+            if (enabled)
+                it->events |= POLLIN;
+            else
+                it->events &= ~POLLIN;
+            break;
+        }
+    }
+}
+
+// Runs one quantum for a ready client and updates its ready state.
+void ChatServer::serveInput(int client_fd) {
+    bool leftover = drainInput(client_fd);
+    if (leftover && clients.find(client_fd) != clients.end()) {
+        if (inputPaused.insert(client_fd).second)
+            setPollIn(client_fd, false);
+        return;
+    }
+    inputBacklog.erase(client_fd);
+    if (inputPaused.erase(client_fd))
+        setPollIn(client_fd, true);
+}
+
+void ChatServer::runScheduler() {
+    if (inputBacklog.empty())
+        return;
+    std::vector<int> order;
+    order.reserve(inputBacklog.size());
+    std::set<int>::iterator start = inputBacklog.lower_bound(nextScheduled);
+    order.insert(order.end(), start, inputBacklog.end());
+    order.insert(order.end(), inputBacklog.begin(), start);
+    nextScheduled = order[0] + 1;
+
+    for (size_t i = 0; i < order.size(); i++) {
+        if (inputBacklog.count(order[i]))
+            serveInput(order[i]);
+    }
+}
@@ -0,0 +1,415 @@
+#include "ChatServer.hpp"
+#include "Search.hpp"
+#include <climits>
+#include <cctype>
+
+// Rough per-key cost of a postings map node, on top of the key itself.
+#define SEARCH_KEY_OVERHEAD 64
+
+SearchIndex::SearchIndex()
+        : running(false), stopping(false), dropped(0), usedBytes(0), docBytes(0), live(new Segment()) {
+    pthread_mutex_init(&queueLock, NULL);
+    pthread_cond_init(&queueReady, NULL);
+    pthread_mutex_init(&indexLock, NULL);
+    live->lastId = 0;
+    live->docs = 0;
+    live->bytes = 0;
+}
+
+SearchIndex::~SearchIndex() {
+    stop();
+    for (size_t i = 0; i < segments.size(); i++)
+        delete segments[i];
+    delete live;
+    pthread_mutex_destroy(&queueLock);
+    pthread_cond_destroy(&queueReady);
+    pthread_mutex_destroy(&indexLock);
+}
+
+void SearchIndex::start() {
+    if (running)
+        return;
+    // Signals stay with the main thread so poll() still sees EINTR.
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    running = pthread_create(&thread, NULL, indexerMain, this) == 0;
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (!running)
+        perror("Search indexer thread creation failed, SEARCH disabled");
+}
+
+void SearchIndex::stop() {
+    if (!running)
+        return;
+    pthread_mutex_lock(&queueLock);
+    stopping = true;
+    pthread_cond_signal(&queueReady);
+    pthread_mutex_unlock(&queueLock);
+    pthread_join(thread, NULL);
+    running = false;
+}
+
+// Called by the main loop for every recorded message. Only queues it; if
+// the indexer has fallen SEARCH_QUEUE_LIMIT behind, the message is skipped.
+void SearchIndex::submit(unsigned long msgid, const std::string &channel, const struct timeval &time,
+                         const SharedLine &line) {
+    if (!running)
+        return;
+    SearchDoc doc;
+    doc.msgid = msgid;
+    doc.channel.assign(channel.data(), channel.size());
+    doc.time = time;
+    doc.line = line;
+
+    pthread_mutex_lock(&queueLock);
+    if (queue.size() >= SEARCH_QUEUE_LIMIT) {
+        dropped++;
+    } else {
+        queue.push_back(doc);
+        if (queue.size() == 1)
+            pthread_cond_signal(&queueReady);
+    }
+    pthread_mutex_unlock(&queueLock);
+}
+
+
+void *SearchIndex::indexerMain(void *arg) {
+    static_cast<SearchIndex *>(arg)->indexerLoop();
+    return NULL;
+}
+
+void SearchIndex::indexerLoop() {
+    std::vector<SearchDoc> batch;
+    while (true) {
+        pthread_mutex_lock(&queueLock);
+        while (queue.empty() && !stopping)
+            pthread_cond_wait(&queueReady, &queueLock);
+        if (stopping) {
+            pthread_mutex_unlock(&queueLock);
+            return;
+        }
+        size_t count = std::min(queue.size(), static_cast<size_t>(SEARCH_INSERT_BATCH));
+        batch.assign(queue.begin(), queue.begin() + count);
+        queue.erase(queue.begin(), queue.begin() + count);
+        pthread_mutex_unlock(&queueLock);
+
+        insert(batch);
+        batch.clear();
+        evict();
+        mergeSegments();
+    }
+}
+
+// The text of ":prefix COMMAND target :text\r\n".
+static std::string messageText(const std::string &line) {
+    size_t colon = line.find(" :", 1);
+    if (colon == std::string::npos)
+        return "";
+    size_t end = line.size();
+    while (end > colon + 2 && (line[end - 1] == '\r' || line[end - 1] == '\n'))
+        end--;
+    return line.substr(colon + 2, end - colon - 2);
+}
+
+static size_t docSize(const SearchDoc &doc) {
+    return sizeof(SearchDoc) + doc.channel.size() + doc.line.size();
+}
+
+void SearchIndex::insert(std::vector<SearchDoc> &batch) {
+    std::vector<std::vector<std::string> > keys(batch.size());
+    std::vector<std::string> tokens;
+    for (size_t i = 0; i < batch.size(); i++) {
+        tokens.clear();
+        tokenize(messageText(batch[i].line.str()), tokens);
+        std::sort(tokens.begin(), tokens.end());
+        tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+        for (size_t t = 0; t < tokens.size(); t++)
+            keys[i].push_back(batch[i].channel + " " + tokens[t]);
+    }
+
+    pthread_mutex_lock(&indexLock);
+    for (size_t i = 0; i < batch.size(); i++) {
+        docs.push_back(batch[i]);
+        docBytes += docSize(batch[i]);
+        for (size_t k = 0; k < keys[i].size(); k++) {
+            std::vector<unsigned long> &list = live->postings[keys[i][k]];
+            if (list.empty())
+                live->bytes += keys[i][k].size() + SEARCH_KEY_OVERHEAD;
+            list.push_back(batch[i].msgid);
+            live->bytes += sizeof(unsigned long);
+        }
+        live->lastId = batch[i].msgid;
+        if (++live->docs >= SEARCH_SEGMENT_DOCS) {
+            segments.push_back(live);
+            live = new Segment();
+            live->lastId = 0;
+            live->docs = 0;
+            live->bytes = 0;
+        }
+    }
+    publishBytes();
+    pthread_mutex_unlock(&indexLock);
+}
+
+size_t SearchIndex::totalBytes() const {
+    size_t bytes = docBytes + live->bytes;
+    for (size_t i = 0; i < segments.size(); i++)
+        bytes += segments[i]->bytes;
+    return bytes;
+}
+
+// Called with indexLock held.
+void SearchIndex::publishBytes() {
+    size_t now = totalBytes();
+    size_t seen = __sync_add_and_fetch(&usedBytes, 0);
+    if (now > seen)
+        __sync_add_and_fetch(&usedBytes, now - seen);
+    else
+        __sync_sub_and_fetch(&usedBytes, seen - now);
+}
+
+size_t SearchIndex::bytes() {
+    return __sync_add_and_fetch(&usedBytes, 0);
+}
+
+// Drops the oldest sealed segment and its documents until the index fits.
+void SearchIndex::evict() {
+    std::vector<Segment *> dead;
+    pthread_mutex_lock(&indexLock);
+    while (totalBytes() > SEARCH_MAX_BYTES && !segments.empty()) {
+        Segment *oldest = segments.front();
+        while (!docs.empty() && docs.front().msgid <= oldest->lastId) {
+            docBytes -= docSize(docs.front());
+            docs.pop_front();
+        }
+        segments.erase(segments.begin());
+        dead.push_back(oldest);
+    }
+    for (std::map<std::string, unsigned long>::iterator it = forgotten.begin(); it != forgotten.end();) {
+        if (docs.empty() || docs.front().msgid >= it->second)
+            forgotten.erase(it++);
+        else
+            ++it;
+    }
+    publishBytes();
+    pthread_mutex_unlock(&indexLock);
+    for (size_t i = 0; i < dead.size(); i++)
+        delete dead[i];
+}
+
+// Past SEARCH_MAX_SEGMENTS, merges the adjacent pair with the fewest bytes,
+// as long as the result stays small enough to be evicted in one piece.
+void SearchIndex::mergeSegments() {
+    if (segments.size() <= SEARCH_MAX_SEGMENTS)
+        return;
+    size_t best = segments.size();
+    size_t bestBytes = SEARCH_MAX_BYTES / SEARCH_MAX_SEGMENTS;
+    for (size_t i = 0; i + 1 < segments.size(); i++) {
+        size_t bytes = segments[i]->bytes + segments[i + 1]->bytes;
+        if (bytes <= bestBytes) {
+            best = i;
+            bestBytes = bytes;
+        }
+    }
+    if (best == segments.size())
+        return;
+
+    // Sealed segments never change and only this thread removes them, so
+    // they can be read without the lock.
+    Segment *older = segments[best];
+    Segment *newer = segments[best + 1];
+    Segment *merged = new Segment();
+    merged->postings = older->postings;
+    merged->bytes = older->bytes;
+    for (Postings::const_iterator it = newer->postings.begin(); it != newer->postings.end(); ++it) {
+        std::vector<unsigned long> &list = merged->postings[it->first];
+        if (list.empty())
+            merged->bytes += it->first.size() + SEARCH_KEY_OVERHEAD;
+        list.insert(list.end(), it->second.begin(), it->second.end());
+        merged->bytes += it->second.size() * sizeof(unsigned long);
+    }
+    merged->docs = older->docs + newer->docs;
+    merged->lastId = newer->lastId;
+
+    pthread_mutex_lock(&indexLock);
+    segments[best] = merged;
+    segments.erase(segments.begin() + best + 1);
+    publishBytes();
+    pthread_mutex_unlock(&indexLock);
+    delete older;
+    delete newer;
+}
+
+
+void SearchIndex::tokenize(const std::string &text, std::vector<std::string> &tokens) {
+    std::string token;
+    for (size_t i = 0; i <= text.size(); i++) {
+        unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+        if (c >= 0x80 || std::isalnum(c)) {
+            if (token.size() < SEARCH_MAX_TOKEN)
+                token += static_cast<char>(std::tolower(c));
+            continue;
+        }
+        if (token.size() >= SEARCH_MIN_TOKEN)
+            tokens.push_back(token);
+        token.clear();
+    }
+}
+
+const SearchDoc *SearchIndex::findDoc(unsigned long msgid) const {
+    size_t lo = 0, hi = docs.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (docs[mid].msgid < msgid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < docs.size() && docs[lo].msgid == msgid ? &docs[lo] : NULL;
+}
+
+// Fills out with up to limit messages in channel older than before that
+// contain every term, newest first. Returns true if there are more.
+// Segments hold disjoint msgid ranges, so each is intersected on its own,
+// newest first, and the walk stops as soon as the page is full.
+bool SearchIndex::search(const std::string &channel, const std::vector<std::string> &terms, unsigned long before,
+                         size_t limit, std::vector<SearchDoc> &out) {
+    std::vector<std::string> keys;
+    for (size_t t = 0; t < terms.size(); t++)
+        keys.push_back(channel + " " + terms[t]);
+    std::vector<const std::vector<unsigned long> *> lists(keys.size());
+
+    pthread_mutex_lock(&indexLock);
+    std::map<std::string, unsigned long>::const_iterator forgot = forgotten.find(channel);
+    unsigned long floor = forgot == forgotten.end() ? 0 : forgot->second;
+    for (size_t s = segments.size() + 1; s-- > 0;) {
+        const Segment *segment = s == segments.size() ? live : segments[s];
+        if (segment != live && segment->lastId < floor)
+            break;
+        size_t smallest = 0;
+        bool missing = false;
+        for (size_t t = 0; t < keys.size() && !missing; t++) {
+            Postings::const_iterator it = segment->postings.find(keys[t]);
+            missing = it == segment->postings.end();
+            if (missing)
+                break;
+            lists[t] = &it->second;
+            if (lists[t]->size() < lists[smallest]->size())
+                smallest = t;
+        }
+        if (missing)
+            continue;
+
+        const std::vector<unsigned long> &base = *lists[smallest];
+        size_t i = std::lower_bound(base.begin(), base.end(), before) - base.begin();
+        while (i-- > 0 && base[i] >= floor) {
+            bool all = true;
+            for (size_t t = 0; t < lists.size() && all; t++)
+                all = t == smallest || std::binary_search(lists[t]->begin(), lists[t]->end(), base[i]);
+            if (!all)
+                continue;
+            if (out.size() == limit) {
+                pthread_mutex_unlock(&indexLock);
+                return true;
+            }
+            const SearchDoc *doc = findDoc(base[i]);
+            if (doc)
+                out.push_back(*doc);
+        }
+    }
+    pthread_mutex_unlock(&indexLock);
+    return false;
+}
+
+// Hides what channel said before msgid below, once the channel is gone,
+// from whoever creates a channel of the same name later.
+void SearchIndex::forgetChannel(const std::string &channel, unsigned long below) {
+    pthread_mutex_lock(&indexLock);
+    forgotten[channel] = below;
+    pthread_mutex_unlock(&indexLock);
+}
+
+SearchStats SearchIndex::stats() {
+    SearchStats stats;
+    pthread_mutex_lock(&queueLock);
+    stats.queued = queue.size();
+    stats.dropped = dropped;
+    pthread_mutex_unlock(&queueLock);
+
+    pthread_mutex_lock(&indexLock);
+    stats.docs = docs.size();
+    stats.segments = segments.size() + 1;
+    stats.postings = live->postings.size();
+    for (size_t i = 0; i < segments.size(); i++)
+        stats.postings += segments[i]->postings.size();
+    stats.bytes = totalBytes();
+    pthread_mutex_unlock(&indexLock);
+    return stats;
+}
+
+
+// SEARCH <channel> [msgid=<id>] <terms>: the newest SEARCH_PAGE_SIZE
+// messages holding every term, older than msgid if one is given. A last
+// line carrying a msgid reference means there are more.
+void ChatServer::processSearchCommand(int client_fd, std::istringstream &iss) {
+    std::string target, word;
+    iss >> target;
+    std::vector<std::string> words;
+    while (iss >> word)
+        words.push_back(word);
+
+    Client &client = clients[client_fd];
+    if (target.empty() || words.empty()) {
+        sendToClient(client_fd, ":irc.localhost FAIL SEARCH NEED_MORE_PARAMS :Missing parameters\r\n");
+        return;
+    }
+    ChannelMap::iterator chanIt = channels.find(target);
+    if (chanIt == channels.end() || !chanIt->second.isMember(client_fd)) {
+        sendToClient(client_fd, ":irc.localhost FAIL SEARCH INVALID_TARGET " + target +
+                                " :Messages could not be searched\r\n");
+        return;
+    }
+
+    unsigned long before = ULONG_MAX;
+    HistoryRef ref;
+    if (parseHistoryRef(words[0], ref)) {
+        if (!ref.byId) {
+            sendToClient(client_fd, ":irc.localhost FAIL SEARCH INVALID_PARAMS " + words[0] +
+                                    " :Only msgid references are supported\r\n");
+            return;
+        }
+        before = ref.msgid;
+        words.erase(words.begin());
+    }
+
+    std::vector<std::string> terms;
+    for (size_t i = 0; i < words.size(); i++)
+        SearchIndex::tokenize(words[i], terms);
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    if (terms.empty() || terms.size() > SEARCH_MAX_TERMS) {
+        sendToClient(client_fd, ":irc.localhost FAIL SEARCH INVALID_PARAMS " + target + " :" +
+                                (terms.empty() ? "No usable search terms" : "Too many search terms") + "\r\n");
+        return;
+    }
+
+    std::vector<SearchDoc> found;
+    bool more = searchIndex.search(target, terms, before, SEARCH_PAGE_SIZE, found);
+
+    bool tags = client.hasCapability(CAP_MESSAGE_TAGS);
+    std::string out;
+    for (size_t i = 0; i < found.size(); i++) {
+        if (tags)
+            out += messageTags(found[i].msgid, found[i].time);
+        out += found[i].line.str();
+    }
+    if (more) {
+        std::ostringstream end;
+        end << ":irc.localhost SEARCH " << target << " msgid=" << found.back().msgid << " :More results\r\n";
+        out += end.str();
+    } else {
+        out += ":irc.localhost SEARCH " + target + " * :End of results\r\n";
+    }
+    sendToClient(client_fd, out);
+}
@@ -0,0 +1,106 @@
+#pragma once
+#ifndef SEARCH_HPP
+#define SEARCH_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <pthread.h>
+#include <sys/time.h>
+#include "History.hpp"
+
+#define SEARCH_MAX_BYTES (32 * 1024 * 1024)
+#define SEARCH_SEGMENT_DOCS 1024
+#define SEARCH_MAX_SEGMENTS 8
+#define SEARCH_QUEUE_LIMIT 65536
+#define SEARCH_INSERT_BATCH 256
+#define SEARCH_PAGE_SIZE 20
+#define SEARCH_MAX_TERMS 8
+#define SEARCH_MIN_TOKEN 2
+#define SEARCH_MAX_TOKEN 64
+
+struct SearchDoc {
+    unsigned long msgid;
+    std::string channel;
+    struct timeval time;
+    SharedLine line;
+};
+
+struct SearchStats {
+    size_t docs;
+    size_t segments;
+    size_t postings;
+    size_t bytes;
+    size_t queued;
+    unsigned long dropped;
+};
+
+// Full-text index over recent channel messages. The main loop only queues
+// each message; an indexer thread tokenizes it and appends it to a live
+// segment, keyed by "<channel> <token>". Full segments are sealed and never
+// change again, so merges read them without the lock and only take it to
+// swap the result in. Past SEARCH_MAX_BYTES the oldest documents go first;
+// their postings are dropped whole with their segment or pruned on merge.
+class SearchIndex {
+private:
+    typedef std::map<std::string, std::vector<unsigned long> > Postings;
+    struct Segment {
+        unsigned long lastId;
+        size_t docs;
+        size_t bytes;
+        Postings postings;
+    };
+
+    pthread_t thread;
+    bool running;
+    bool stopping;
+    pthread_mutex_t queueLock;
+    pthread_cond_t queueReady;
+    std::deque<SearchDoc> queue;
+    unsigned long dropped;
+    // Mirrors totalBytes() for readers that must not wait on indexLock;
+    // only the indexer thread changes it.
+    size_t usedBytes;
+
+    // Everything below is guarded by indexLock and written only by the
+    // indexer thread.
+    pthread_mutex_t indexLock;
+    std::deque<SearchDoc> docs;
+    size_t docBytes;
+    std::vector<Segment *> segments;
+    Segment *live;
+    // Also under indexLock, but set from the main loop: the first msgid
+    // still visible in each channel that was destroyed.
+    std::map<std::string, unsigned long> forgotten;
+
+    SearchIndex(const SearchIndex &);
+    SearchIndex &operator=(const SearchIndex &);
+
+    static void *indexerMain(void *arg);
+    void indexerLoop();
+    void insert(std::vector<SearchDoc> &batch);
+    void evict();
+    void mergeSegments();
+    size_t totalBytes() const;
+    void publishBytes();
+    const SearchDoc *findDoc(unsigned long msgid) const;
+
+public:
+    SearchIndex();
+    ~SearchIndex();
+
+    void start();
+    void stop();
+    void submit(unsigned long msgid, const std::string &channel, const struct timeval &time,
+                const SharedLine &line);
+    bool search(const std::string &channel, const std::vector<std::string> &terms, unsigned long before,
+                size_t limit, std::vector<SearchDoc> &out);
+    void forgetChannel(const std::string &channel, unsigned long below);
+    SearchStats stats();
+    size_t bytes();
+
+    static void tokenize(const std::string &text, std::vector<std::string> &tokens);
+};
+
+#endif
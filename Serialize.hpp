@@ -0,0 +1,77 @@
+#pragma once
+#ifndef SERIALIZE_HPP
+#define SERIALIZE_HPP
+
+#include <string>
+#include <stdint.h>
+
+// Little-endian encoding helpers shared by the snapshot and upgrade formats.
+
+inline void putU32(std::string &out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out += static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+inline void putU64(std::string &out, uint64_t value) {
+    putU32(out, static_cast<uint32_t>(value & 0xffffffffu));
+    putU32(out, static_cast<uint32_t>(value >> 32));
+}
+
+inline void putBytes(std::string &out, const char *data, size_t len) {
+    putU32(out, static_cast<uint32_t>(len));
+    out.append(data, len);
+}
+
+template <typename S>
+void putString(std::string &out, const S &value) {
+    putBytes(out, value.data(), value.size());
+}
+
+class Reader {
+private:
+    const unsigned char *pos;
+    const unsigned char *end;
+
+public:
+    Reader(const void *data, size_t len)
+        : pos(static_cast<const unsigned char *>(data)), end(pos + len) {}
+
+    bool getU32(uint32_t &value) {
+        if (end - pos < 4)
+            return false;
+        value = pos[0] | (pos[1] << 8) | (pos[2] << 16) | (static_cast<uint32_t>(pos[3]) << 24);
+        pos += 4;
+        return true;
+    }
+
+    bool getU64(uint64_t &value) {
+        uint32_t lo, hi;
+        if (!getU32(lo) || !getU32(hi))
+            return false;
+        value = (static_cast<uint64_t>(hi) << 32) | lo;
+        return true;
+    }
+
+    bool getU8(unsigned char &value) {
+        if (pos >= end)
+            return false;
+        value = *pos++;
+        return true;
+    }
+
+    bool getBytes(std::string &value) {
+        uint32_t len;
+        if (!getU32(len) || static_cast<size_t>(end - pos) < len)
+            return false;
+        value.assign(reinterpret_cast<const char *>(pos), len);
+        pos += len;
+        return true;
+    }
+
+    bool atEnd() const {
+        return pos == end;
+    }
+};
+
+#endif
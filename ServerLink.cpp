@@ -0,0 +1,586 @@
+#include "ChatServer.hpp"
+#include <netdb.h>
+
+// Server-to-server links. Live events travel in the client line format with
+// a nick!user@host prefix, so a peer can hand them to its local users as-is.
+// A few verbs exist only between servers:
+//   SERVER <name> <password>                          handshake, both sides
+//   UID <nick> <user> <signon-ts>                     introduces a user
+//   SJOIN <channel> :[@]nick ...                      joins with op status
+//   CHANINFO <channel> <flags> <limit> <key|*> :topic burst channel state
+//   MASK <channel> <b|e|I> <mask> <setter> <set-ts>   burst one list entry
+//   KILL <nick> :<reason>                             removes a user
+//   EOB                                               end of burst
+// Links must form a tree. Every event is forwarded to all links except the
+// one it arrived on, so it crosses each link exactly once. Remote users live
+// in `clients` under negative ids and are reached through their link.
+// Links authenticate with their own secret from LINK_PASSWORD_ENV, never the
+// client password, and are only accepted from the configured peers.
+
+#define REMOTE_ID_START -2
+#define LINK_RETRY_INTERVAL 10
+
+void ChatServer::setServerName(const std::string &name) {
+    serverName = name;
+    renderWelcome();
+}
+
+void ChatServer::addLinkTarget(const std::string &host, int port) {
+    LinkTarget target;
+    target.host = host;
+    target.port = port;
+    target.fd = -1;
+    linkTargets.push_back(target);
+}
+
+void ChatServer::setLinkPassword(const std::string &password) {
+    linkPassword = password;
+}
+
+static std::string numericHost(const struct sockaddr *addr) {
+    char host[INET6_ADDRSTRLEN] = "";
+    if (addr->sa_family == AF_INET) {
+        inet_ntop(AF_INET, &reinterpret_cast<const struct sockaddr_in *>(addr)->sin_addr, host, sizeof(host));
+    } else if (addr->sa_family == AF_INET6) {
+        const struct in6_addr &in6 = reinterpret_cast<const struct sockaddr_in6 *>(addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&in6))
+            inet_ntop(AF_INET, in6.s6_addr + 12, host, sizeof(host));
+        else
+            inet_ntop(AF_INET6, &in6, host, sizeof(host));
+    }
+    return host;
+}
+
+// Returns the index of the link target whose address the connection comes
+// from, or -1.
+int ChatServer::findLinkPeer(int fd) const {
+    struct sockaddr_storage peer;
+    socklen_t peerLen = sizeof(peer);
+    if (getpeername(fd, reinterpret_cast<struct sockaddr *>(&peer), &peerLen) < 0)
+        return -1;
+    std::string host = numericHost(reinterpret_cast<struct sockaddr *>(&peer));
+    if (host.empty())
+        return -1;
+
+    for (size_t i = 0; i < linkTargets.size(); i++) {
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(linkTargets[i].host.c_str(), NULL, &hints, &res) != 0)
+            continue;
+        bool match = false;
+        for (struct addrinfo *ai = res; ai && !match; ai = ai->ai_next)
+            match = numericHost(ai->ai_addr) == host;
+        freeaddrinfo(res);
+        if (match)
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+bool ChatServer::isEstablishedLink(int fd) const {
+    std::map<int, ServerLink>::const_iterator it = links.find(fd);
+    return it != links.end() && it->second.established;
+}
+
+std::string ChatServer::userPrefix(const Client &client) const {
+    return ":" + client.getNickname() + "!" + client.getUsername() + "@localhost";
+}
+
+
+void ChatServer::connectLinks() {
+    time_t now = time(NULL);
+    if (linkPassword.empty() || now - lastLinkAttempt < LINK_RETRY_INTERVAL) {
+        return;
+    }
+    lastLinkAttempt = now;
+
+    for (size_t i = 0; i < linkTargets.size(); i++) {
+        LinkTarget &target = linkTargets[i];
+        if (target.fd != -1) {
+            continue;
+        }
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        std::ostringstream port;
+        port << target.port;
+        if (getaddrinfo(target.host.c_str(), port.str().c_str(), &hints, &res) != 0) {
+            std::cerr << "Cannot resolve link " << target.host << std::endl;
+            continue;
+        }
+
+        int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (fd < 0) {
+            freeaddrinfo(res);
+            continue;
+        }
+        setNonBlocking(fd);
+        if (connect(fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            freeaddrinfo(res);
+            close(fd);
+            continue;
+        }
+        freeaddrinfo(res);
+
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        fds.push_back(pfd);
+        outbox.attach(fd);
+        clients[fd] = Client(fd);
+
+        ServerLink link;
+        link.established = false;
+        link.outgoing = true;
+        links[fd] = link;
+        target.fd = fd;
+
+        std::cout << "Connecting to link " << target.host << ":" << target.port << std::endl;
+        sendToClient(fd, "SERVER " + serverName + " " + linkPassword + "\r\n");
+    }
+}
+
+
+void ChatServer::handleServerHandshake(int fd, const std::string &param) {
+    std::istringstream iss(param);
+    std::string name, password;
+    iss >> name >> password;
+
+    bool duplicate = false;
+    for (std::map<int, ServerLink>::iterator it = links.begin(); it != links.end(); ++it) {
+        if (it->first != fd && it->second.name == name)
+            duplicate = true;
+    }
+
+    // An incoming link must not have started client registration and must
+    // come from a configured peer.
+    std::map<int, ServerLink>::iterator it = links.find(fd);
+    int peer = -1;
+    if (it == links.end()) {
+        Client &client = clients[fd];
+        if (!client.isAuthenticated() && !client.hasNickname() && !client.hasUsername())
+            peer = findLinkPeer(fd);
+        // Both ends dialed each other: the lower server name's link wins.
+        if (peer != -1 && linkTargets[peer].fd != -1 && serverName < name)
+            peer = -1;
+    }
+
+    if ((it == links.end() && peer == -1) || linkPassword.empty() || password != linkPassword || name.empty() || name == serverName ||
+        duplicate) {
+        std::cerr << "Rejected link from " << (name.empty() ? "*" : name) << std::endl;
+        sendToClient(fd, "ERROR :Link rejected\r\n");
+        handleClientDisconnect(fd);
+        return;
+    }
+
+    if (it == links.end()) {
+        int dialing = linkTargets[peer].fd;
+        if (dialing != -1)
+            handleClientDisconnect(dialing);
+        linkTargets[peer].fd = fd;
+        ServerLink link;
+        link.outgoing = false;
+        it = links.insert(std::make_pair(fd, link)).first;
+        sendToClient(fd, "SERVER " + serverName + " " + linkPassword + "\r\n");
+    }
+    it->second.name = name;
+    it->second.established = true;
+
+    std::cout << "Linked with server " << name << " (fd=" << fd << ")" << std::endl;
+    sendBurst(fd);
+}
+
+
+void ChatServer::sendBurst(int link_fd) {
+    std::ostringstream burst;
+
+    for (std::map<int, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
+        Client &user = it->second;
+        if (!user.hasSentWelcome() || user.getLinkFd() == link_fd) {
+            continue;
+        }
+        burst << "UID " << user.getNickname() << " " << user.getUsername() << " "
+              << user.getSignonTime() << "\r\n";
+    }
+
+    for (ChannelMap::iterator it = channels.begin(); it != channels.end(); ++it) {
+        Channel &chan = it->second;
+        std::string flags;
+        if (chan.inviteOnly)
+            flags += "i";
+        if (chan.topicRestricted)
+            flags += "t";
+        burst << "CHANINFO " << chan.name << " " << (flags.empty() ? "-" : flags) << " "
+              << chan.userLimit << " " << (chan.channelKey.empty() ? "*" : chan.channelKey)
+              << " :" << chan.getTopic() << "\r\n";
+
+        const MaskList *lists[3] = { &chan.bans, &chan.exceptions, &chan.invexes };
+        const char *modes = "beI";
+        for (int l = 0; l < 3; l++) {
+            const std::vector<CompiledMask> &entries = lists[l]->entries();
+            for (size_t i = 0; i < entries.size(); i++) {
+                burst << "MASK " << chan.name << " " << modes[l] << " " << entries[i].text << " "
+                      << entries[i].setter << " " << entries[i].setAt << "\r\n";
+            }
+        }
+
+        std::string members;
+        for (FdSet::iterator m = chan.members.begin(); m != chan.members.end(); ++m) {
+            std::map<int, Client>::iterator member = clients.find(*m);
+            if (member == clients.end() || member->second.getLinkFd() == link_fd) {
+                continue;
+            }
+            if (!members.empty())
+                members += " ";
+            if (chan.isOperator(*m))
+                members += "@";
+            members += member->second.getNickname();
+        }
+        if (!members.empty()) {
+            burst << "SJOIN " << chan.name << " :" << members << "\r\n";
+        }
+    }
+
+    burst << "EOB\r\n";
+    sendToClient(link_fd, burst.str());
+}
+
+
+void ChatServer::propagate(const std::string &line, int except_link) {
+    for (std::map<int, ServerLink>::iterator it = links.begin(); it != links.end(); ++it) {
+        if (it->second.established && it->first != except_link) {
+            sendToClient(it->first, line);
+        }
+    }
+}
+
+// Channel messages only need to reach links behind which a member sits.
+void ChatServer::propagateToChannel(Channel &chan, const std::string &line, int except_link) {
+    std::set<int> targets;
+    for (FdSet::iterator it = chan.members.begin(); it != chan.members.end(); ++it) {
+        if (*it >= 0) {
+            continue;
+        }
+        std::map<int, Client>::iterator member = clients.find(*it);
+        if (member != clients.end() && member->second.getLinkFd() != except_link) {
+            targets.insert(member->second.getLinkFd());
+        }
+    }
+    for (std::set<int>::iterator it = targets.begin(); it != targets.end(); ++it) {
+        sendToClient(*it, line);
+    }
+}
+
+void ChatServer::introduceUser(int client_fd) {
+    Client &client = clients[client_fd];
+    std::ostringstream uid;
+    uid << "UID " << client.getNickname() << " " << client.getUsername() << " "
+        << client.getSignonTime() << "\r\n";
+    propagate(uid.str(), -1);
+}
+
+
+// Removes a user from every channel and the client table. Local users are
+// disconnected; the event is announced to all links except except_link.
+void ChatServer::killUser(int id, const std::string &reason, int except_link) {
+    std::map<int, Client>::iterator it = clients.find(id);
+    if (it == clients.end()) {
+        return;
+    }
+    Client &client = it->second;
+    std::string quitLine = userPrefix(client) + " QUIT :" + reason + "\r\n";
+    notifyPeers(id, quitLine, false, NULL);
+
+    if (client.isRemote()) {
+        propagate("KILL " + client.getNickname() + " :" + reason + "\r\n", except_link);
+        eraseClient(id);
+    } else {
+        propagate(quitLine, except_link);
+        client.setQuitAnnounced(true);
+        sendToClient(id, "ERROR :Closing link (" + reason + ")\r\n");
+        handleClientDisconnect(id);
+    }
+}
+
+
+void ChatServer::dropLink(int link_fd) {
+    std::map<int, ServerLink>::iterator linkIt = links.find(link_fd);
+    if (linkIt == links.end()) {
+        return;
+    }
+    std::string reason = serverName + " " + (linkIt->second.name.empty() ? "*" : linkIt->second.name);
+    links.erase(linkIt);
+
+    for (size_t i = 0; i < linkTargets.size(); i++) {
+        if (linkTargets[i].fd == link_fd)
+            linkTargets[i].fd = -1;
+    }
+
+    std::vector<int> lost;
+    for (std::map<int, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (it->second.getLinkFd() == link_fd)
+            lost.push_back(it->first);
+    }
+    for (size_t i = 0; i < lost.size(); i++) {
+        Client &client = clients[lost[i]];
+        std::string quitLine = userPrefix(client) + " QUIT :" + reason + "\r\n";
+        notifyPeers(lost[i], quitLine, false, NULL);
+        propagate(quitLine, link_fd);
+        eraseClient(lost[i]);
+    }
+    if (!lost.empty()) {
+        std::cout << "Netsplit: lost " << lost.size() << " users (" << reason << ")" << std::endl;
+    }
+}
+
+
+// Returns the id of the remote user named by prefix if it sits behind link_fd.
+int ChatServer::remoteSource(int link_fd, const std::string &prefix) {
+    std::string nick = prefix.substr(0, prefix.find('!'));
+    int id = getFdByNickname(nick);
+    if (id == -1 || clients[id].getLinkFd() != link_fd) {
+        return -1;
+    }
+    return id;
+}
+
+
+void ChatServer::processServerMessage(int link_fd, const std::string &message) {
+    std::istringstream iss(message);
+    std::string prefix, command;
+    if (!message.empty() && message[0] == ':') {
+        iss >> prefix;
+        prefix.erase(0, 1);
+    }
+    iss >> command;
+
+    std::string rest;
+    std::getline(iss, rest);
+    size_t colon = rest.find(" :");
+    std::string trailing = colon == std::string::npos ? "" : rest.substr(colon + 2);
+    std::istringstream args(rest.substr(0, colon));
+    std::string line = message + "\r\n";
+
+    if (command == "PING") {
+        sendToClient(link_fd, "PONG :" + serverName + "\r\n");
+    } else if (command == "UID") {
+        std::string nick, user;
+        time_t ts = 0;
+        args >> nick >> user >> ts;
+        if (nick.empty() || user.empty()) {
+            return;
+        }
+
+        int existing = getFdByNickname(nick);
+        if (existing != -1) {
+            // Both sides of a netjoin apply the same rule: the older signon
+            // keeps the nick, and on a tie both users are removed.
+            time_t ours = clients[existing].getSignonTime();
+            if (ours <= ts) {
+                if (ours == ts)
+                    killUser(existing, "Nick collision", link_fd);
+                return;
+            }
+            killUser(existing, "Nick collision", link_fd);
+        }
+
+        int id = nextRemoteId--;
+        Client remote(id);
+        remote.setUsername(user);
+        remote.setSentWelcome(true);
+        remote.setLinkFd(link_fd);
+        remote.setSignonTime(ts);
+        clients[id] = remote;
+        setClientNickname(id, nick);
+        propagate(line, link_fd);
+    } else if (command == "KILL") {
+        std::string nick;
+        args >> nick;
+        int id = getFdByNickname(nick);
+        if (id != -1 && clients[id].getLinkFd() != link_fd) {
+            killUser(id, trailing, link_fd);
+        } else if (id != -1) {
+            propagate(line, link_fd);
+            dropRemoteUser(id, trailing);
+        }
+    } else if (command == "CHANINFO") {
+        std::string name, flags, key;
+        int limit = 0;
+        args >> name >> flags >> limit >> key;
+        if (name.empty()) {
+            return;
+        }
+        Channel &chan = channels[name];
+        chan.name = name;
+        chan.server = this;
+        if (flags.find('i') != std::string::npos)
+            chan.inviteOnly = true;
+        if (flags.find('t') != std::string::npos)
+            chan.topicRestricted = true;
+        if (chan.userLimit == 0)
+            chan.userLimit = limit;
+        if (chan.channelKey.empty() && key != "*")
+            chan.channelKey = key;
+        if (chan.getTopic().empty())
+            chan.setTopic(trailing);
+        snapshotDirty = true;
+        propagate(line, link_fd);
+    } else if (command == "MASK") {
+        std::string name, list, mask, setter;
+        long setAt = 0;
+        args >> name >> list >> mask >> setter >> setAt;
+        ChannelMap::iterator chanIt = channels.find(name);
+        if (chanIt == channels.end() || list.size() != 1 || std::string("beI").find(list[0]) == std::string::npos ||
+            mask.empty()) {
+            return;
+        }
+        Channel &chan = chanIt->second;
+        MaskList &masks = list[0] == 'b' ? chan.bans : list[0] == 'e' ? chan.exceptions : chan.invexes;
+        if (masks.size() < MAX_LIST_MASKS && masks.add(mask, setter, static_cast<time_t>(setAt))) {
+            chan.banCache.clear();
+            snapshotDirty = true;
+        }
+        propagate(line, link_fd);
+    } else if (command == "SJOIN") {
+        std::string name;
+        args >> name;
+        if (name.empty()) {
+            return;
+        }
+        Channel &chan = channels[name];
+        chan.name = name;
+        chan.server = this;
+
+        std::istringstream members(trailing);
+        std::string entry;
+        while (members >> entry) {
+            bool op = entry[0] == '@';
+            std::string nick = op ? entry.substr(1) : entry;
+            int id = remoteSource(link_fd, nick);
+            if (id == -1 || chan.isMember(id)) {
+                continue;
+            }
+            Client &member = clients[id];
+            chan.addMember(id, nick, member.getUsername());
+            chan.broadcast(userPrefix(member) + " JOIN " + name + "\r\n");
+            if (op) {
+                chan.makeOperator(id);
+                chan.broadcast(":irc.localhost MODE " + name + " +o " + nick + "\r\n");
+            }
+        }
+        propagate(line, link_fd);
+    } else if (command == "PRIVMSG" || command == "NOTICE") {
+        int source = remoteSource(link_fd, prefix);
+        std::string target;
+        args >> target;
+        if (source == -1 || target.empty()) {
+            return;
+        }
+        if (target[0] == '#' || target[0] == '&') {
+            ChannelMap::iterator chanIt = channels.find(target);
+            if (chanIt == channels.end()) {
+                return;
+            }
+            SharedLine shared(line);
+            sendChannelMessage(chanIt->second, shared, source);
+            propagateToChannel(chanIt->second, shared.str(), link_fd);
+        } else {
+            int recipient = getFdByNickname(target);
+            if (recipient != -1 && clients[recipient].getLinkFd() != link_fd) {
+                sendToClient(recipient, line);
+            }
+        }
+    } else if (command == "INVITE") {
+        int source = remoteSource(link_fd, prefix);
+        std::string target, channel;
+        args >> target >> channel;
+        int recipient = getFdByNickname(target);
+        if (source == -1 || recipient == -1 || clients[recipient].getLinkFd() == link_fd) {
+            return;
+        }
+        ChannelMap::iterator chanIt = channels.find(channel);
+        if (chanIt != channels.end()) {
+            chanIt->second.inviteUser(target);
+        }
+        sendToClient(recipient, line);
+    } else if (command == "PART" || command == "TOPIC" || command == "MODE" || command == "KICK") {
+        int source = remoteSource(link_fd, prefix);
+        std::string channel;
+        args >> channel;
+        ChannelMap::iterator chanIt = channels.find(channel);
+        if (source == -1 || chanIt == channels.end()) {
+            return;
+        }
+        Channel &chan = chanIt->second;
+
+        if (command == "PART") {
+            chan.removeMember(source);
+            chan.broadcast(line);
+        } else if (command == "TOPIC") {
+            chan.setTopic(trailing);
+            chan.broadcast(line);
+        } else if (command == "MODE") {
+            std::string modes, param;
+            args >> modes;
+            std::vector<std::string> params;
+            while (args >> param)
+                params.push_back(param);
+            std::vector<ModeChange> changes = chan.parseModes(modes, params, source);
+            chan.applyModes(changes, source);
+            chan.broadcast(line);
+        } else {
+            std::string target;
+            args >> target;
+            chan.broadcast(line);
+            int victim = chan.getFdByNickname(target);
+            if (victim != -1)
+                chan.removeMember(victim);
+        }
+        propagate(line, link_fd);
+    } else if (command == "NICK") {
+        int source = remoteSource(link_fd, prefix);
+        std::string newNick;
+        args >> newNick;
+        if (newNick.empty())
+            newNick = trailing;
+        if (source == -1 || newNick.empty()) {
+            return;
+        }
+        int existing = getFdByNickname(newNick);
+        if (existing != -1 && existing != source) {
+            killUser(existing, "Nick collision", -1);
+            killUser(source, "Nick collision", -1);
+            return;
+        }
+        renameUser(source, newNick, line);
+        propagate(line, link_fd);
+    } else if (command == "QUIT") {
+        int source = remoteSource(link_fd, prefix);
+        if (source == -1) {
+            return;
+        }
+        propagate(line, link_fd);
+        dropRemoteUser(source, trailing);
+    } else if (command == "ERROR") {
+        std::cerr << "Link error: " << trailing << std::endl;
+    }
+}
+
+
+// Forgets a remote user locally, showing a QUIT to local channel peers.
+void ChatServer::dropRemoteUser(int id, const std::string &reason) {
+    Client &client = clients[id];
+    std::string quitLine = userPrefix(client) + " QUIT :" + reason + "\r\n";
+    notifyPeers(id, quitLine, false, NULL);
+    eraseClient(id);
+}
+
+
+void ChatServer::renameUser(int id, const std::string &newNick, const std::string &line) {
+    notifyPeers(id, line, false, &newNick);
+    setClientNickname(id, newNick);
+}
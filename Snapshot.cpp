@@ -0,0 +1,231 @@
+#include "ChatServer.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "Serialize.hpp"
+#include <ctime>
+
+// Snapshot layout, all integers little-endian:
+//   "IRCS" | u32 version | u32 channel count | channels... | u32 checksum
+// Each channel is: name, topic, key (u32 length + bytes), i32 user limit,
+// u8 flags, u32 operator count and that many nicknames, then (version 2)
+// the ban, exception and invite-exception lists.
+
+#define SNAPSHOT_MAGIC "IRCS"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_FLAG_TOPIC_RESTRICTED 0x1
+#define SNAPSHOT_FLAG_INVITE_ONLY 0x2
+
+static uint32_t checksum(const char *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+std::string ChatServer::serializeChannels() {
+    std::string out(SNAPSHOT_MAGIC);
+    putU32(out, SNAPSHOT_VERSION);
+    putU32(out, static_cast<uint32_t>(channels.size()));
+
+    for (ChannelMap::iterator it = channels.begin(); it != channels.end(); ++it) {
+        Channel &chan = it->second;
+        putBytes(out, chan.name.data(), chan.name.size());
+        putBytes(out, chan.topic.data(), chan.topic.size());
+        putBytes(out, chan.channelKey.data(), chan.channelKey.size());
+        putU32(out, static_cast<uint32_t>(chan.userLimit));
+
+        unsigned char flags = 0;
+        if (chan.topicRestricted)
+            flags |= SNAPSHOT_FLAG_TOPIC_RESTRICTED;
+        if (chan.inviteOnly)
+            flags |= SNAPSHOT_FLAG_INVITE_ONLY;
+        out += static_cast<char>(flags);
+
+        // Operators are stored by nickname since fds do not survive a restart.
+        NickSet ops = chan.savedOperators;
+        for (FdSet::iterator op = chan.operators.begin(); op != chan.operators.end(); ++op) {
+            FdNickMap::iterator nick = chan.memberNicknames.find(*op);
+            if (nick != chan.memberNicknames.end())
+                ops.insert(nick->second);
+        }
+        putU32(out, static_cast<uint32_t>(ops.size()));
+        for (NickSet::iterator op = ops.begin(); op != ops.end(); ++op) {
+            putBytes(out, op->data(), op->size());
+        }
+        chan.serializeMasks(out);
+    }
+
+    putU32(out, checksum(out.data(), out.size()));
+    return out;
+}
+
+
+// Called by Channel whenever state the snapshot keeps may have changed.
+void ChatServer::channelChanged() {
+    snapshotDirty = true;
+}
+
+
+// Runs in the forked child, so it only touches its copy-on-write view.
+bool ChatServer::writeSnapshotFile(const std::string &data) {
+    std::string tmpPath = std::string(SNAPSHOT_FILE) + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        perror("Snapshot open failed");
+        return false;
+    }
+
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Snapshot write failed");
+            close(fd);
+            return false;
+        }
+        written += n;
+    }
+
+    if (fsync(fd) < 0) {
+        perror("Snapshot fsync failed");
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    if (rename(tmpPath.c_str(), SNAPSHOT_FILE) < 0) {
+        perror("Snapshot rename failed");
+        return false;
+    }
+
+    // The rename only survives a crash once the directory entry is synced.
+    std::string path = SNAPSHOT_FILE;
+    std::string dir = path.find('/') == std::string::npos ? "." : path.substr(0, path.rfind('/') + 1);
+    int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dirFd < 0 || fsync(dirFd) < 0) {
+        perror("Snapshot directory fsync failed");
+        if (dirFd >= 0)
+            close(dirFd);
+        return false;
+    }
+    close(dirFd);
+    return true;
+}
+
+
+void ChatServer::startSnapshot() {
+    if (snapshotPid > 0 || !snapshotDirty) {
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Snapshot fork failed");
+        return;
+    }
+    if (pid == 0) {
+        bool ok = writeSnapshotFile(serializeChannels());
+        _exit(ok ? 0 : 1);
+    }
+
+    snapshotPid = pid;
+    snapshotDirty = false;
+}
+
+
+void ChatServer::reapSnapshot() {
+    if (snapshotPid <= 0) {
+        return;
+    }
+
+    int status;
+    pid_t pid = waitpid(snapshotPid, &status, WNOHANG);
+    if (pid == 0) {
+        return;
+    }
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::cerr << "Snapshot failed, will retry" << std::endl;
+        snapshotDirty = true;
+    }
+    snapshotPid = -1;
+}
+
+
+void ChatServer::loadSnapshot() {
+    int fd = open(SNAPSHOT_FILE, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < 16) {
+        close(fd);
+        return;
+    }
+
+    size_t len = st.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Snapshot mmap failed");
+        return;
+    }
+
+    const char *data = static_cast<const char *>(map);
+    Reader trailer(data + len - 4, 4);
+    uint32_t stored;
+    trailer.getU32(stored);
+    if (memcmp(data, SNAPSHOT_MAGIC, 4) != 0 || checksum(data, len - 4) != stored) {
+        std::cerr << "Ignoring corrupt snapshot " << SNAPSHOT_FILE << std::endl;
+        munmap(map, len);
+        return;
+    }
+
+    Reader reader(data + 4, len - 8);
+    uint32_t version, count;
+    bool ok = reader.getU32(version) && version >= 1 && version <= SNAPSHOT_VERSION &&
+              reader.getU32(count);
+
+    ChannelMap loaded;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        std::string name, topic, key;
+        uint32_t limit, opCount;
+        unsigned char flags;
+        ok = reader.getBytes(name) && reader.getBytes(topic) && reader.getBytes(key) &&
+             reader.getU32(limit) && reader.getU8(flags) && reader.getU32(opCount);
+        if (!ok)
+            break;
+
+        Channel &chan = loaded[name];
+        chan.name = name;
+        chan.server = this;
+        chan.setTopic(topic);
+        chan.channelKey = key;
+        chan.userLimit = static_cast<int>(limit);
+        chan.topicRestricted = (flags & SNAPSHOT_FLAG_TOPIC_RESTRICTED) != 0;
+        chan.inviteOnly = (flags & SNAPSHOT_FLAG_INVITE_ONLY) != 0;
+
+        for (uint32_t j = 0; ok && j < opCount; j++) {
+            std::string nick;
+            ok = reader.getBytes(nick);
+            if (ok)
+                chan.savedOperators.insert(toPoolString(nick));
+        }
+        if (ok && version >= 2)
+            ok = chan.restoreMasks(reader);
+    }
+    munmap(map, len);
+
+    if (!ok) {
+        std::cerr << "Ignoring truncated snapshot " << SNAPSHOT_FILE << std::endl;
+        return;
+    }
+    channels.swap(loaded);
+    snapshotDirty = false;
+    std::cout << "Restored " << channels.size() << " channels from " << SNAPSHOT_FILE << std::endl;
+}
@@ -0,0 +1,496 @@
+#include "ChatServer.hpp"
+#include "Serialize.hpp"
+#include <csignal>
+#include <climits>
+#include <sys/wait.h>
+
+// Hot upgrade: on SIGUSR2 the running server forks, execs the binary found
+// at binaryPath and hands it the listening socket, every client socket and
+// the full client/channel state over a Unix socketpair. The old process
+// exits once the new one acknowledges; if anything fails it keeps serving.
+
+#define UPGRADE_ENV "IRCSERV_UPGRADE_FD"
+#define UPGRADE_MAGIC "IRCU"
+#define UPGRADE_VERSION 9
+#define UPGRADE_TIMEOUT_MS 10000
+#define UPGRADE_FDS_PER_MSG 200
+
+extern char **environ;
+
+volatile sig_atomic_t ChatServer::upgradeRequested = 0;
+
+void ChatServer::handleUpgradeSignal(int) {
+    upgradeRequested = 1;
+}
+
+void ChatServer::enableHotUpgrade(int argc, char **argv) {
+    char resolved[PATH_MAX];
+    if (realpath(argv[0], resolved) == NULL) {
+        perror("realpath failed, hot upgrade disabled");
+        return;
+    }
+    binaryPath = resolved;
+    execArgs.assign(argv + 1, argv + argc);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleUpgradeSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+}
+
+
+static bool writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool readAll(int fd, char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool sendFds(int sock, const std::vector<int> &fdList) {
+    for (size_t start = 0; start < fdList.size(); start += UPGRADE_FDS_PER_MSG) {
+        size_t count = std::min(fdList.size() - start, static_cast<size_t>(UPGRADE_FDS_PER_MSG));
+        std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+        char marker = 'F';
+        struct iovec iov;
+        iov.iov_base = &marker;
+        iov.iov_len = 1;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fdList[start], count * sizeof(int));
+
+        if (sendmsg(sock, &msg, 0) != 1)
+            return false;
+    }
+    return true;
+}
+
+static bool recvFds(int sock, size_t total, std::vector<int> &fdList) {
+    while (fdList.size() < total) {
+        size_t count = std::min(total - fdList.size(), static_cast<size_t>(UPGRADE_FDS_PER_MSG));
+        std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+        char marker;
+        struct iovec iov;
+        iov.iov_base = &marker;
+        iov.iov_len = 1;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+
+        if (recvmsg(sock, &msg, 0) != 1)
+            return false;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            return false;
+
+        size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int *data = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+        fdList.insert(fdList.end(), data, data + received);
+    }
+    return true;
+}
+
+
+std::string ChatServer::serializeUpgradeState(std::vector<int> &fdList) {
+    std::string out(UPGRADE_MAGIC);
+    putU32(out, UPGRADE_VERSION);
+    putU64(out, nextMsgId);
+
+    fdList.clear();
+    for (size_t i = 0; i < listeners.size(); i++) {
+        fdList.push_back(listeners[i].fd);
+    }
+    for (std::map<int, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
+        fdList.push_back(it->first);
+    }
+    putU32(out, static_cast<uint32_t>(fdList.size()));
+    for (size_t i = 0; i < fdList.size(); i++) {
+        putU32(out, static_cast<uint32_t>(fdList[i]));
+    }
+
+    putU32(out, static_cast<uint32_t>(listeners.size()));
+    for (size_t i = 0; i < listeners.size(); i++) {
+        putString(out, listeners[i].spec);
+        putU32(out, static_cast<uint32_t>(listeners[i].family));
+        putU32(out, static_cast<uint32_t>(listeners[i].backlog));
+        out += static_cast<char>(listeners[i].v6only ? 1 : 0);
+        putString(out, listeners[i].path);
+        putU64(out, static_cast<uint64_t>(listeners[i].dev));
+        putU64(out, static_cast<uint64_t>(listeners[i].ino));
+    }
+
+    putU32(out, static_cast<uint32_t>(clients.size()));
+    for (std::map<int, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
+        putU32(out, static_cast<uint32_t>(it->first));
+        it->second.serializeState(out);
+        putString(out, outbox.pendingOutput(it->first));
+    }
+
+    putU32(out, static_cast<uint32_t>(channels.size()));
+    for (ChannelMap::iterator it = channels.begin(); it != channels.end(); ++it) {
+        Channel &chan = it->second;
+        putString(out, chan.name);
+        putString(out, chan.topic);
+        putString(out, chan.channelKey);
+        putU32(out, static_cast<uint32_t>(chan.userLimit));
+        out += static_cast<char>((chan.topicRestricted ? 0x1 : 0) | (chan.inviteOnly ? 0x2 : 0));
+
+        putU32(out, static_cast<uint32_t>(chan.members.size()));
+        for (FdSet::iterator m = chan.members.begin(); m != chan.members.end(); ++m) {
+            putU32(out, static_cast<uint32_t>(*m));
+            putString(out, chan.memberNicknames[*m]);
+            putString(out, chan.memberUsernames[*m]);
+            out += static_cast<char>(chan.isOperator(*m) ? 1 : 0);
+        }
+
+        putU32(out, static_cast<uint32_t>(chan.invitedUsers.size()));
+        for (InviteMap::iterator n = chan.invitedUsers.begin(); n != chan.invitedUsers.end(); ++n) {
+            putString(out, n->first);
+        }
+        putU32(out, static_cast<uint32_t>(chan.savedOperators.size()));
+        for (NickSet::iterator n = chan.savedOperators.begin(); n != chan.savedOperators.end(); ++n) {
+            putString(out, *n);
+        }
+        chan.serializeMasks(out);
+
+        std::vector<HistoryEntry> entries;
+        chan.history.latest(NULL, chan.history.size(), entries);
+        putU32(out, static_cast<uint32_t>(entries.size()));
+        for (size_t i = 0; i < entries.size(); i++) {
+            putU64(out, entries[i].msgid);
+            putU64(out, static_cast<uint64_t>(entries[i].time.tv_sec));
+            putU32(out, static_cast<uint32_t>(entries[i].time.tv_usec));
+            putString(out, entries[i].line.str());
+        }
+    }
+    capture.serializeState(out);
+    return out;
+}
+
+
+bool ChatServer::restoreUpgradeState(const std::string &blob, const std::vector<int> &newFds) {
+    if (blob.compare(0, 4, UPGRADE_MAGIC) != 0) {
+        return false;
+    }
+    Reader body(blob.data() + 4, blob.size() - 4);
+
+    uint32_t version, fdCount;
+    uint64_t msgid;
+    if (!body.getU32(version) || version != UPGRADE_VERSION || !body.getU64(msgid) ||
+        !body.getU32(fdCount) || fdCount != newFds.size() || fdCount == 0) {
+        return false;
+    }
+    nextMsgId = msgid;
+
+    std::map<int, int> remap;
+    for (uint32_t i = 0; i < fdCount; i++) {
+        uint32_t oldFd;
+        if (!body.getU32(oldFd))
+            return false;
+        remap[static_cast<int>(oldFd)] = newFds[i];
+    }
+
+    uint32_t listenerCount;
+    if (!body.getU32(listenerCount) || listenerCount > fdCount)
+        return false;
+    for (uint32_t i = 0; i < listenerCount; i++) {
+        Listener listener;
+        uint32_t family, backlog;
+        unsigned char v6only;
+        uint64_t dev, ino;
+        if (!body.getBytes(listener.spec) || !body.getU32(family) || !body.getU32(backlog) ||
+            !body.getU8(v6only) || !body.getBytes(listener.path) || !body.getU64(dev) || !body.getU64(ino))
+            return false;
+        listener.dev = static_cast<dev_t>(dev);
+        listener.ino = static_cast<ino_t>(ino);
+        listener.fd = newFds[i];
+        listener.family = static_cast<int>(family);
+        listener.backlog = static_cast<int>(backlog);
+        listener.v6only = v6only != 0;
+        listeners.push_back(listener);
+    }
+
+    uint32_t clientCount;
+    if (!body.getU32(clientCount))
+        return false;
+    for (uint32_t i = 0; i < clientCount; i++) {
+        uint32_t oldFd;
+        if (!body.getU32(oldFd) || remap.find(oldFd) == remap.end())
+            return false;
+        int fd = remap[oldFd];
+        Client client(fd);
+        std::string pending;
+        if (!client.restoreState(body) || !body.getBytes(pending))
+            return false;
+        outbox.restorePending(fd, pending);
+        inputBytes += client.getBufferSize();
+        if (client.hasLine())
+            inputBacklog.insert(fd);
+        clients[fd] = client;
+        if (client.hasNickname())
+            nickIndex[client.getNickname()] = fd;
+        if (!client.getResumeToken().empty())
+            resumeTokens[client.getResumeToken()] = fd;
+        const std::set<std::string> &monitored = client.getMonitored();
+        for (std::set<std::string>::const_iterator it = monitored.begin(); it != monitored.end(); ++it)
+            monitorWatchers[*it].insert(fd);
+    }
+
+    uint32_t channelCount;
+    if (!body.getU32(channelCount))
+        return false;
+    for (uint32_t i = 0; i < channelCount; i++) {
+        std::string name, topic, key;
+        uint32_t limit, count;
+        unsigned char flags;
+        if (!body.getBytes(name) || !body.getBytes(topic) || !body.getBytes(key) ||
+            !body.getU32(limit) || !body.getU8(flags) || !body.getU32(count))
+            return false;
+
+        Channel &chan = channels[name];
+        chan.name = name;
+        chan.server = this;
+        chan.setTopic(topic);
+        chan.channelKey = key;
+        chan.userLimit = static_cast<int>(limit);
+        chan.topicRestricted = (flags & 0x1) != 0;
+        chan.inviteOnly = (flags & 0x2) != 0;
+
+        for (uint32_t j = 0; j < count; j++) {
+            uint32_t oldFd;
+            std::string nick, user;
+            unsigned char op;
+            if (!body.getU32(oldFd) || !body.getBytes(nick) || !body.getBytes(user) || !body.getU8(op))
+                return false;
+            std::map<int, int>::iterator fd = remap.find(oldFd);
+            if (fd == remap.end())
+                continue;
+            chan.addMember(fd->second, nick, user);
+            if (op)
+                chan.makeOperator(fd->second);
+        }
+
+        for (int list = 0; list < 2; list++) {
+            if (!body.getU32(count))
+                return false;
+            for (uint32_t j = 0; j < count; j++) {
+                std::string nick;
+                if (!body.getBytes(nick))
+                    return false;
+                if (list == 0) {
+                    chan.invitedUsers[toPoolString(nick)] = time(NULL);
+                    invitesByNick[nick].insert(chan.name);
+                } else
+                    chan.savedOperators.insert(toPoolString(nick));
+            }
+        }
+
+        if (!chan.restoreMasks(body) || !body.getU32(count))
+            return false;
+        for (uint32_t j = 0; j < count; j++) {
+            uint64_t id, sec;
+            uint32_t usec;
+            std::string line;
+            if (!body.getU64(id) || !body.getU64(sec) || !body.getU32(usec) || !body.getBytes(line))
+                return false;
+            HistoryEntry entry;
+            entry.msgid = id;
+            entry.time.tv_sec = static_cast<time_t>(sec);
+            entry.time.tv_usec = usec;
+            entry.line = SharedLine(line);
+            chan.history.append(entry);
+        }
+        if (!chan.history.empty()) {
+            historyBytes += chan.history.getBytes();
+            historyHeads.insert(std::make_pair(chan.history.oldestId(), chan.name));
+        }
+    }
+    return capture.restoreState(body, remap) && body.atEnd();
+}
+
+
+void ChatServer::performUpgrade() {
+    upgradeRequested = 0;
+    if (binaryPath.empty()) {
+        std::cerr << "Hot upgrade not enabled" << std::endl;
+        return;
+    }
+    // Parked sessions also live under memory ids, but they quit below
+    // rather than block the upgrade.
+    for (std::map<int, Client>::iterator it = clients.lower_bound(MEMORY_ID_BASE); it != clients.end(); ++it) {
+        if (parkedClients.find(it->first) == parkedClients.end()) {
+            std::cerr << "Hot upgrade is not supported with in-memory connections" << std::endl;
+            return;
+        }
+    }
+    if (!links.empty()) {
+        std::cerr << "Hot upgrade is not supported while server links are up" << std::endl;
+        return;
+    }
+    expireParkedClients(true);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("Upgrade socketpair failed");
+        return;
+    }
+
+    // Worker threads do not survive fork(), so settle them and the capture
+    // buffer first and build everything execve needs; the child only closes
+    // descriptors and execs.
+    outbox.quiesce();
+    capture.flush();
+
+    std::vector<char *> args;
+    args.push_back(const_cast<char *>(binaryPath.c_str()));
+    for (size_t i = 0; i < execArgs.size(); i++) {
+        args.push_back(const_cast<char *>(execArgs[i].c_str()));
+    }
+    args.push_back(NULL);
+
+    std::ostringstream handoff;
+    handoff << UPGRADE_ENV "=" << sv[1];
+    std::string handoffVar = handoff.str();
+    std::vector<char *> env;
+    for (char **e = environ; *e; e++) {
+        if (strncmp(*e, UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0)
+            env.push_back(*e);
+    }
+    env.push_back(const_cast<char *>(handoffVar.c_str()));
+    env.push_back(NULL);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Upgrade fork failed");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        // Inherited copies would keep sockets alive after the new process
+        // closes them, so only the handoff socket survives the exec.
+        for (size_t i = 0; i < fds.size(); i++) {
+            close(fds[i].fd);
+        }
+        close(sv[0]);
+        execve(binaryPath.c_str(), &args[0], &env[0]);
+        _exit(127);
+    }
+    close(sv[1]);
+
+    std::cout << "Handing off to new process " << pid << std::endl;
+    std::vector<int> fdList;
+    std::string blob = serializeUpgradeState(fdList);
+    std::string header;
+    putU32(header, static_cast<uint32_t>(blob.size()));
+
+    bool ok = writeAll(sv[0], header.data(), header.size()) &&
+              writeAll(sv[0], blob.data(), blob.size()) && sendFds(sv[0], fdList);
+
+    char ack = 0;
+    if (ok) {
+        pollfd pfd;
+        pfd.fd = sv[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        ok = poll(&pfd, 1, UPGRADE_TIMEOUT_MS) == 1 && read(sv[0], &ack, 1) == 1 && ack == 'K';
+    }
+    close(sv[0]);
+
+    if (ok) {
+        std::cout << "Hot upgrade complete, exiting" << std::endl;
+        exit(0);
+    }
+
+    std::cerr << "Hot upgrade failed, continuing to serve" << std::endl;
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+
+bool ChatServer::resumeFromUpgrade() {
+    const char *handoff = getenv(UPGRADE_ENV);
+    if (!handoff) {
+        return false;
+    }
+    int sock = std::atoi(handoff);
+    unsetenv(UPGRADE_ENV);
+
+    char header[4];
+    std::string blob;
+    std::vector<int> newFds;
+    bool ok = readAll(sock, header, sizeof(header));
+    if (ok) {
+        uint32_t len;
+        Reader reader(header, sizeof(header));
+        reader.getU32(len);
+        blob.resize(len);
+        ok = len > 0 && readAll(sock, &blob[0], len);
+    }
+    if (ok) {
+        Reader reader(blob.data() + 4, blob.size() - 4);
+        uint32_t version, fdCount;
+        uint64_t msgid;
+        ok = reader.getU32(version) && reader.getU64(msgid) && reader.getU32(fdCount) &&
+             recvFds(sock, fdCount, newFds) && restoreUpgradeState(blob, newFds);
+    }
+
+    if (!ok) {
+        std::cerr << "Hot upgrade handoff failed" << std::endl;
+        exit(1);
+    }
+
+    pollfd pfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    for (size_t i = 0; i < listeners.size(); i++) {
+        pfd.fd = listeners[i].fd;
+        fds.push_back(pfd);
+    }
+    for (std::map<int, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
+        pfd.fd = it->first;
+        pfd.events = POLLIN | (outbox.hasPending(it->first) ? POLLOUT : 0);
+        fds.push_back(pfd);
+    }
+
+    char ack = 'K';
+    writeAll(sock, &ack, 1);
+    close(sock);
+
+    std::cout << "Resumed " << clients.size() << " clients and " << channels.size()
+              << " channels from hot upgrade" << std::endl;
+    return true;
+}
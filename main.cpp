@@ -1,33 +1,52 @@
 #include "ChatServer.hpp"
-#include <climits>
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: ./ircserv <port> <password>" << std::endl;
+    if (argc < 3) {
+        std::cerr << "Usage: ./ircserv <port>[,<listener>...] <password> [<servername> [<host:port> ...]]" << std::endl;
         return 1;
     }
 
-	errno = 0;
-	char *end;
-	long result = std::strtol(argv[1], &end, 10);
-
-	if (errno == ERANGE || result > INT_MAX || result < 1024)
-	{
-        std::cerr << "Invalid port value!" << std::endl;
-        return 1;
-	}
-
-	if (*end != '\0')
-	{
+    std::vector<std::string> listenSpecs = splitCommaList(argv[1]);
+    if (listenSpecs.empty()) {
         std::cerr << "Invalid port value!" << std::endl;
         return 1;
-	}
-
-	int port = static_cast<int>(result);
+    }
 
     std::string password = argv[2];
 
-    ChatServer server(port, password);
+    ChatServer server(password);
+    server.enableHotUpgrade(argc, argv);
+    server.enableMotdReload();
+    if (!server.start(listenSpecs)) {
+        return 1;
+    }
+    if (std::getenv(MEMORY_SOFT_ENV) || std::getenv(MEMORY_HARD_ENV)) {
+        const char *soft = std::getenv(MEMORY_SOFT_ENV);
+        const char *hard = std::getenv(MEMORY_HARD_ENV);
+        server.setMemoryLimits(soft ? std::strtoul(soft, NULL, 10) : MEMORY_SOFT_LIMIT,
+                               hard ? std::strtoul(hard, NULL, 10) : MEMORY_HARD_LIMIT);
+    }
+    if (std::getenv(CAPTURE_ENV)) {
+        server.enableCapture(std::getenv(CAPTURE_ENV));
+    }
+    if (argc > 3) {
+        server.setServerName(argv[3]);
+    }
+    for (int i = 4; i < argc; i++) {
+        std::string peer = argv[i];
+        size_t colon = peer.rfind(':');
+        if (colon == std::string::npos) {
+            std::cerr << "Invalid link " << peer << ", expected <host:port>" << std::endl;
+            return 1;
+        }
+        server.addLinkTarget(peer.substr(0, colon), std::atoi(peer.c_str() + colon + 1));
+    }
+    if (std::getenv(LINK_PASSWORD_ENV)) {
+        server.setLinkPassword(std::getenv(LINK_PASSWORD_ENV));
+    } else if (argc > 4) {
+        std::cerr << "Server links need a password in " << LINK_PASSWORD_ENV << std::endl;
+        return 1;
+    }
     server.run();
 
     return 0;
@@ -1,76 +1,132 @@
 #include "ChatServer.hpp"
 
+std::vector<std::string> splitCommaList(const std::string &list) {
+    std::vector<std::string> items;
+    std::string item;
+    std::istringstream iss(list);
+    while (std::getline(iss, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+
 void ChatServer::processJoinCommand(int client_fd, std::istringstream &iss) {
-    std::string channelName, key;
-    iss >> channelName >> key;
+    std::string channelList, keyList;
+    iss >> channelList >> keyList;
 
-    if (channelName.empty()) {
+    if (channelList.empty()) {
         std::string errorMsg = ":irc.localhost 461 " + clients[client_fd].getNickname() +
                                " JOIN :Not enough parameters\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
+    std::vector<std::string> names = splitCommaList(channelList);
+    std::vector<std::string> keys = splitCommaList(keyList);
+    if (names.size() > TARGMAX) {
+        std::string errorMsg = ":irc.localhost 407 " + clients[client_fd].getNickname() +
+                               " " + channelList + " :Too many targets\r\n";
+        sendToClient(client_fd, errorMsg);
+        return;
+    }
+
+    for (size_t i = 0; i < names.size(); i++) {
+        joinChannel(client_fd, names[i], i < keys.size() ? keys[i] : "");
+    }
+}
+
+
+void ChatServer::joinChannel(int client_fd, std::string channelName, const std::string &key) {
     if (channelName[0] != '#') {
         channelName = "#" + channelName;
     }
 
     bool isNewChannel = (channels.find(channelName) == channels.end());
 
+    if (isNewChannel && memoryPressure() != MEMORY_OK) {
+        std::string errorMsg = ":irc.localhost 405 " + clients[client_fd].getNickname() + " " + channelName +
+                               " :Cannot create channel, server is low on memory\r\n";
+        sendToClient(client_fd, errorMsg);
+        return;
+    }
+
     if (isNewChannel) {
-        channels.insert(std::make_pair(channelName, Channel(channelName)));
+        Channel &chan = channels[channelName];
+        chan.name = channelName;
+        chan.server = this;
         std::cout << "Created new channel: " << channelName << std::endl;
     } else {
         Channel &chan = channels[channelName];
 
-        if (chan.isInviteOnly() && !chan.isInvited(clients[client_fd].getNickname())) {
+        if (chan.isBanned(clients[client_fd])) {
+            std::string errorMsg = ":irc.localhost 474 " + clients[client_fd].getNickname() +
+                                   " " + channelName + " :Cannot join channel (+b)\r\n";
+            sendToClient(client_fd, errorMsg);
+            return;
+        }
+
+        if (chan.isInviteOnly() && !chan.isInvited(clients[client_fd].getNickname()) &&
+            !chan.isInvexed(clients[client_fd])) {
             std::string errorMsg = ":irc.localhost 473 " + clients[client_fd].getNickname() +
                                    " " + channelName + " :Cannot join: Invite-only channel\r\n";
-            send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+            sendToClient(client_fd, errorMsg);
             return;
         }
 
         if (chan.getUserLimit() > 0 && chan.getMemberCount() >= chan.getUserLimit()) {
             std::string errorMsg = ":irc.localhost 471 " + clients[client_fd].getNickname() +
                                    " " + channelName + " :Cannot join: Channel is full\r\n";
-            send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+            sendToClient(client_fd, errorMsg);
             return;
         }
 
         if (!chan.getChannelKey().empty() && chan.getChannelKey() != key) {
             std::string errorMsg = ":irc.localhost 475 " + clients[client_fd].getNickname() +
                                    " " + channelName + " :Cannot join: Incorrect channel key\r\n";
-            send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+            sendToClient(client_fd, errorMsg);
             return;
         }
     }
 
     std::string nickname = clients[client_fd].getNickname();
     if (nickname.empty()) {
-        send(client_fd, "You must set a nickname before joining a channel.\r\n", 50, 0);
+        sendToClient(client_fd, "You must set a nickname before joining a channel.\r\n");
         return;
     }
     std::string username = clients[client_fd].getUsername();
     if (username.empty()) {
-        send(client_fd, "You must set a username before joining a channel.\r\n", 50, 0);
+        sendToClient(client_fd, "You must set a username before joining a channel.\r\n");
         return;
     }
 
     channels[channelName].addMember(client_fd, nickname, username);
     clients[client_fd].setCurrentChannel(channelName);
 
+    Channel &joined = channels[channelName];
+    NickSet::iterator savedOp = joined.savedOperators.find(toPoolString(nickname));
+    if (savedOp != joined.savedOperators.end()) {
+        joined.makeOperator(client_fd);
+        joined.savedOperators.erase(savedOp);
+    }
+
     if (isNewChannel) {
         channels[channelName].makeOperator(client_fd);
         std::string response = "You are now the channel operator.\r\n";
-        send(client_fd, response.c_str(), response.size(), 0);
+        sendToClient(client_fd, response);
     }
 
     std::string response = "Joined " + channelName + "\n";
-    send(client_fd, response.c_str(), response.size(), 0);
+    sendToClient(client_fd, response);
     std::cout << "User " << client_fd << " joined channel: " << channelName << std::endl;
 
     std::string joinMsg = ":" + nickname + "!" + username + "@localhost JOIN " + channelName + "\r\n";
     channels[channelName].broadcast(joinMsg);
+    std::string sjoin = ":" + serverName + " SJOIN " + channelName + " :" +
+                        (joined.isOperator(client_fd) ? "@" : "") + nickname + "\r\n";
+    propagate(sjoin, -1);
 
     std::string topic = channels[channelName].getTopic();
     std::string topicMsg;
@@ -79,64 +135,84 @@ void ChatServer::processJoinCommand(int client_fd, std::istringstream &iss) {
     } else {
         topicMsg = ":irc.localhost 331 " + nickname + " " + channelName + " :No topic is set\r\n";
     }
-    send(client_fd, topicMsg.c_str(), topicMsg.size(), 0);
-
-    std::string namesList = ":irc.localhost 353 " + nickname + " = " + channelName + " :";
-    namesList += channels[channelName].getMembersList();
-    namesList += "\r\n";
-    send(client_fd, namesList.c_str(), namesList.size(), 0);
+    sendToClient(client_fd, topicMsg);
 
-    std::string endNames = ":irc.localhost 366 " + nickname + " " + channelName + " :End of /NAMES list\r\n";
-    send(client_fd, endNames.c_str(), endNames.size(), 0);
+    if (!clients[client_fd].hasCapability(CAP_NO_IMPLICIT_NAMES)) {
+        sendNames(client_fd, channels[channelName]);
+    }
 }
 
 
 void ChatServer::processPrivMsgCommand(int client_fd, std::istringstream &iss) {
-    std::string target, msg;
-    iss >> target;
+    std::string targetList, msg;
+    iss >> targetList;
     std::getline(iss, msg);
 
     while (!msg.empty() && (msg[0] == ' ' || msg[0] == ':')) {
         msg.erase(0, 1);
     }
 
-    std::cout << "PRIVMSG received - Target: '" << target << "', Message: '" << msg << "'" << std::endl;
     Client &client = clients[client_fd];
 
-    if (target.empty() || msg.empty()) {
+    if (targetList.empty() || msg.empty()) {
         std::string errorMsg = ":irc.localhost 461 " + client.getNickname() +
                                " PRIVMSG :Not enough parameters\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
+        return;
+    }
+
+    std::vector<std::string> targets = splitCommaList(targetList);
+    if (targets.size() > TARGMAX) {
+        std::string errorMsg = ":irc.localhost 407 " + client.getNickname() +
+                               " " + targetList + " :Too many targets\r\n";
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
-    if (target[0] == '#' || target[0] == '&') {
-        if (channels.find(target) != channels.end()) {
-            if (!channels[target].isMember(client_fd)) {
+    // Prefix and payload are serialized once; only the target differs per line.
+    std::string head = ":" + client.getNickname() + "!" + client.getUsername() + "@localhost PRIVMSG ";
+    std::string tail = " :" + msg + "\r\n";
+    std::set<std::string> seen;
+
+    for (size_t i = 0; i < targets.size(); i++) {
+        const std::string &target = targets[i];
+        if (!seen.insert(target).second) {
+            continue;
+        }
+
+        if (target[0] == '#' || target[0] == '&') {
+            ChannelMap::iterator chanIt = channels.find(target);
+            if (chanIt == channels.end()) {
+                std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
+                                       " " + target + " :No such channel\r\n";
+                sendToClient(client_fd, errorMsg);
+                continue;
+            }
+            if (!chanIt->second.isMember(client_fd)) {
                 std::string errorMsg = ":irc.localhost 404 " + client.getNickname() +
                                        " " + target + " :Cannot send to channel\r\n";
-                send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
-                return;
+                sendToClient(client_fd, errorMsg);
+                continue;
             }
-            channels[target].sendMessageToChannel(msg, client_fd);
-        } else {
-            std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
-                                   " " + target + " :No such channel\r\n";
-            send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
-        }
-    }
-    else {
-        int recipientFd = getFdByNickname(target);
-        if (recipientFd == -1) {
-            std::string errorMsg = ":irc.localhost 401 " + client.getNickname() +
-                                   " " + target + " :No such nick/channel\r\n";
-            send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+            if (!chanIt->second.isOperator(client_fd) && chanIt->second.isBanned(client)) {
+                std::string errorMsg = ":irc.localhost 404 " + client.getNickname() +
+                                       " " + target + " :Cannot send to channel (+b)\r\n";
+                sendToClient(client_fd, errorMsg);
+                continue;
+            }
+            SharedLine line(head + target + tail);
+            sendChannelMessage(chanIt->second, line, client_fd);
+            propagateToChannel(chanIt->second, line.str(), -1);
         } else {
-            std::string senderPrefix = ":" + client.getNickname() + "!" +
-                                       client.getUsername() + "@localhost";
-            std::string messageToSend = senderPrefix + " PRIVMSG " + target +
-                                        " :" + msg + "\r\n";
-            send(recipientFd, messageToSend.c_str(), messageToSend.size(), 0);
+            int recipientFd = getFdByNickname(target);
+            if (recipientFd == -1) {
+                std::string errorMsg = ":irc.localhost 401 " + client.getNickname() +
+                                       " " + target + " :No such nick/channel\r\n";
+                sendToClient(client_fd, errorMsg);
+                continue;
+            }
+            std::string messageToSend = head + target + tail;
+            sendToClient(recipientFd, messageToSend);
         }
     }
 }
@@ -149,21 +225,21 @@ void ChatServer::processKickCommand(int client_fd, std::istringstream &iss) {
     if (channel.empty() || target.empty()) {
         std::string errorMsg = ":irc.localhost 461 " + client.getNickname() +
                                " KICK :Not enough parameters\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
     if (channel[0] != '#' && channel[0] != '&') {
         std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
                                " " + channel + " :No such channel\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
     if (channels.find(channel) == channels.end()) {
         std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
                                " " + channel + " :No such channel\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
@@ -172,22 +248,16 @@ void ChatServer::processKickCommand(int client_fd, std::istringstream &iss) {
     if (!chan.isOperator(client_fd)) {
         std::string errorMsg = ":irc.localhost 482 " + client.getNickname() +
                                " " + channel + " :You're not channel operator\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
-    int target_fd = -1;
-    for (std::map<int, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
-        if (it->second.getNickname() == target) {
-            target_fd = it->first;
-            break;
-        }
-    }
+    int target_fd = getFdByNickname(target);
 
     if (target_fd == -1 || !chan.isMember(target_fd)) {
         std::string errorMsg = ":irc.localhost 441 " + client.getNickname() +
                                " " + target + " " + channel + " :They aren't on that channel\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
@@ -195,6 +265,7 @@ void ChatServer::processKickCommand(int client_fd, std::istringstream &iss) {
     std::string kickMessage = ":" + client.getNickname() + "!" + client.getUsername() + "@localhost" +
                           " KICK " + channel + " " + target + " :Kicked by operator\r\n";
     chan.broadcast(kickMessage);
+    propagate(kickMessage, -1);
     chan.removeMember(target_fd);
 }
 
@@ -207,21 +278,21 @@ void ChatServer::processInviteCommand(int client_fd, std::istringstream &iss) {
     if (target.empty() || channel.empty()) {
         std::string errorMsg = ":irc.localhost 461 " + client.getNickname() +
                                " INVITE :Not enough parameters\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
     if (channel[0] != '#' && channel[0] != '&') {
         std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
                                " " + channel + " :No such channel\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
     if (channels.find(channel) == channels.end()) {
         std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
                                " " + channel + " :No such channel\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
@@ -230,22 +301,16 @@ void ChatServer::processInviteCommand(int client_fd, std::istringstream &iss) {
     if (!chan.isOperator(client_fd)) {
         std::string errorMsg = ":irc.localhost 482 " + client.getNickname() +
                                " " + channel + " :You're not channel operator\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
-    int target_fd = -1;
-    for (std::map<int, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
-        if (it->second.getNickname() == target) {
-            target_fd = it->first;
-            break;
-        }
-    }
+    int target_fd = getFdByNickname(target);
 
     if (target_fd == -1) {
         std::string errorMsg = ":irc.localhost 401 " + client.getNickname() +
                                " " + target + " :No such nick/channel\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
@@ -253,11 +318,11 @@ void ChatServer::processInviteCommand(int client_fd, std::istringstream &iss) {
 
     std::string operPrefix = ":" + client.getNickname() + "!" + client.getUsername() + "@localhost";
     std::string inviteMsg = operPrefix + " INVITE " + target + " " + channel + "\r\n";
-    send(target_fd, inviteMsg.c_str(), inviteMsg.size(), 0);
+    sendToClient(target_fd, inviteMsg);
 
     std::string replyMsg = ":irc.localhost 341 " + client.getNickname() + " " + target + " " + channel +
                            " :Invitation sent\r\n";
-    send(client_fd, replyMsg.c_str(), replyMsg.size(), 0);
+    sendToClient(client_fd, replyMsg);
 }
 
 
@@ -269,21 +334,21 @@ void ChatServer::processTopicCommand(int client_fd, std::istringstream &iss) {
     if (channel.empty()) {
         std::string errorMsg = ":irc.localhost 461 " + client.getNickname() +
                                " TOPIC :Not enough parameters\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
     if (channel[0] != '#' && channel[0] != '&') {
         std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
                                " " + channel + " :No such channel\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
     if (channels.find(channel) == channels.end()) {
         std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
                                " " + channel + " :No such channel\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
@@ -295,11 +360,11 @@ void ChatServer::processTopicCommand(int client_fd, std::istringstream &iss) {
         if (currentTopic.empty()) {
             std::string response = ":irc.localhost 331 " + client.getNickname() +
                                    " " + channel + " :No topic is set\r\n";
-            send(client_fd, response.c_str(), response.size(), 0);
+            sendToClient(client_fd, response);
         } else {
             std::string response = ":irc.localhost 332 " + client.getNickname() +
                                    " " + channel + " :" + currentTopic + "\r\n";
-            send(client_fd, response.c_str(), response.size(), 0);
+            sendToClient(client_fd, response);
         }
         return;
     }
@@ -318,7 +383,7 @@ void ChatServer::processTopicCommand(int client_fd, std::istringstream &iss) {
     if (chan.isTopicRestricted() && !chan.isOperator(client_fd)) {
         std::string errorMsg = ":irc.localhost 482 " + client.getNickname() +
                                " " + channel + " :You're not channel operator\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
@@ -327,50 +392,134 @@ void ChatServer::processTopicCommand(int client_fd, std::istringstream &iss) {
                                client.getUsername() + "@localhost TOPIC " +
                                channel + " :" + topic + "\r\n";
     chan.broadcast(notification);
+    propagate(notification, -1);
 }
 
 
 void ChatServer::processModeCommand(int client_fd, std::istringstream &iss) {
-    std::string channel, mode, param;
-    iss >> channel >> mode >> param;
+    std::string channel, modes, param;
+    iss >> channel >> modes;
+    std::vector<std::string> params;
+    while (iss >> param) {
+        params.push_back(param);
+    }
 
     Client &client = clients[client_fd];
-    if (channel.empty() || mode.empty()) {
+    if (channel.empty()) {
         std::string errorMsg = ":irc.localhost 461 " + client.getNickname() +
                                " MODE :Not enough parameters\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
     if (channel[0] != '#' && channel[0] != '&') {
-        std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
-                               " " + channel + " :No such channel\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        processUserMode(client_fd, channel, modes);
         return;
     }
 
     if (channels.find(channel) == channels.end()) {
         std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
                                " " + channel + " :No such channel\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
+        return;
+    }
+    Channel &chan = channels[channel];
+
+    if (modes.empty()) {
+        std::string reply = ":irc.localhost 324 " + client.getNickname() + " " + channel + " " +
+                            chan.modeString(chan.isMember(client_fd)) + "\r\n";
+        sendToClient(client_fd, reply);
+        return;
+    }
+
+    if (params.empty() && (modes == "b" || modes == "+b" || modes == "e" || modes == "+e" ||
+                           modes == "I" || modes == "+I")) {
+        std::string reply;
+        chan.appendMaskList(reply, client.getNickname(), modes[modes.size() - 1]);
+        sendToClient(client_fd, reply);
         return;
     }
 
-    if (!channels[channel].isOperator(client_fd)) {
+    if (!chan.isOperator(client_fd)) {
         std::string errorMsg = ":irc.localhost 482 " + client.getNickname() +
                                " " + channel + " :You're not channel operator\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
 
-    channels[channel].setMode(mode, param, client_fd);
+    std::vector<ModeChange> changes = chan.parseModes(modes, params, client_fd);
+    std::string applied = chan.applyModes(changes, client_fd);
+    if (!applied.empty()) {
+        std::string modeLine = userPrefix(client) + " MODE " + channel + " " + applied + "\r\n";
+        chan.broadcast(modeLine);
+        propagate(modeLine, -1);
+    }
+}
+
+
+// Supported user modes are +i (hidden from WHO masks), +w and +o.
+void ChatServer::processUserMode(int client_fd, const std::string &target, const std::string &modes) {
+    Client &client = clients[client_fd];
+    std::string nick = client.getNickname();
+    if (target != nick) {
+        std::string errorMsg = ":irc.localhost 502 " + nick + " :Cant change mode for other users\r\n";
+        sendToClient(client_fd, errorMsg);
+        return;
+    }
+
+    if (modes.empty()) {
+        std::string current = "+";
+        if (client.hasUserMode(UMODE_INVISIBLE))
+            current += 'i';
+        if (client.hasUserMode(UMODE_WALLOPS))
+            current += 'w';
+        if (client.hasUserMode(UMODE_OPER))
+            current += 'o';
+        sendToClient(client_fd, ":irc.localhost 221 " + nick + " " + current + "\r\n");
+        return;
+    }
+
+    std::string applied;
+    char sign = '+', shown = 0;
+    bool unknown = false;
+    for (size_t i = 0; i < modes.size(); i++) {
+        char mode = modes[i];
+        if (mode == '+' || mode == '-') {
+            sign = mode;
+            continue;
+        }
+        unsigned int flag = mode == 'i' ? UMODE_INVISIBLE : mode == 'w' ? UMODE_WALLOPS :
+                            mode == 'o' ? UMODE_OPER : 0;
+        if (!flag) {
+            unknown = true;
+            continue;
+        }
+        // Operator status comes from OPER; MODE can only drop it.
+        if (flag == UMODE_OPER && sign == '+')
+            continue;
+        if (client.hasUserMode(flag) == (sign == '+'))
+            continue;
+        client.setUserMode(flag, sign == '+');
+        if (sign != shown) {
+            shown = sign;
+            applied += sign;
+        }
+        applied += mode;
+    }
+
+    if (unknown) {
+        sendToClient(client_fd, ":irc.localhost 501 " + nick + " :Unknown MODE flag\r\n");
+    }
+    if (!applied.empty()) {
+        sendToClient(client_fd, userPrefix(client) + " MODE " + nick + " :" + applied + "\r\n");
+    }
 }
 
 void ChatServer::processPartCommand(int client_fd, std::istringstream &iss) {
-    std::string channel;
+    std::string channelList;
     std::string partMessage;
     
-    iss >> channel;
+    iss >> channelList;
     std::getline(iss, partMessage);
     
     while (!partMessage.empty() && (partMessage[0] == ' ' || partMessage[0] == ':')) {
@@ -378,50 +527,60 @@ void ChatServer::processPartCommand(int client_fd, std::istringstream &iss) {
     }
     
     Client &client = clients[client_fd];
-    if (channel.empty()) {
+    if (channelList.empty()) {
         std::string errorMsg = ":irc.localhost 461 " + client.getNickname() +
                                " PART :Not enough parameters\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+        sendToClient(client_fd, errorMsg);
         return;
     }
-    
-    if (channel[0] != '#' && channel[0] != '&') {
-        std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
-                               " " + channel + " :No such channel\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
-        return;
-    }
-    
-    if (channels.find(channel) == channels.end()) {
-        std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
-                               " " + channel + " :No such channel\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
-        return;
-    }
-    
-    Channel &chan = channels[channel];
-    if (!chan.isMember(client_fd)) {
-        std::string errorMsg = ":irc.localhost 442 " + client.getNickname() +
-                               " " + channel + " :You're not on that channel\r\n";
-        send(client_fd, errorMsg.c_str(), errorMsg.size(), 0);
+
+    std::vector<std::string> names = splitCommaList(channelList);
+    if (names.size() > TARGMAX) {
+        std::string errorMsg = ":irc.localhost 407 " + client.getNickname() +
+                               " " + channelList + " :Too many targets\r\n";
+        sendToClient(client_fd, errorMsg);
         return;
     }
-    
-    std::string senderPrefix = ":" + client.getNickname() + "!" + client.getUsername() + "@localhost";
-    std::string notification = senderPrefix + " PART " + channel;
-    if (!partMessage.empty()) {
-        notification += " :" + partMessage;
+
+    std::string head = ":" + client.getNickname() + "!" + client.getUsername() + "@localhost PART ";
+    std::string tail = partMessage.empty() ? "\r\n" : " :" + partMessage + "\r\n";
+
+    for (size_t i = 0; i < names.size(); i++) {
+        const std::string &channel = names[i];
+
+        if (channel[0] != '#' && channel[0] != '&') {
+            std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
+                                   " " + channel + " :No such channel\r\n";
+            sendToClient(client_fd, errorMsg);
+            continue;
+        }
+
+        ChannelMap::iterator chanIt = channels.find(channel);
+        if (chanIt == channels.end()) {
+            std::string errorMsg = ":irc.localhost 403 " + client.getNickname() +
+                                   " " + channel + " :No such channel\r\n";
+            sendToClient(client_fd, errorMsg);
+            continue;
+        }
+
+        Channel &chan = chanIt->second;
+        if (!chan.isMember(client_fd)) {
+            std::string errorMsg = ":irc.localhost 442 " + client.getNickname() +
+                                   " " + channel + " :You're not on that channel\r\n";
+            sendToClient(client_fd, errorMsg);
+            continue;
+        }
+
+        chan.removeMember(client_fd);
+        chan.broadcast(head + channel + tail);
+        propagate(head + channel + tail, -1);
     }
-    notification += "\r\n";
-    
-    chan.removeMember(client_fd);
-    chan.broadcast(notification);
 }
 
 
 void ChatServer::processNoticeCommand(int client_fd, std::istringstream &iss) {
-    std::string target, msg;
-    iss >> target;
+    std::string targetList, msg;
+    iss >> targetList;
     std::getline(iss, msg);
     
     while (!msg.empty() && (msg[0] == ' ' || msg[0] == ':')) {
@@ -429,40 +588,62 @@ void ChatServer::processNoticeCommand(int client_fd, std::istringstream &iss) {
     }
     
     // Отладочная информация (необязательно)
-    // std::cout << "NOTICE received - Target: '" << target << "', Message: '" << msg << "'" << std::endl;
+    // std::cout << "NOTICE received - Target: '" << targetList << "', Message: '" << msg << "'" << std::endl;
     
     Client &client = clients[client_fd];
     
-    if (target.empty() || msg.empty()) {
+    if (targetList.empty() || msg.empty()) {
         // Можно залогировать ошибку, но не отправлять ответ клиенту.
         std::cerr << "NOTICE: Not enough parameters from " << client.getNickname() << std::endl;
         return;
     }
-    
-    if (target[0] == '#' || target[0] == '&') {
-        if (channels.find(target) != channels.end()) {
-            if (!channels[target].isMember(client_fd)) {
+
+    std::vector<std::string> targets = splitCommaList(targetList);
+    if (targets.size() > TARGMAX) {
+        std::cerr << "NOTICE: Too many targets from " << client.getNickname() << std::endl;
+        return;
+    }
+
+    std::string head = ":" + client.getNickname() + "!" + client.getUsername() + "@localhost NOTICE ";
+    std::string tail = " :" + msg + "\r\n";
+    std::set<std::string> seen;
+
+    for (size_t i = 0; i < targets.size(); i++) {
+        const std::string &target = targets[i];
+        if (!seen.insert(target).second) {
+            continue;
+        }
+
+        if (target[0] == '#' || target[0] == '&') {
+            ChannelMap::iterator chanIt = channels.find(target);
+            if (chanIt == channels.end()) {
+                // Канал не существует – можно залогировать ошибку
+                std::cerr << "NOTICE: No such channel " << target << std::endl;
+                continue;
+            }
+            if (!chanIt->second.isMember(client_fd)) {
                 // Обычно для NOTICE ошибки не отправляются, но можно записать в лог.
                 std::cerr << "NOTICE: Client " << client.getNickname() << " not member of channel " << target << std::endl;
-                return;
+                continue;
             }
-            std::string senderPrefix = ":" + client.getNickname() + "!" + client.getUsername() + "@localhost";
-            std::string noticeMessage = senderPrefix + " NOTICE " + target + " :" + msg + "\r\n";
-            channels[target].broadcast(noticeMessage);
-        } else {
-            // Канал не существует – можно залогировать ошибку
-            std::cerr << "NOTICE: No such channel " << target << std::endl;
-        }
-    }
-    else {
-        int recipientFd = getFdByNickname(target);
-        if (recipientFd == -1) {
-            std::cerr << "NOTICE: No such nick " << target << std::endl;
-            return;
+            if (!chanIt->second.isOperator(client_fd) && chanIt->second.isBanned(client)) {
+                continue;
+            }
+            SharedLine line(head + target + tail);
+            if (loadLevel >= LOAD_OVERLOADED) {
+                loadStats.shed++;
+            } else {
+                sendChannelMessage(chanIt->second, line, -1);
+            }
+            propagateToChannel(chanIt->second, line.str(), -1);
         } else {
-            std::string senderPrefix = ":" + client.getNickname() + "!" + client.getUsername() + "@localhost";
-            std::string noticeMessage = senderPrefix + " NOTICE " + target + " :" + msg + "\r\n";
-            send(recipientFd, noticeMessage.c_str(), noticeMessage.size(), 0);
+            int recipientFd = getFdByNickname(target);
+            if (recipientFd == -1) {
+                std::cerr << "NOTICE: No such nick " << target << std::endl;
+                continue;
+            }
+            std::string noticeMessage = head + target + tail;
+            sendToClient(recipientFd, noticeMessage);
         }
     }
 }
@@ -488,15 +669,313 @@ void ChatServer::processQuitCommand(int client_fd, std::istringstream &iss) {
     }
     broadcastMessage += "\r\n";
     
-    for (std::map<std::string, Channel>::iterator it = channels.begin(); it != channels.end(); ++it) {
-        Channel &chan = it->second;
-        if (chan.isMember(client_fd)) {
-            chan.broadcast(broadcastMessage);
-            chan.removeMember(client_fd);
-        }
-    }
-    
+    notifyPeers(client_fd, broadcastMessage, true, NULL);
+    propagate(broadcastMessage, -1);
+    client.setQuitAnnounced(true);
+
     std::cout << "Client " << client.getNickname() << " quit: " << quitMessage << std::endl;
     
     handleClientDisconnect(client_fd);
 }
+
+
+void ChatServer::processStatsCommand(int client_fd, std::istringstream &iss) {
+    std::string query;
+    iss >> query;
+
+    Client &client = clients[client_fd];
+    std::string nick = client.getNickname();
+    if (query.empty()) {
+        std::string errorMsg = ":irc.localhost 461 " + nick + " STATS :Not enough parameters\r\n";
+        sendToClient(client_fd, errorMsg);
+        return;
+    }
+
+    if (query == "m" || query == "M") {
+        size_t clientBytes = 0;
+        for (std::map<int, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
+            clientBytes += it->second.memoryUsage();
+        }
+        size_t channelBytes = 0;
+        for (ChannelMap::iterator it = channels.begin(); it != channels.end(); ++it) {
+            channelBytes += it->second.memoryUsage();
+        }
+
+        std::ostringstream report;
+        report << ":irc.localhost 249 " << nick << " :Clients: " << clients.size()
+               << " using " << clientBytes << " bytes ("
+               << (clients.empty() ? 0 : clientBytes / clients.size()) << " per client)\r\n";
+        report << ":irc.localhost 249 " << nick << " :Channels: " << channels.size()
+               << " using " << channelBytes << " bytes ("
+               << (channels.empty() ? 0 : channelBytes / channels.size()) << " per channel)\r\n";
+        report << ":irc.localhost 249 " << nick << " :Pool: " << MemoryPool::getLiveObjects()
+               << " objects, " << MemoryPool::getLiveBytes() << " bytes live, "
+               << MemoryPool::getReservedBytes() << " bytes reserved, "
+               << MemoryPool::getLargeBytes() << " bytes oversized\r\n";
+        report << ":irc.localhost 249 " << nick << " :History: " << historyBytes << " of "
+               << HISTORY_TOTAL_BYTES << " bytes\r\n";
+        report << ":irc.localhost 249 " << nick << " :Output: " << outbox.pendingBytes()
+               << " bytes queued\r\n";
+        std::string response = report.str();
+        sendToClient(client_fd, response);
+    }
+
+    std::string endMsg = ":irc.localhost 219 " + nick + " " + query + " :End of /STATS report\r\n";
+    sendToClient(client_fd, endMsg);
+}
+
+
+void ChatServer::sendNames(int client_fd, Channel &chan) {
+    std::string reply;
+    chan.appendNamesReply(reply, clients[client_fd].getNickname());
+    sendToClient(client_fd, reply);
+}
+
+
+void ChatServer::processNamesCommand(int client_fd, std::istringstream &iss) {
+    std::string channelList;
+    iss >> channelList;
+
+    Client &client = clients[client_fd];
+    if (channelList.empty()) {
+        for (ChannelMap::iterator it = channels.begin(); it != channels.end(); ++it) {
+            if (it->second.isMember(client_fd)) {
+                sendNames(client_fd, it->second);
+            }
+        }
+        std::string endNames = ":irc.localhost 366 " + client.getNickname() + " * :End of /NAMES list\r\n";
+        sendToClient(client_fd, endNames);
+        return;
+    }
+
+    std::vector<std::string> names = splitCommaList(channelList);
+    if (names.size() > TARGMAX) {
+        std::string errorMsg = ":irc.localhost 407 " + client.getNickname() +
+                               " " + channelList + " :Too many targets\r\n";
+        sendToClient(client_fd, errorMsg);
+        return;
+    }
+
+    for (size_t i = 0; i < names.size(); i++) {
+        ChannelMap::iterator chanIt = channels.find(names[i]);
+        if (chanIt == channels.end()) {
+            std::string endNames = ":irc.localhost 366 " + client.getNickname() + " " + names[i] +
+                                   " :End of /NAMES list\r\n";
+            sendToClient(client_fd, endNames);
+            continue;
+        }
+        sendNames(client_fd, chanIt->second);
+    }
+}
+
+
+void ChatServer::processCapCommand(int client_fd, const std::string &param) {
+    Client &client = clients[client_fd];
+    std::string nick = client.hasNickname() ? client.getNickname() : "*";
+
+    std::istringstream iss(param);
+    std::string subcommand;
+    iss >> subcommand;
+    std::transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+
+    if (subcommand == "LS") {
+        std::string response = ":irc.localhost CAP " + nick + " LS :no-implicit-names message-tags draft/resume-0.5\r\n";
+        sendToClient(client_fd, response);
+    } else if (subcommand == "LIST") {
+        std::string enabled;
+        if (client.hasCapability(CAP_NO_IMPLICIT_NAMES))
+            enabled += "no-implicit-names ";
+        if (client.hasCapability(CAP_MESSAGE_TAGS))
+            enabled += "message-tags ";
+        if (client.hasCapability(CAP_RESUME))
+            enabled += "draft/resume-0.5 ";
+        if (!enabled.empty())
+            enabled.erase(enabled.size() - 1);
+        std::string response = ":irc.localhost CAP " + nick + " LIST :" + enabled + "\r\n";
+        sendToClient(client_fd, response);
+    } else if (subcommand == "REQ") {
+        std::string requested;
+        std::getline(iss, requested);
+        while (!requested.empty() && (requested[0] == ' ' || requested[0] == ':')) {
+            requested.erase(0, 1);
+        }
+
+        // A request is applied all-or-nothing, so validate every token first.
+        std::istringstream caps(requested);
+        std::vector<std::pair<unsigned int, bool> > changes;
+        std::string cap;
+        bool valid = !requested.empty();
+        while (valid && caps >> cap) {
+            bool enable = true;
+            if (cap[0] == '-') {
+                enable = false;
+                cap.erase(0, 1);
+            }
+            if (cap == "no-implicit-names")
+                changes.push_back(std::make_pair(CAP_NO_IMPLICIT_NAMES, enable));
+            else if (cap == "message-tags")
+                changes.push_back(std::make_pair(CAP_MESSAGE_TAGS, enable));
+            else if (cap == "draft/resume-0.5")
+                changes.push_back(std::make_pair(CAP_RESUME, enable));
+            else
+                valid = false;
+        }
+
+        if (!valid) {
+            std::string response = ":irc.localhost CAP " + nick + " NAK :" + requested + "\r\n";
+            sendToClient(client_fd, response);
+            return;
+        }
+        for (size_t i = 0; i < changes.size(); i++) {
+            client.setCapability(changes[i].first, changes[i].second);
+        }
+        std::string response = ":irc.localhost CAP " + nick + " ACK :" + requested + "\r\n";
+        sendToClient(client_fd, response);
+        if (client.hasSentWelcome() && client.hasCapability(CAP_RESUME) != !client.getResumeToken().empty()) {
+            issueResumeToken(client_fd);
+        }
+    } else if (subcommand == "END") {
+        return;
+    } else {
+        std::string errorMsg = ":irc.localhost 410 " + nick + " " + subcommand + " :Invalid CAP command\r\n";
+        sendToClient(client_fd, errorMsg);
+    }
+}
+
+
+// Records a channel message and delivers it to every local member except
+// except_fd. Members with message-tags get the msgid and time of the
+// history entry, so live lines can anchor CHATHISTORY requests.
+void ChatServer::sendChannelMessage(Channel &chan, const SharedLine &line, int except_fd) {
+    HistoryEntry entry = recordHistory(chan, line);
+    std::vector<int> plain;
+    std::vector<int> tagged;
+    for (FdSet::const_iterator it = chan.members.begin(); it != chan.members.end(); ++it) {
+        if (*it == except_fd || *it < 0)
+            continue;
+        std::map<int, Client>::iterator member = clients.find(*it);
+        if (member != clients.end() && member->second.hasCapability(CAP_MESSAGE_TAGS))
+            tagged.push_back(*it);
+        else
+            plain.push_back(*it);
+    }
+    sendToTargets(plain, line);
+    if (!tagged.empty())
+        sendToTargets(tagged, SharedLine(messageTags(entry.msgid, entry.time) + line.str()));
+}
+
+
+HistoryEntry ChatServer::recordHistory(Channel &chan, const SharedLine &line) {
+    HistoryEntry entry;
+    entry.msgid = nextMsgId++;
+    gettimeofday(&entry.time, NULL);
+    entry.line = line;
+    searchIndex.submit(entry.msgid, chan.name, entry.time, line);
+
+    ChannelHistory &history = chan.history;
+    bool hadHead = !history.empty();
+    unsigned long oldHead = history.oldestId();
+    size_t oldBytes = history.getBytes();
+
+    history.append(entry);
+
+    historyBytes = historyBytes - oldBytes + history.getBytes();
+    if (!hadHead || history.oldestId() != oldHead) {
+        if (hadHead)
+            historyHeads.erase(std::make_pair(oldHead, chan.name));
+        historyHeads.insert(std::make_pair(history.oldestId(), chan.name));
+    }
+
+    // The heads set is ordered by msgid, so its first element is always the
+    // oldest message held anywhere on the server.
+    while (historyBytes > HISTORY_TOTAL_BYTES && !historyHeads.empty()) {
+        ChannelMap::iterator it = channels.find(historyHeads.begin()->second);
+        if (it == channels.end()) {
+            historyHeads.erase(historyHeads.begin());
+            continue;
+        }
+        evictHistory(it->second);
+    }
+    return entry;
+}
+
+
+void ChatServer::evictHistory(Channel &chan) {
+    ChannelHistory &history = chan.history;
+    if (history.empty())
+        return;
+
+    historyHeads.erase(std::make_pair(history.oldestId(), chan.name));
+    historyBytes -= history.getBytes();
+    history.evictOldest();
+    historyBytes += history.getBytes();
+    if (!history.empty())
+        historyHeads.insert(std::make_pair(history.oldestId(), chan.name));
+}
+
+
+void ChatServer::processChatHistoryCommand(int client_fd, std::istringstream &iss) {
+    std::string subcommand, target, refToken, limitToken;
+    iss >> subcommand >> target >> refToken >> limitToken;
+    std::transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+
+    Client &client = clients[client_fd];
+    if (subcommand.empty() || target.empty() || refToken.empty() || limitToken.empty()) {
+        std::string errorMsg = ":irc.localhost FAIL CHATHISTORY NEED_MORE_PARAMS " + subcommand +
+                               " :Missing parameters\r\n";
+        sendToClient(client_fd, errorMsg);
+        return;
+    }
+
+    if (subcommand != "LATEST" && subcommand != "BEFORE" && subcommand != "AFTER") {
+        std::string errorMsg = ":irc.localhost FAIL CHATHISTORY INVALID_PARAMS " + subcommand +
+                               " :Unknown subcommand\r\n";
+        sendToClient(client_fd, errorMsg);
+        return;
+    }
+
+    ChannelMap::iterator chanIt = channels.find(target);
+    if (chanIt == channels.end() || !chanIt->second.isMember(client_fd)) {
+        std::string errorMsg = ":irc.localhost FAIL CHATHISTORY INVALID_TARGET " + subcommand + " " +
+                               target + " :Messages could not be retrieved\r\n";
+        sendToClient(client_fd, errorMsg);
+        return;
+    }
+
+    HistoryRef ref;
+    bool latestAll = (subcommand == "LATEST" && refToken == "*");
+    if (!latestAll && !parseHistoryRef(refToken, ref)) {
+        std::string errorMsg = ":irc.localhost FAIL CHATHISTORY INVALID_PARAMS " + subcommand + " " +
+                               refToken + " :Invalid message reference\r\n";
+        sendToClient(client_fd, errorMsg);
+        return;
+    }
+
+    long limit = std::strtol(limitToken.c_str(), NULL, 10);
+    if (limit <= 0) {
+        std::string errorMsg = ":irc.localhost FAIL CHATHISTORY INVALID_PARAMS " + subcommand + " " +
+                               limitToken + " :Invalid limit\r\n";
+        sendToClient(client_fd, errorMsg);
+        return;
+    }
+    if (limit > HISTORY_MAX_MESSAGES)
+        limit = HISTORY_MAX_MESSAGES;
+
+    std::vector<HistoryEntry> entries;
+    const ChannelHistory &history = chanIt->second.history;
+    if (subcommand == "LATEST")
+        history.latest(latestAll ? NULL : &ref, limit, entries);
+    else if (subcommand == "BEFORE")
+        history.before(ref, limit, entries);
+    else
+        history.after(ref, limit, entries);
+
+    bool tags = client.hasCapability(CAP_MESSAGE_TAGS);
+    std::string out;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (tags)
+            out += messageTags(entries[i].msgid, entries[i].time);
+        out += entries[i].line.str();
+    }
+    sendToClient(client_fd, out);
+}
\ No newline at end of file
@@ -0,0 +1,300 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <unistd.h>
+#include "../ChatServer.hpp"
+
+// Regression tests for server state that is hard to reach from a socket.
+// Each test drives in-memory connections and then inspects the server
+// through ServerTest, a friend of ChatServer. Tests run in a scratch
+// directory so snapshot files never touch the working tree.
+
+#define TEST_PASSWORD "test"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                           \
+    do {                                                                                      \
+        if (!(cond)) {                                                                        \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+            failures++;                                                                       \
+        }                                                                                     \
+    } while (0)
+
+class ServerTest {
+public:
+    static int connect(ChatServer &server, const std::string &nick) {
+        int id = server.openMemoryConnection();
+        server.feed(id, "PASS " TEST_PASSWORD "\r\nNICK " + nick + "\r\nUSER " + nick + " 0 * :test\r\n");
+        server.takeOutput(id);
+        return id;
+    }
+
+    // Channels restored from a snapshot have no members; the reclaim sweep
+    // must keep them however long they stay empty.
+    static void restoredChannelSurvivesReclaim() {
+        {
+            ChatServer before(TEST_PASSWORD);
+            before.startInProcess();
+            int id = connect(before, "keeper");
+            before.feed(id, "JOIN #keep\r\nTOPIC #keep :kept across restarts\r\n");
+            CHECK(before.writeSnapshotFile(before.serializeChannels()));
+        }
+
+        ChatServer after(TEST_PASSWORD);
+        after.startInProcess();
+        after.loadSnapshot();
+        int id = connect(after, "passer");
+        after.feed(id, "JOIN #gone\r\nPART #gone\r\n");
+        CHECK(after.channels.count("#keep") == 1);
+        CHECK(after.channels.count("#gone") == 1);
+
+        after.reclaimState();
+        for (ChannelMap::iterator it = after.channels.begin(); it != after.channels.end(); ++it)
+            it->second.emptySince = time(NULL) - CHANNEL_EMPTY_TTL - 1;
+        after.reclaimState();
+
+        CHECK(after.channels.count("#keep") == 1);
+        CHECK(after.channels.count("#keep") && after.channels["#keep"].getTopic() == "kept across restarts");
+        CHECK(after.channels.count("#gone") == 0);
+        unlink(SNAPSHOT_FILE);
+    }
+
+    // A hot upgrade must keep resume tokens working and signon times intact.
+    static void upgradeKeepsResumeState() {
+        ChatServer before(TEST_PASSWORD);
+        before.startInProcess();
+        int id = before.openMemoryConnection();
+        before.feed(id, "CAP REQ :draft/resume-0.5\r\nPASS " TEST_PASSWORD "\r\nNICK resumer\r\n"
+                        "USER resumer 0 * :test\r\nCAP END\r\n");
+        std::string token = before.clients[id].getResumeToken();
+        before.clients[id].setSignonTime(1234567890);
+        CHECK(!token.empty());
+
+        std::vector<int> oldIds;
+        std::string blob = before.serializeUpgradeState(oldIds);
+        std::vector<int> newFds;
+        for (size_t i = 0; i < oldIds.size(); i++) {
+            int sv[2];
+            CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+            close(sv[1]);
+            newFds.push_back(sv[0]);
+        }
+
+        ChatServer after(TEST_PASSWORD);
+        after.startInProcess();
+        CHECK(after.restoreUpgradeState(blob, newFds));
+        CHECK(after.resumeTokens.count(token) == 1);
+        if (after.resumeTokens.count(token)) {
+            Client &client = after.clients[after.resumeTokens[token]];
+            CHECK(client.getNickname() == "resumer");
+            CHECK(client.getResumeToken() == token);
+            CHECK(client.getSignonTime() == 1234567890);
+        }
+        for (size_t i = 0; i < newFds.size(); i++)
+            close(newFds[i]);
+    }
+
+    // Parking and resuming over and over must reuse in-memory ids, which
+    // index the outbox's slot table, instead of growing it.
+    static void parkAndResumeReuseSlots() {
+        ChatServer server(TEST_PASSWORD);
+        server.startInProcess();
+        int watcher = connect(server, "watcher");
+        server.feed(watcher, "JOIN #park\r\n");
+        int id = server.openMemoryConnection();
+        server.feed(id, "CAP REQ :draft/resume-0.5\r\nPASS " TEST_PASSWORD "\r\nNICK parker\r\n"
+                        "USER parker 0 * :test\r\nCAP END\r\nJOIN #park\r\n");
+        server.takeOutput(watcher);
+
+        int highWater = 0;
+        for (int round = 0; round < 50; round++) {
+            std::string token = server.clients[id].getResumeToken();
+            CHECK(!token.empty());
+            server.closeConnection(id);
+            CHECK(server.parkedClients.size() == 1);
+            id = server.openMemoryConnection();
+            server.feed(id, "CAP REQ :draft/resume-0.5\r\nPASS " TEST_PASSWORD "\r\nRESUME " + token +
+                                "\r\nCAP END\r\n");
+            CHECK(server.parkedClients.empty());
+            CHECK(server.clients[id].getNickname() == "parker");
+            if (round == 0)
+                highWater = server.nextMemoryId;
+        }
+        CHECK(server.nextMemoryId == highWater);
+        CHECK(server.clients.size() == 2);
+        CHECK(server.channels["#park"].members.size() == 2);
+        CHECK(server.takeOutput(watcher).empty());
+    }
+
+    // CHATHISTORY anchored on the time tag a message was delivered with
+    // must leave that message out on both sides.
+    static void historyAnchorsOnOwnTimeTag() {
+        ChatServer server(TEST_PASSWORD);
+        server.startInProcess();
+        int writer = connect(server, "writer");
+        int reader = server.openMemoryConnection();
+        server.feed(reader, "CAP REQ :message-tags\r\nPASS " TEST_PASSWORD "\r\nNICK reader\r\n"
+                            "USER reader 0 * :test\r\nCAP END\r\n");
+        server.feed(writer, "JOIN #hist\r\n");
+        server.feed(reader, "JOIN #hist\r\n");
+        server.takeOutput(reader);
+
+        server.feed(writer, "PRIVMSG #hist :first\r\n");
+        usleep(2000);
+        server.feed(writer, "PRIVMSG #hist :middle\r\n");
+        usleep(2000);
+        server.feed(writer, "PRIVMSG #hist :last\r\n");
+
+        std::string live = server.takeOutput(reader);
+        size_t middle = live.find(":middle");
+        CHECK(middle != std::string::npos);
+        if (middle == std::string::npos)
+            return;
+        size_t start = live.find("time=", live.rfind('\n', middle) + 1) + 5;
+        std::string stamp = live.substr(start, live.find(' ', start) - start);
+
+        server.feed(reader, "CHATHISTORY AFTER #hist timestamp=" + stamp + " 10\r\n");
+        std::string after = server.takeOutput(reader);
+        CHECK(after.find(":last") != std::string::npos);
+        CHECK(after.find(":middle") == std::string::npos);
+
+        server.feed(reader, "CHATHISTORY BEFORE #hist timestamp=" + stamp + " 10\r\n");
+        std::string before = server.takeOutput(reader);
+        CHECK(before.find(":first") != std::string::npos);
+        CHECK(before.find(":middle") == std::string::npos);
+    }
+
+    // NICK and QUIT reach peers through the joined-channel index, once each,
+    // and leave neither memberships nor invites behind.
+    static void peersFollowJoinedChannels() {
+        ChatServer server(TEST_PASSWORD);
+        server.startInProcess();
+        int mover = connect(server, "mover");
+        int peer = connect(server, "peer");
+        int stranger = connect(server, "stranger");
+        server.feed(mover, "JOIN #one\r\nJOIN #two\r\n");
+        server.feed(peer, "JOIN #one\r\nJOIN #two\r\n");
+        server.feed(stranger, "JOIN #three\r\n");
+        server.feed(mover, "INVITE stranger #one\r\n");
+        CHECK(server.joinedChannels[mover].size() == 2);
+        CHECK(server.invitesByNick.count("stranger") == 1);
+        server.takeOutput(peer);
+        server.takeOutput(stranger);
+
+        server.feed(mover, "NICK shaker\r\n");
+        std::string seen = server.takeOutput(peer);
+        CHECK(seen.find("NICK") != std::string::npos && seen.find("NICK") == seen.rfind("NICK"));
+        CHECK(server.takeOutput(stranger).empty());
+
+        server.feed(stranger, "NICK wanderer\r\n");
+        CHECK(server.invitesByNick.count("stranger") == 0);
+        CHECK(server.channels["#one"].invitedUsers.empty());
+
+        server.feed(mover, "QUIT :bye\r\n");
+        seen = server.takeOutput(peer);
+        CHECK(seen.find("QUIT") != std::string::npos && seen.find("QUIT") == seen.rfind("QUIT"));
+        CHECK(server.joinedChannels.count(mover) == 0);
+        CHECK(!server.channels["#one"].isMember(mover) && !server.channels["#two"].isMember(mover));
+        CHECK(server.joinedChannels[peer].size() == 2);
+    }
+
+    static std::string readFile(const char *path) {
+        std::ifstream in(path, std::ios::binary);
+        std::ostringstream data;
+        data << in.rdbuf();
+        return data.str();
+    }
+
+    static size_t occurrences(const std::string &text, const std::string &needle) {
+        size_t count = 0;
+        for (size_t at = text.find(needle); at != std::string::npos; at = text.find(needle, at + 1))
+            count++;
+        return count;
+    }
+
+    // Capture records a line when its bytes arrive, not when the loop gets
+    // round to running it, and records it only once.
+    static void captureRecordsOnArrival() {
+        {
+            ChatServer server(TEST_PASSWORD);
+            server.startInProcess();
+            server.enableCapture("capture.bin");
+            int id = connect(server, "talker");
+            server.handleInput(id, "PRIVMSG talker :early\r\nPRIVMSG talker :partial");
+            server.capture.flush();
+            std::string captured = readFile("capture.bin");
+            CHECK(occurrences(captured, "PRIVMSG talker :early") == 1);
+            CHECK(occurrences(captured, ":early\r") == 0);
+            CHECK(occurrences(captured, ":partial") == 0);
+            CHECK(server.clients[id].hasLine());
+
+            server.feed(id, "\r\n");
+            server.capture.flush();
+            captured = readFile("capture.bin");
+            CHECK(occurrences(captured, "PRIVMSG talker :early") == 1);
+            CHECK(occurrences(captured, "PRIVMSG talker :partial") == 1);
+            CHECK(!server.clients[id].hasLine());
+        }
+        unlink("capture.bin");
+    }
+
+    // Changes past the MODES= limit in 005 are refused out loud.
+    static void extraModeChangesAreReported() {
+        ChatServer server(TEST_PASSWORD);
+        server.startInProcess();
+        int id = server.openMemoryConnection();
+        server.feed(id, "PASS " TEST_PASSWORD "\r\nNICK moder\r\nUSER moder 0 * :test\r\n");
+        std::ostringstream limit;
+        limit << "MODES=" << MAX_MODE_CHANGES << " ";
+        CHECK(server.takeOutput(id).find(limit.str()) != std::string::npos);
+
+        server.feed(id, "JOIN #modes\r\n");
+        server.takeOutput(id);
+        server.feed(id, "MODE #modes +itbbbbb a!*@* b!*@* c!*@* d!*@* e!*@*\r\n");
+        std::string reply = server.takeOutput(id);
+        CHECK(reply.find("FAIL MODE TOO_MANY_CHANGES #modes") != std::string::npos);
+        CHECK(reply.find(" 1 ignored") != std::string::npos);
+        CHECK(server.channels["#modes"].bans.size() == 4);
+    }
+};
+
+struct TestCase {
+    const char *name;
+    void (*run)();
+};
+
+int main() {
+    char scratch[] = "/tmp/ircserv_test.XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) < 0) {
+        std::perror("scratch directory");
+        return 1;
+    }
+
+    // The server logs every connection to std::cout; keep the report readable.
+    std::ostream console(std::cout.rdbuf());
+    std::ofstream quiet("/dev/null");
+    std::cout.rdbuf(quiet.rdbuf());
+
+    const TestCase tests[] = {
+        {"restored channel survives reclaim", ServerTest::restoredChannelSurvivesReclaim},
+        {"upgrade keeps resume state", ServerTest::upgradeKeepsResumeState},
+        {"park and resume reuse slots", ServerTest::parkAndResumeReuseSlots},
+        {"history anchors on own time tag", ServerTest::historyAnchorsOnOwnTimeTag},
+        {"peers follow joined channels", ServerTest::peersFollowJoinedChannels},
+        {"capture records on arrival", ServerTest::captureRecordsOnArrival},
+        {"extra mode changes are reported", ServerTest::extraModeChangesAreReported},
+    };
+    size_t count = sizeof(tests) / sizeof(tests[0]);
+    for (size_t i = 0; i < count; i++) {
+        int before = failures;
+        tests[i].run();
+        console << (failures == before ? "ok   " : "FAIL ") << tests[i].name << std::endl;
+    }
+    rmdir(scratch);
+    console << (failures ? "FAILED" : "all tests passed") << std::endl;
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../ChatServer.hpp"
+#include "harness.hpp"
+
+// Measures how long light users wait while another client pipelines as
+// fast as TCP lets it. The server runs in this process on a loopback port.
+// Light clients take turns sending a PING and waiting for the PONG, first
+// with nobody else active and then while the pipeliner floods a channel
+// of its own. Round-trip percentiles are reported for both phases.
+
+#define FAIR_PASSWORD "fair"
+#define PIPELINE_BATCH 5000
+
+static volatile bool pipelining = false;
+static volatile unsigned long pipelinedLines = 0;
+
+static void *serve(void *arg) {
+    static_cast<ChatServer *>(arg)->run();
+    return NULL;
+}
+
+static int connectClient(int port, const std::string &nick) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        std::cerr << "Cannot connect to port " << port << std::endl;
+        std::exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    std::string input;
+    sendAll(fd, "PASS " FAIR_PASSWORD "\r\nNICK " + nick + "\r\nUSER " + nick + " 0 * :fair\r\n");
+    waitFor(fd, input, " 001 ");
+    return fd;
+}
+
+static void *pipeline(void *arg) {
+    int fd = *static_cast<int *>(arg);
+    std::string batch;
+    for (int i = 0; i < PIPELINE_BATCH; i++)
+        batch += "PRIVMSG #pipeline :pipelined line\r\n";
+    while (pipelining) {
+        if (!sendAll(fd, batch))
+            break;
+        pipelinedLines += PIPELINE_BATCH;
+    }
+    return NULL;
+}
+
+static void probe(const std::vector<int> &light, double seconds, std::vector<double> &samples) {
+    std::vector<std::string> inputs(light.size());
+    double stop = nowUs() + seconds * 1e6;
+    for (unsigned long round = 0; nowUs() < stop; round++) {
+        for (size_t i = 0; i < light.size(); i++) {
+            std::ostringstream token;
+            token << "fair-" << round << "-" << i;
+            double start = nowUs();
+            sendAll(light[i], "PING " + token.str() + "\r\n");
+            if (!waitFor(light[i], inputs[i], token.str()))
+                return;
+            samples.push_back(nowUs() - start);
+        }
+    }
+}
+
+static void report(std::ostream &out, const char *phase, std::vector<double> &samples) {
+    std::sort(samples.begin(), samples.end());
+    out << phase << ": " << samples.size() << " probes";
+    if (!samples.empty()) {
+        out << ", p50 " << percentile(samples, 0.50) << " us, p99 " << percentile(samples, 0.99)
+            << " us, p999 " << percentile(samples, 0.999) << " us, max " << samples.back() << " us";
+    }
+    out << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    size_t lightCount = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 20;
+    double seconds = argc > 2 ? std::strtod(argv[2], NULL) : 5;
+    int port = argc > 3 ? std::atoi(argv[3]) : 6690;
+    if (lightCount == 0 || seconds <= 0) {
+        std::cerr << "Usage: ./ircfair [light clients] [seconds per phase] [port]" << std::endl;
+        return 2;
+    }
+
+    // The server logs every connection to std::cout; keep the report readable.
+    std::ostream console(std::cout.rdbuf());
+    std::ofstream quiet("/dev/null");
+    std::cout.rdbuf(quiet.rdbuf());
+
+    std::ostringstream spec;
+    spec << "127.0.0.1:" << port;
+    ChatServer *server = new ChatServer(FAIR_PASSWORD);
+    if (!server->listenOn(spec.str()))
+        return 1;
+    server->startInProcess();
+    pthread_t serverThread;
+    pthread_create(&serverThread, NULL, serve, server);
+
+    std::vector<int> light;
+    for (size_t i = 0; i < lightCount; i++) {
+        std::ostringstream nick;
+        nick << "light" << i;
+        light.push_back(connectClient(port, nick.str()));
+    }
+    int heavy = connectClient(port, "heavy");
+    std::string heavyInput;
+    sendAll(heavy, "JOIN #pipeline\r\n");
+    waitFor(heavy, heavyInput, " 366 ");
+
+    std::vector<double> samples;
+    probe(light, seconds, samples);
+    report(console, "idle", samples);
+
+    pipelining = true;
+    pthread_t pipelineThread;
+    pthread_create(&pipelineThread, NULL, pipeline, &heavy);
+    samples.clear();
+    double start = nowUs();
+    probe(light, seconds, samples);
+    double elapsed = (nowUs() - start) / 1e6;
+    report(console, "pipelined", samples);
+    console << "pipeliner: " << pipelinedLines << " lines written in " << elapsed << " s ("
+            << pipelinedLines / elapsed << " lines/s)" << std::endl;
+
+    pipelining = false;
+    shutdown(heavy, SHUT_RDWR);
+    pthread_join(pipelineThread, NULL);
+    std::cout.rdbuf(console.rdbuf());
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <sys/time.h>
+#include "../Framing.hpp"
+
+// Compares the framing kernels on bursty multi-line input. A corpus of
+// client traffic is cut into chunks of random size, as recv() would hand
+// them over, and each kernel frames and validates every chunk. "split" is
+// the framing ircserv did before the kernels: find('\n') and substr() on a
+// copy of the buffer for every line, with no validation. Every kernel must
+// agree with the scalar one on each line end and its flags.
+
+static double nowSeconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void appendText(std::string &line, size_t length) {
+    static const char *words[] = {"hello", "there", "the", "quick", "brown", "fox", "irc", "server",
+                                  "caf\xc3\xa9", "\xe2\x9c\x93", "\xf0\x9f\x98\x80", "na\xc3\xafve"};
+    // One line in ten carries UTF-8; the rest are plain ASCII.
+    size_t wordCount = std::rand() % 10 == 0 ? 12 : 8;
+    while (line.size() < length) {
+        line += words[std::rand() % wordCount];
+        line += ' ';
+    }
+}
+
+static std::string buildCorpus(size_t bytes) {
+    std::string corpus;
+    while (corpus.size() < bytes) {
+        std::string line;
+        int kind = std::rand() % 100;
+        if (kind < 20) {
+            line = "PING :token";
+        } else if (kind < 95) {
+            line = "PRIVMSG #channel :";
+            appendText(line, 20 + std::rand() % 380);
+        } else {
+            line = "NOTICE someone :";
+            appendText(line, 20 + std::rand() % 100);
+        }
+        int bad = std::rand() % 1000;
+        if (bad == 0)
+            line[line.size() / 2] = '\0';
+        else if (bad == 1)
+            line[line.size() / 2] = '\r';
+        else if (bad == 2)
+            line[line.size() / 2] = static_cast<char>(0xff);
+        corpus += line + "\r\n";
+    }
+    return corpus;
+}
+
+static std::vector<size_t> chunkSizes(size_t total) {
+    std::vector<size_t> sizes;
+    for (size_t used = 0; used < total;) {
+        size_t size = std::rand() % 4 == 0 ? 1 + std::rand() % 16384 : 1 + std::rand() % 1024;
+        if (size > total - used)
+            size = total - used;
+        sizes.push_back(size);
+        used += size;
+    }
+    return sizes;
+}
+
+static void report(const char *name, double seconds, size_t bytes, size_t lines, size_t flagged) {
+    std::cout << name << ": " << bytes / seconds / 1e6 << " MB/s, " << lines / seconds / 1e6
+              << " Mlines/s (" << lines << " lines, " << flagged << " flagged)" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 64;
+    int rounds = argc > 2 ? std::atoi(argv[2]) : 5;
+    if (megabytes == 0 || rounds <= 0) {
+        std::cerr << "Usage: ./ircframe [megabytes] [rounds]" << std::endl;
+        return 2;
+    }
+
+    std::srand(42);
+    std::string corpus = buildCorpus(megabytes * 1024 * 1024);
+    std::vector<size_t> sizes = chunkSizes(corpus.size());
+    size_t totalBytes = corpus.size() * rounds;
+    std::cout << corpus.size() << " bytes in " << sizes.size() << " chunks, " << rounds << " rounds"
+              << std::endl;
+
+    double start = nowSeconds();
+    size_t lines = 0;
+    for (int round = 0; round < rounds; round++) {
+        std::string buffer;
+        size_t offset = 0;
+        for (size_t c = 0; c < sizes.size(); c++) {
+            buffer.append(corpus, offset, sizes[c]);
+            offset += sizes[c];
+            while (true) {
+                std::string copy = buffer;
+                size_t pos = copy.find('\n');
+                if (pos == std::string::npos)
+                    break;
+                std::string line = copy.substr(0, pos);
+                buffer.erase(0, pos + 1);
+                lines++;
+            }
+        }
+    }
+    report("split", nowSeconds() - start, totalBytes, lines, 0);
+
+    std::vector<FrameKernel> kernels = frameKernels();
+    std::vector<LineEnd> reference;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        std::vector<LineEnd> ends;
+        ends.reserve(corpus.size() / 16);
+        double seconds = 0;
+        size_t flagged = 0;
+        for (int round = 0; round < rounds; round++) {
+            ends.clear();
+            FrameState state;
+            resetFrameState(state);
+            size_t offset = 0;
+            double roundStart = nowSeconds();
+            for (size_t c = 0; c < sizes.size(); c++) {
+                size_t first = ends.size();
+                kernels[k].scan(corpus.data() + offset, sizes[c], state, ends);
+                for (size_t i = first; i < ends.size(); i++)
+                    ends[i].offset += offset;
+                offset += sizes[c];
+            }
+            seconds += nowSeconds() - roundStart;
+        }
+        for (size_t i = 0; i < ends.size(); i++)
+            flagged += ends[i].flags != 0;
+        report(kernels[k].name, seconds, totalBytes, ends.size() * rounds, flagged);
+
+        if (k == 0) {
+            reference = ends;
+            continue;
+        }
+        for (size_t i = 0; i < ends.size() || i < reference.size(); i++) {
+            if (i >= ends.size() || i >= reference.size() || ends[i].offset != reference[i].offset ||
+                ends[i].flags != reference[i].flags) {
+                std::cerr << kernels[k].name << " disagrees with scalar at line " << i << std::endl;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
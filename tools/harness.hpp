@@ -0,0 +1,60 @@
+#pragma once
+#ifndef TOOLS_HARNESS_HPP
+#define TOOLS_HARNESS_HPP
+
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+// Helpers shared by the load tools that drive a server over real sockets.
+
+inline uint64_t nowUs() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+inline bool sendAll(int fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Reads until a line containing token arrives. Lines before it are dropped.
+inline bool waitFor(int fd, std::string &input, const std::string &token) {
+    char buffer[4096];
+    while (true) {
+        size_t end;
+        while ((end = input.find('\n')) != std::string::npos) {
+            bool found = input.substr(0, end).find(token) != std::string::npos;
+            input.erase(0, end + 1);
+            if (found)
+                return true;
+        }
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        input.append(buffer, n);
+    }
+}
+
+// Expects samples sorted ascending.
+inline double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    return sorted[static_cast<size_t>(p * (sorted.size() - 1))];
+}
+
+#endif
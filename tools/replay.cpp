@@ -0,0 +1,398 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../Serialize.hpp"
+#include "../Capture.hpp"
+#include "harness.hpp"
+
+// Re-drives a capture written by ircserv (IRCSERV_CAPTURE) against a
+// server, at the original pace scaled by -s, or as fast as possible with
+// -s 0. After each line it sends a PING probe; the matching PONG gives the
+// line's latency and is kept out of the recorded output. With -o, every
+// connection's output is written to <dir>/<connection>.out with message
+// tags stripped, so two builds can be compared with -c.
+
+#define PROBE_TOKEN "ircreplay-"
+#define DRAIN_TIMEOUT_US 5000000
+#define MAX_WAIT_MS 50
+
+struct Record {
+    uint64_t time;
+    uint32_t connection;
+    unsigned char type;
+    std::string data;
+};
+
+struct Connection {
+    int fd;
+    bool writeClosed;
+    std::string input;
+    std::deque<uint64_t> probes;
+    std::ofstream *output;
+};
+
+static int usage() {
+    std::cerr << "Usage: ./ircreplay <capture> <host:port> [-s speed] [-o outdir]\n"
+              << "       ./ircreplay -c <outdir> <outdir>" << std::endl;
+    return 2;
+}
+
+static bool loadCapture(const char *path, std::vector<Record> &records) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot open " << path << std::endl;
+        return false;
+    }
+    std::string blob((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (blob.size() < 4 || blob.compare(0, 4, CAPTURE_MAGIC) != 0) {
+        std::cerr << path << " is not an ircserv capture" << std::endl;
+        return false;
+    }
+    Reader in(blob.data() + 4, blob.size() - 4);
+
+    uint32_t version;
+    if (!in.getU32(version) || version != CAPTURE_VERSION) {
+        std::cerr << path << " is not an ircserv capture" << std::endl;
+        return false;
+    }
+    while (!in.atEnd()) {
+        Record rec;
+        if (!in.getU64(rec.time) || !in.getU32(rec.connection) || !in.getU8(rec.type) ||
+            !in.getBytes(rec.data)) {
+            break;
+        }
+        records.push_back(rec);
+    }
+    if (!in.atEnd()) {
+        std::cerr << "Truncated capture after " << records.size() << " records" << std::endl;
+    }
+    return true;
+}
+
+static int connectTo(const std::string &host, const std::string &port) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+        return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static std::string stripTags(const std::string &line) {
+    if (line.empty() || line[0] != '@')
+        return line;
+    size_t space = line.find(' ');
+    return space == std::string::npos ? std::string() : line.substr(space + 1);
+}
+
+class Replay {
+private:
+    std::map<uint32_t, Connection> conns;
+    std::string host;
+    std::string port;
+    std::string outDir;
+    std::vector<uint64_t> latencies;
+    uint64_t probeSeq;
+    size_t linesSent;
+    size_t bytesReceived;
+    size_t failures;
+
+    void closeConnection(Connection &conn) {
+        if (conn.fd >= 0)
+            close(conn.fd);
+        conn.fd = -1;
+        conn.probes.clear();
+        if (conn.output) {
+            delete conn.output;
+            conn.output = NULL;
+        }
+    }
+
+    void handleLine(Connection &conn, const std::string &line) {
+        if (line.find(" PONG ") != std::string::npos || line.compare(0, 5, "PONG ") == 0) {
+            if (line.find(PROBE_TOKEN) != std::string::npos && !conn.probes.empty()) {
+                latencies.push_back(nowUs() - conn.probes.front());
+                conn.probes.pop_front();
+                return;
+            }
+        }
+        if (conn.output)
+            *conn.output << stripTags(line) << '\n';
+    }
+
+    void readConnection(Connection &conn) {
+        char buffer[65536];
+        ssize_t n = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            closeConnection(conn);
+            return;
+        }
+        bytesReceived += n;
+        conn.input.append(buffer, n);
+        size_t start = 0, pos;
+        while ((pos = conn.input.find('\n', start)) != std::string::npos) {
+            size_t end = pos > start && conn.input[pos - 1] == '\r' ? pos - 1 : pos;
+            handleLine(conn, conn.input.substr(start, end - start));
+            start = pos + 1;
+        }
+        conn.input.erase(0, start);
+    }
+
+    void dispatch(const Record &rec) {
+        if (rec.type == CAPTURE_OPEN || conns.find(rec.connection) == conns.end()) {
+            Connection conn;
+            conn.fd = connectTo(host, port);
+            conn.writeClosed = false;
+            conn.output = NULL;
+            if (conn.fd < 0) {
+                failures++;
+            } else if (!outDir.empty()) {
+                std::ostringstream path;
+                path << outDir << "/" << rec.connection << ".out";
+                conn.output = new std::ofstream(path.str().c_str());
+            }
+            std::map<uint32_t, Connection>::iterator old = conns.find(rec.connection);
+            if (old != conns.end())
+                closeConnection(old->second);
+            conns[rec.connection] = conn;
+        }
+        Connection &conn = conns[rec.connection];
+        if (conn.fd < 0 || conn.writeClosed)
+            return;
+
+        if (rec.type == CAPTURE_LINE) {
+            std::ostringstream probe;
+            probe << rec.data << "\r\nPING :" << PROBE_TOKEN << ++probeSeq << "\r\n";
+            conn.probes.push_back(nowUs());
+            if (!sendAll(conn.fd, probe.str())) {
+                failures++;
+                closeConnection(conn);
+                return;
+            }
+            linesSent++;
+        } else if (rec.type == CAPTURE_CLOSE) {
+            shutdown(conn.fd, SHUT_WR);
+            conn.writeClosed = true;
+        }
+    }
+
+    bool pollOnce(int timeoutMs) {
+        std::vector<pollfd> pfds;
+        std::vector<Connection *> owners;
+        for (std::map<uint32_t, Connection>::iterator it = conns.begin(); it != conns.end(); ++it) {
+            if (it->second.fd < 0)
+                continue;
+            pollfd pfd;
+            pfd.fd = it->second.fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            pfds.push_back(pfd);
+            owners.push_back(&it->second);
+        }
+        if (pfds.empty()) {
+            if (timeoutMs > 0)
+                usleep(timeoutMs * 1000);
+            return false;
+        }
+        if (poll(&pfds[0], pfds.size(), timeoutMs) <= 0)
+            return true;
+        for (size_t i = 0; i < pfds.size(); i++) {
+            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                readConnection(*owners[i]);
+        }
+        return true;
+    }
+
+    bool awaitingProbes() const {
+        for (std::map<uint32_t, Connection>::const_iterator it = conns.begin(); it != conns.end(); ++it) {
+            if (it->second.fd >= 0 && !it->second.probes.empty())
+                return true;
+        }
+        return false;
+    }
+
+    static uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+        if (sorted.empty())
+            return 0;
+        size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+        return sorted[index];
+    }
+
+public:
+    Replay(const std::string &h, const std::string &p, const std::string &dir)
+        : host(h), port(p), outDir(dir), probeSeq(0), linesSent(0), bytesReceived(0), failures(0) {}
+
+    ~Replay() {
+        for (std::map<uint32_t, Connection>::iterator it = conns.begin(); it != conns.end(); ++it)
+            closeConnection(it->second);
+    }
+
+    void run(const std::vector<Record> &records, double speed) {
+        uint64_t start = nowUs();
+        uint64_t base = records.empty() ? 0 : records[0].time;
+        size_t next = 0;
+
+        while (next < records.size()) {
+            uint64_t now = nowUs();
+            while (next < records.size()) {
+                uint64_t offset = records[next].time > base ? records[next].time - base : 0;
+                uint64_t due = speed > 0 ? start + static_cast<uint64_t>(offset / speed) : now;
+                if (due > now)
+                    break;
+                dispatch(records[next++]);
+            }
+            int waitMs = 0;
+            if (next < records.size() && speed > 0) {
+                uint64_t offset = records[next].time > base ? records[next].time - base : 0;
+                uint64_t due = start + static_cast<uint64_t>(offset / speed);
+                now = nowUs();
+                waitMs = due > now ? static_cast<int>(std::min<uint64_t>((due - now) / 1000, MAX_WAIT_MS)) : 0;
+            }
+            pollOnce(waitMs);
+        }
+
+        uint64_t sentAt = nowUs();
+        while (awaitingProbes() && nowUs() - sentAt < DRAIN_TIMEOUT_US)
+            pollOnce(MAX_WAIT_MS);
+        uint64_t elapsed = nowUs() - start;
+
+        // Late output still lands in the files before the report.
+        uint64_t settle = nowUs();
+        while (nowUs() - settle < 200000 && pollOnce(MAX_WAIT_MS))
+            ;
+
+        std::sort(latencies.begin(), latencies.end());
+        size_t lost = linesSent - latencies.size();
+        double seconds = elapsed / 1e6;
+        std::cout << "connections     " << conns.size() << "\n"
+                  << "lines sent      " << linesSent << "\n"
+                  << "bytes received  " << bytesReceived << "\n"
+                  << "elapsed         " << seconds << " s\n"
+                  << "throughput      " << (seconds > 0 ? linesSent / seconds : 0) << " lines/s\n"
+                  << "latency p50     " << percentile(latencies, 0.50) << " us\n"
+                  << "latency p90     " << percentile(latencies, 0.90) << " us\n"
+                  << "latency p99     " << percentile(latencies, 0.99) << " us\n"
+                  << "latency max     " << (latencies.empty() ? 0 : latencies.back()) << " us\n"
+                  << "unanswered      " << lost << "\n"
+                  << "connect errors  " << failures << std::endl;
+    }
+};
+
+
+// Compares the per-connection outputs of two replays and reports the first
+// differing line of each connection.
+static int compareOutputs(const std::string &left, const std::string &right) {
+    DIR *dir = opendir(left.c_str());
+    if (!dir) {
+        std::cerr << "Cannot open " << left << std::endl;
+        return 2;
+    }
+    std::vector<std::string> names;
+    for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".out") == 0)
+            names.push_back(name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    size_t differing = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        std::ifstream a((left + "/" + names[i]).c_str());
+        std::ifstream b((right + "/" + names[i]).c_str());
+        if (!b) {
+            std::cout << names[i] << ": missing in " << right << std::endl;
+            differing++;
+            continue;
+        }
+        std::string la, lb;
+        size_t lineNo = 0;
+        while (true) {
+            bool moreA = static_cast<bool>(std::getline(a, la));
+            bool moreB = static_cast<bool>(std::getline(b, lb));
+            lineNo++;
+            if (!moreA && !moreB)
+                break;
+            if (moreA != moreB || la != lb) {
+                std::cout << names[i] << ":" << lineNo << "\n  - " << (moreA ? la : "<eof>")
+                          << "\n  + " << (moreB ? lb : "<eof>") << std::endl;
+                differing++;
+                break;
+            }
+        }
+    }
+    std::cout << differing << " of " << names.size() << " connections differ" << std::endl;
+    return differing ? 1 : 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    if (argc == 4 && std::string(argv[1]) == "-c")
+        return compareOutputs(argv[2], argv[3]);
+    if (argc < 3)
+        return usage();
+
+    double speed = 1.0;
+    std::string outDir;
+    for (int i = 3; i < argc; i++) {
+        std::string opt = argv[i];
+        if (opt == "-s" && i + 1 < argc) {
+            speed = std::strtod(argv[++i], NULL);
+        } else if (opt == "-o" && i + 1 < argc) {
+            outDir = argv[++i];
+        } else {
+            return usage();
+        }
+    }
+    if (!outDir.empty() && mkdir(outDir.c_str(), 0755) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        return 1;
+    }
+
+    std::string target = argv[2];
+    size_t colon = target.rfind(':');
+    if (colon == std::string::npos)
+        return usage();
+
+    std::vector<Record> records;
+    if (!loadCapture(argv[1], records))
+        return 1;
+
+    Replay replay(target.substr(0, colon), target.substr(colon + 1), outDir);
+    replay.run(records, speed);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <sys/time.h>
+#include "../ChatServer.hpp"
+
+// Drives libircserv in one process through in-memory connections: N
+// clients register, spread over C channels and each sends M channel
+// messages. Output is collected after every phase, and each phase's wall
+// time is reported.
+
+#define SIM_PASSWORD "sim"
+
+static double nowSeconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static size_t drain(ChatServer &server, const std::vector<int> &ids) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < ids.size(); i++)
+        bytes += server.takeOutput(ids[i]).size();
+    return bytes;
+}
+
+static void report(std::ostream &out, const char *phase, double seconds, size_t ops, size_t bytes) {
+    out << phase << ": " << ops << " ops in " << seconds << " s ("
+              << (seconds > 0 ? ops / seconds : 0) << " ops/s), " << bytes << " bytes out" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    size_t clients = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 100000;
+    size_t channels = argc > 2 ? std::strtoul(argv[2], NULL, 10) : 1000;
+    size_t messages = argc > 3 ? std::strtoul(argv[3], NULL, 10) : 10;
+    if (clients == 0 || channels == 0) {
+        std::cerr << "Usage: ./ircsim [clients] [channels] [messages per client]" << std::endl;
+        return 2;
+    }
+
+    // The server logs every connection to std::cout; keep the report readable.
+    std::ostream console(std::cout.rdbuf());
+    std::ofstream quiet("/dev/null");
+    std::cout.rdbuf(quiet.rdbuf());
+
+    ChatServer server(SIM_PASSWORD);
+    server.startInProcess();
+    std::vector<int> ids;
+    ids.reserve(clients);
+
+    double start = nowSeconds();
+    for (size_t i = 0; i < clients; i++) {
+        int id = server.openMemoryConnection();
+        std::ostringstream lines;
+        lines << "PASS " SIM_PASSWORD "\r\nNICK u" << i << "\r\nUSER u" << i << " 0 * :sim\r\n";
+        server.feed(id, lines.str());
+        ids.push_back(id);
+    }
+    size_t bytes = drain(server, ids);
+    report(console, "register", nowSeconds() - start, clients, bytes);
+
+    start = nowSeconds();
+    bytes = 0;
+    for (size_t i = 0; i < clients; i++) {
+        std::ostringstream line;
+        line << "JOIN #c" << i % channels << "\r\n";
+        server.feed(ids[i], line.str());
+        if (i % 1000 == 999)
+            bytes += drain(server, ids);
+    }
+    bytes += drain(server, ids);
+    report(console, "join", nowSeconds() - start, clients, bytes);
+
+    start = nowSeconds();
+    bytes = 0;
+    for (size_t round = 0; round < messages; round++) {
+        for (size_t i = 0; i < clients; i++) {
+            std::ostringstream line;
+            line << "PRIVMSG #c" << i % channels << " :message " << round << "\r\n";
+            server.feed(ids[i], line.str());
+        }
+        bytes += drain(server, ids);
+    }
+    report(console, "privmsg", nowSeconds() - start, clients * messages, bytes);
+
+    start = nowSeconds();
+    for (size_t i = 0; i < clients; i++)
+        server.feed(ids[i], "QUIT :done\r\n");
+    for (size_t i = 0; i < clients; i++)
+        server.closeConnection(ids[i]);
+    report(console, "quit", nowSeconds() - start, clients, 0);
+    std::cout.rdbuf(console.rdbuf());
+    return 0;
+}
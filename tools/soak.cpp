@@ -0,0 +1,396 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../ChatServer.hpp"
+#include "harness.hpp"
+
+// Measures how far one server scales by connection count. The server runs
+// in a child process on a loopback port, so its RSS, CPU time and wakeups
+// can be read from /proc apart from the load generator's. Idle registered
+// connections are ramped up to each step in turn. Each step records the
+// rate at which the ramp got connections accepted and registered, RSS per
+// connection, the server's CPU and wakeups over an idle period, and PRIVMSG
+// latency between two probe clients while a few background clients chat.
+// Progress goes to stderr; the report is one JSON object on stdout.
+
+#define SOAK_PASSWORD "soak"
+// Registrations in flight; staying under the listen backlog keeps the
+// accept queue from overflowing into resets.
+#define SOAK_WINDOW (LISTEN_BACKLOG / 2)
+#define SOAK_PER_ADDRESS 20000
+#define SOAK_STALL_SECONDS 10
+#define SOAK_FD_RESERVE 64
+#define SOAK_BACKGROUND 20
+#define SOAK_BACKGROUND_RATE 200
+#define SOAK_PROBES 200
+
+static volatile bool chatting = false;
+static std::vector<int> background;
+
+static std::string registration(const std::string &nick) {
+    return "PASS " SOAK_PASSWORD "\r\nNICK " + nick + "\r\nUSER " + nick + " 0 * :soak\r\n";
+}
+
+// Spreads connections over 127.0.0.x so no source address runs out of
+// ephemeral ports.
+static int openSocket(int port, size_t index, bool blocking) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (!blocking)
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + index / SOAK_PER_ADDRESS);
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int connectClient(int port, size_t index, const std::string &nick) {
+    int fd = openSocket(port, index, true);
+    std::string input;
+    if (fd < 0 || !sendAll(fd, registration(nick)) || !waitFor(fd, input, " 376 ")) {
+        std::cerr << "Cannot register " << nick << " on port " << port << std::endl;
+        std::exit(1);
+    }
+    return fd;
+}
+
+struct Registration {
+    int fd;
+    size_t index;
+    bool sent;
+    std::string input;
+};
+
+// Opens connections until idle holds target registered ones, keeping
+// SOAK_WINDOW registrations in flight.
+static bool ramp(int port, size_t target, std::vector<int> &idle, size_t &nextIndex, std::string &error) {
+    std::vector<Registration> window;
+    double lastProgress = nowUs();
+    while (idle.size() < target) {
+        while (window.size() < SOAK_WINDOW && idle.size() + window.size() < target) {
+            Registration reg;
+            reg.index = nextIndex++;
+            reg.fd = openSocket(port, reg.index, false);
+            reg.sent = false;
+            if (reg.fd < 0) {
+                error = std::string("connect: ") + strerror(errno);
+                return false;
+            }
+            window.push_back(reg);
+        }
+
+        std::vector<pollfd> pfds(window.size());
+        for (size_t i = 0; i < window.size(); i++) {
+            pfds[i].fd = window[i].fd;
+            pfds[i].events = window[i].sent ? POLLIN : POLLOUT;
+            pfds[i].revents = 0;
+        }
+        if (poll(&pfds[0], pfds.size(), 1000) < 0 && errno != EINTR) {
+            error = std::string("poll: ") + strerror(errno);
+            return false;
+        }
+
+        std::vector<Registration> waiting;
+        for (size_t i = 0; i < window.size(); i++) {
+            Registration &reg = window[i];
+            short revents = pfds[i].revents;
+            if ((revents & POLLOUT) && !reg.sent) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(reg.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                std::ostringstream nick;
+                nick << "soak" << reg.index;
+                if (err || !sendAll(reg.fd, registration(nick.str()))) {
+                    error = std::string("register: ") + strerror(err ? err : errno);
+                    return false;
+                }
+                reg.sent = true;
+            } else if (revents & (POLLIN | POLLERR | POLLHUP)) {
+                char buffer[4096];
+                ssize_t n = recv(reg.fd, buffer, sizeof(buffer), 0);
+                if (n <= 0) {
+                    error = n < 0 ? std::string("registration: ") + strerror(errno)
+                                  : "connection closed during registration";
+                    return false;
+                }
+                reg.input.append(buffer, n);
+                if (reg.input.find(" 376 ") != std::string::npos) {
+                    idle.push_back(reg.fd);
+                    lastProgress = nowUs();
+                    continue;
+                }
+            }
+            waiting.push_back(reg);
+        }
+        window.swap(waiting);
+        if (nowUs() - lastProgress > SOAK_STALL_SECONDS * 1e6) {
+            error = "registrations stalled";
+            return false;
+        }
+    }
+    return true;
+}
+
+static long readStatus(pid_t pid, const std::string &field) {
+    std::ostringstream path;
+    path << "/proc/" << pid << "/status";
+    std::ifstream in(path.str().c_str());
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.compare(0, field.size() + 1, field + ":") == 0)
+            return std::strtol(line.c_str() + field.size() + 1, NULL, 10);
+    }
+    return -1;
+}
+
+// User plus system time of every thread, from /proc/<pid>/stat.
+static double cpuSeconds(pid_t pid) {
+    std::ostringstream path;
+    path << "/proc/" << pid << "/stat";
+    std::ifstream in(path.str().c_str());
+    std::string stat;
+    std::getline(in, stat);
+    size_t close = stat.rfind(')');
+    if (close == std::string::npos)
+        return 0;
+    std::istringstream fields(stat.substr(close + 2));
+    std::string skip;
+    for (int i = 3; i < 14; i++)
+        fields >> skip;
+    unsigned long utime = 0, stime = 0;
+    fields >> utime >> stime;
+    return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// The thread-group leader is the server's event loop; each time it blocks
+// in poll() and is woken again counts as a voluntary switch.
+static long wakeups(pid_t pid) {
+    return readStatus(pid, "voluntary_ctxt_switches") + readStatus(pid, "nonvoluntary_ctxt_switches");
+}
+
+static void *chatter(void *) {
+    char buffer[65536];
+    for (size_t turn = 0; chatting; turn++) {
+        sendAll(background[turn % background.size()], "PRIVMSG #soak :background chatter\r\n");
+        for (size_t i = 0; i < background.size(); i++) {
+            while (recv(background[i], buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+            }
+        }
+        usleep(1000000 / SOAK_BACKGROUND_RATE);
+    }
+    return NULL;
+}
+
+static void probeLatency(int sender, int receiver, std::vector<double> &samples) {
+    std::string input;
+    for (int i = 0; i < SOAK_PROBES; i++) {
+        std::ostringstream token;
+        token << "soak-probe-" << i;
+        double start = nowUs();
+        sendAll(sender, "PRIVMSG soakprobe :" + token.str() + "\r\n");
+        if (!waitFor(receiver, input, token.str()))
+            return;
+        samples.push_back(nowUs() - start);
+        usleep(5000);
+    }
+}
+
+static std::vector<size_t> parseSteps(const std::string &list) {
+    std::vector<size_t> steps;
+    std::istringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        size_t step = std::strtoul(item.c_str(), NULL, 10);
+        if (step == 0)
+            return std::vector<size_t>();
+        steps.push_back(step);
+    }
+    std::sort(steps.begin(), steps.end());
+    return steps;
+}
+
+// Raises the open file limit towards want; returns the soft limit in effect.
+static size_t raiseFileLimit(size_t want) {
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < want) {
+        struct rlimit raised = limit;
+        raised.rlim_cur = raised.rlim_max = want;
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0)
+            limit = raised;
+    }
+    if (limit.rlim_max == RLIM_INFINITY || limit.rlim_max > want)
+        limit.rlim_cur = want;
+    else
+        limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    return limit.rlim_cur;
+}
+
+static pid_t startServer(int port) {
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+    std::ofstream quiet("/dev/null");
+    std::cout.rdbuf(quiet.rdbuf());
+    std::ostringstream spec;
+    spec << "127.0.0.1:" << port;
+    ChatServer *server = new ChatServer(SOAK_PASSWORD);
+    if (!server->listenOn(spec.str()))
+        _exit(1);
+    server->startInProcess();
+    server->run();
+    _exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<size_t> steps = parseSteps(argc > 1 ? argv[1] : "10000,50000,100000");
+    double idleSeconds = argc > 2 ? std::strtod(argv[2], NULL) : 5;
+    int port = argc > 3 ? std::atoi(argv[3]) : 6695;
+    if (steps.empty() || idleSeconds <= 0) {
+        std::cerr << "Usage: ./ircsoak [connections,connections,...] [idle seconds] [port]" << std::endl;
+        return 2;
+    }
+
+    size_t fixed = 2 + SOAK_BACKGROUND;
+    size_t fileLimit = raiseFileLimit(steps.back() + fixed + SOAK_FD_RESERVE);
+    size_t capacity = fileLimit > fixed + SOAK_FD_RESERVE ? fileLimit - fixed - SOAK_FD_RESERVE : 0;
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t server = startServer(port);
+    if (server < 0) {
+        perror("fork");
+        return 1;
+    }
+    for (int attempt = 0; ; attempt++) {
+        int fd = openSocket(port, 0, true);
+        if (fd >= 0) {
+            close(fd);
+            break;
+        }
+        if (attempt == 100 || waitpid(server, NULL, WNOHANG) != 0) {
+            std::cerr << "Server did not start on port " << port << std::endl;
+            kill(server, SIGKILL);
+            return 1;
+        }
+        usleep(50000);
+    }
+
+    size_t nextIndex = 0;
+    int sender = connectClient(port, nextIndex++, "soaksender");
+    int receiver = connectClient(port, nextIndex++, "soakprobe");
+    for (size_t i = 0; i < SOAK_BACKGROUND; i++) {
+        std::ostringstream nick;
+        nick << "soakchat" << i;
+        int fd = connectClient(port, nextIndex++, nick.str());
+        std::string input;
+        sendAll(fd, "JOIN #soak\r\n");
+        waitFor(fd, input, " 366 ");
+        background.push_back(fd);
+    }
+    usleep(500000);
+    long baselineRss = readStatus(server, "VmRSS");
+
+    std::ostringstream report;
+    report << "{\n  \"benchmark\": \"soak\",\n  \"server\": \"" SERVER_VERSION "\",\n"
+           << "  \"file_limit\": " << fileLimit << ",\n  \"idle_seconds\": " << idleSeconds << ",\n"
+           << "  \"probe_connections\": " << fixed << ",\n  \"baseline_rss_kb\": " << baselineRss << ",\n"
+           << "  \"steps\": [";
+
+    std::vector<int> idle;
+    std::string error;
+    for (size_t s = 0; s < steps.size(); s++) {
+        report << (s ? "," : "") << "\n    {\"connections\": " << steps[s];
+        if (!error.empty()) {
+            report << ", \"skipped\": \"earlier step failed\"}";
+            continue;
+        }
+        if (steps[s] > capacity) {
+            report << ", \"skipped\": \"RLIMIT_NOFILE is " << fileLimit << "\"}";
+            std::cerr << steps[s] << " connections: skipped, RLIMIT_NOFILE is " << fileLimit << std::endl;
+            continue;
+        }
+
+        size_t before = idle.size();
+        double start = nowUs();
+        bool ok = ramp(port, steps[s], idle, nextIndex, error);
+        double rampSeconds = (nowUs() - start) / 1e6;
+        report << ", \"reached\": " << idle.size() << ", \"ramp_seconds\": " << rampSeconds
+               << ", \"accepts_per_second\": " << (idle.size() - before) / rampSeconds;
+        if (!ok) {
+            report << ", \"error\": \"" << error << "\"}";
+            std::cerr << steps[s] << " connections: stopped at " << idle.size() << ", " << error << std::endl;
+            continue;
+        }
+
+        usleep(1000000);
+        long rss = readStatus(server, "VmRSS");
+        double cpuStart = cpuSeconds(server);
+        long wakeStart = wakeups(server);
+        usleep(static_cast<useconds_t>(idleSeconds * 1e6));
+        double cpu = cpuSeconds(server) - cpuStart;
+        long woken = wakeups(server) - wakeStart;
+
+        std::vector<double> samples;
+        chatting = true;
+        pthread_t chatThread;
+        pthread_create(&chatThread, NULL, chatter, NULL);
+        probeLatency(sender, receiver, samples);
+        chatting = false;
+        pthread_join(chatThread, NULL);
+        std::sort(samples.begin(), samples.end());
+
+        double rssPerConnection = (rss - baselineRss) * 1024.0 / idle.size();
+        report << ", \"rss_kb\": " << rss << ", \"rss_bytes_per_connection\": " << rssPerConnection
+               << ", \"idle_cpu_ms_per_second\": " << cpu * 1000 / idleSeconds
+               << ", \"idle_wakeups_per_second\": " << woken / idleSeconds
+               << ", \"cpu_us_per_wakeup\": " << (woken ? cpu * 1e6 / woken : 0)
+               << ", \"privmsg_samples\": " << samples.size()
+               << ", \"privmsg_p50_us\": " << percentile(samples, 0.50)
+               << ", \"privmsg_p99_us\": " << percentile(samples, 0.99)
+               << ", \"privmsg_max_us\": " << (samples.empty() ? 0 : samples.back()) << "}";
+        std::cerr << steps[s] << " connections: " << (idle.size() - before) / rampSeconds << " accepts/s, "
+                  << rssPerConnection << " bytes/connection, " << cpu * 1000 / idleSeconds
+                  << " ms CPU per idle second, p99 PRIVMSG " << percentile(samples, 0.99) << " us" << std::endl;
+    }
+    report << "\n  ]\n}\n";
+    std::cout << report.str();
+
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    return error.empty() ? 0 : 1;
+}